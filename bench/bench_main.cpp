@@ -0,0 +1,352 @@
+#include <stdlib.h>
+#include <string.h>
+#include <algorithm>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <omp.h>
+#include "json.h"
+#include "synthetic_data.hpp"
+#include "sparse_kmeans.hpp"
+#include "sparse_kmeans_tree.hpp"
+#include "compact_payload.hpp"
+
+// Reproducible micro and macro benchmarks over a synthetic corpus, results are
+// written as JSON so that runs of two releases can be diffed.
+
+struct BenchOptions {
+    SyntheticConfig data;
+    size_t queries;
+    int32_t k;
+    int32_t iterations;
+    int32_t max_node_size;
+    size_t train_size;
+    std::string filter;
+    std::string out;
+    std::string gen;
+
+    BenchOptions(): queries(1000), k(16), iterations(5), max_node_size(500), train_size(2000) {
+        data.n = 5000;
+        data.dim = 5000;
+    }
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static double elapsed_ns(Clock::time_point start) {
+    return std::chrono::duration<double, std::nano>(Clock::now() - start).count();
+}
+
+class BenchReport {
+public:
+    BenchReport(const BenchOptions& options): _options(options) {}
+
+    bool enabled(const std::string& name) const {
+        return this->_options.filter.empty() || name.find(this->_options.filter) != std::string::npos;
+    }
+
+    // a run of ops operations taking total_ns, latencies are optional per operation timings,
+    // extra fields are copied into the result
+    void add(const std::string& name, size_t ops, double total_ns, std::vector<double> latencies = std::vector<double>(), int32_t status = EXK_SUC,
+             const nlohmann::json& extra = nlohmann::json::object()) {
+        nlohmann::json r = extra;
+        r["name"] = name;
+        r["ops"] = ops;
+        r["total_ms"] = total_ns / 1e6;
+        r["ns_per_op"] = ops > 0 ? total_ns / ops : 0;
+        r["ops_per_sec"] = total_ns > 0 ? ops * 1e9 / total_ns : 0;
+        if (!latencies.empty()) {
+            std::sort(latencies.begin(), latencies.end());
+            r["p50_ns"] = latencies[latencies.size() / 2];
+            r["p99_ns"] = latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+        }
+        if (status == EXK_FAIL) {
+            r["status"] = "fail";
+        }
+        this->_results.push_back(r);
+        std::cerr << name << ": " << r["ns_per_op"] << " ns/op" << std::endl;
+    }
+
+    std::string dump() const {
+        const SyntheticConfig& d = this->_options.data;
+        nlohmann::json obj;
+        obj["config"] = {
+            {"n", d.n}, {"dim", d.dim}, {"nnz", d.nnz}, {"clusters", d.clusters},
+            {"zipf", d.zipf}, {"topic_rate", d.topic_rate}, {"seed", d.seed},
+            {"queries", this->_options.queries}, {"k", this->_options.k},
+            {"iterations", this->_options.iterations}, {"max_node_size", this->_options.max_node_size},
+            {"train_size", this->_options.train_size}
+        };
+        obj["threads"] = omp_get_max_threads();
+        obj["results"] = this->_results;
+        return obj.dump(2);
+    }
+
+private:
+    const BenchOptions& _options;
+    nlohmann::json _results = nlohmann::json::array();
+};
+
+static void bench_dot_kernels(BenchReport& report, const std::vector<const SPVEC*>& samples, const std::vector<const SPVEC*>& queries) {
+    DSVEC center(samples[0]->size());
+    center.clear();
+    for (size_t i = 0; i < std::min((size_t)100, samples.size()); i++) {
+        center += *samples[i];
+    }
+    CPVEC pruned = prune_center(center, 200, 0);
+
+    volatile TSVAL sink = 0;
+    if (report.enabled("micro/dot/inversed_dense_sparse_dot")) {
+        Clock::time_point start = Clock::now();
+        for (auto iter = queries.begin(); iter != queries.end(); iter++) {
+            sink = sink + inversed_dense_sparse_dot(center, **iter);
+        }
+        report.add("micro/dot/inversed_dense_sparse_dot", queries.size(), elapsed_ns(start));
+    }
+
+    if (report.enabled("micro/dot/dense_sparse_l2_distance_sq")) {
+        size_t n = std::min((size_t)100, queries.size());
+        Clock::time_point start = Clock::now();
+        for (size_t i = 0; i < n; i++) {
+            sink = sink + dense_sparse_l2_distance_sq(center, *queries[i]);
+        }
+        report.add("micro/dot/dense_sparse_l2_distance_sq", n, elapsed_ns(start));
+    }
+
+    if (report.enabled("micro/dot/sparse_sparse_dot")) {
+        Clock::time_point start = Clock::now();
+        for (auto iter = queries.begin(); iter != queries.end(); iter++) {
+            sink = sink + sparse_sparse_dot(pruned, **iter);
+        }
+        report.add("micro/dot/sparse_sparse_dot", queries.size(), elapsed_ns(start));
+    }
+}
+
+// configures the model for one of the center layouts
+static int32_t configure_layout(SparseKMeansModel& model, const std::string& layout) {
+    if (layout == "dim_major") {
+        return model.set_dimension_major(true);
+    } else if (layout == "pruned") {
+        return model.set_center_pruning(200);
+    } else if (layout == "inverted") {
+        model.set_center_pruning(200);
+        return model.set_inverted_index(true);
+    } else if (layout == "dim_major_fp16") {
+        model.set_dimension_major(true);
+        return model.set_center_precision(CENTER_FP16);
+    } else if (layout == "dim_major_bf16") {
+        model.set_dimension_major(true);
+        return model.set_center_precision(CENTER_BF16);
+    }
+
+    return EXK_SUC;
+}
+
+static void bench_predict(BenchReport& report, const BenchOptions& options,
+                          const std::vector<const SPVEC*>& train, const std::vector<const SPVEC*>& queries) {
+    const char* layouts[] = {"dense", "dim_major", "pruned", "inverted", "dim_major_fp16", "dim_major_bf16"};
+    for (int32_t l = 0; l < 6; l++) {
+        std::string name = std::string("micro/predict/") + layouts[l];
+        if (!report.enabled(name)) {
+            continue;
+        }
+
+        SparseKMeansModel model(options.k, options.iterations, true, "kmeans++");
+        model.set_seed(options.data.seed);
+        configure_layout(model, layouts[l]);
+        int32_t status = model.fit(train);
+
+        std::vector<double> latencies;
+        Clock::time_point start = Clock::now();
+        for (auto iter = queries.begin(); iter != queries.end(); iter++) {
+            Clock::time_point op = Clock::now();
+            model.predict(**iter);
+            latencies.push_back(elapsed_ns(op));
+        }
+        report.add(name, queries.size(), elapsed_ns(start), latencies, status);
+    }
+}
+
+static void bench_training(BenchReport& report, const BenchOptions& options, const std::vector<const SPVEC*>& train) {
+    if (!report.enabled("micro/train")) {
+        return;
+    }
+
+    // seeding alone is a fit without iterations
+    SparseKMeansModel seeding(options.k, 0, true, "kmeans++");
+    seeding.set_seed(options.data.seed);
+    Clock::time_point start = Clock::now();
+    int32_t status = seeding.fit(train);
+    double seeding_ns = elapsed_ns(start);
+    report.add("micro/train/seeding", train.size(), seeding_ns, std::vector<double>(), status);
+
+    // the E-step is a parallel predict over all the samples
+    start = Clock::now();
+    std::vector<int32_t> assignment(train.size());
+    #pragma omp parallel for
+    for (int32_t i = 0; i < train.size(); i++) {
+        assignment[i] = seeding.predict(*train[i]);
+    }
+    double e_step_ns = elapsed_ns(start);
+    report.add("micro/train/e_step", train.size(), e_step_ns);
+
+    // a second iteration adds one E-step and one M-step over the same seeding,
+    // the M-step is what remains
+    SparseKMeansModel single(options.k, 1, true, "kmeans++");
+    single.set_seed(options.data.seed);
+    start = Clock::now();
+    single.fit(train);
+    double single_ns = elapsed_ns(start);
+
+    SparseKMeansModel twice(options.k, 2, true, "kmeans++");
+    twice.set_seed(options.data.seed);
+    start = Clock::now();
+    status = twice.fit(train);
+    double twice_ns = elapsed_ns(start);
+    report.add("micro/train/m_step", train.size(), std::max(0.0, twice_ns - single_ns - e_step_ns), std::vector<double>(), status);
+
+    SparseKMeansModel full(options.k, options.iterations, true, "kmeans++");
+    full.set_seed(options.data.seed);
+    start = Clock::now();
+    status = full.fit(train);
+    report.add("micro/train/fit", train.size(), elapsed_ns(start), std::vector<double>(), status);
+}
+
+static void bench_tree(BenchReport& report, const BenchOptions& options, VectorBase& base,
+                       const std::vector<int32_t>& ids, const std::vector<const SPVEC*>& queries) {
+    if (!report.enabled("macro/tree")) {
+        return;
+    }
+
+    std::vector<const SPVEC*> samples = base.get_vectors(ids);
+    CompactPayLoad payload(&base, options.max_node_size);
+    SparseKMeansModel prototype(options.k, options.iterations, true, "kmeans++");
+    prototype.set_seed(options.data.seed);
+
+    // the peak of the node trainings held at once, dense centers and accumulators
+    // included, with one training per thread and then one at a time
+    Clock::time_point start = Clock::now();
+    SparseKMeansTree tree(&payload, samples, prototype, options.max_node_size);
+    report.add("macro/tree/build", samples.size(), elapsed_ns(start), std::vector<double>(), EXK_SUC,
+               {{"peak_bytes", tree.build_peak_bytes()}});
+
+    SparseKMeansModel serial(prototype);
+    serial.set_parallel_fits(1);
+    start = Clock::now();
+    SparseKMeansTree one_fit(&payload, samples, serial, options.max_node_size);
+    report.add("macro/tree/build_one_fit", samples.size(), elapsed_ns(start), std::vector<double>(), EXK_SUC,
+               {{"peak_bytes", one_fit.build_peak_bytes()}});
+
+    start = Clock::now();
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        tree.insert(*iter, base.at(*iter), 1.0);
+    }
+    report.add("macro/tree/insert", ids.size(), elapsed_ns(start));
+
+    std::vector<double> latencies;
+    start = Clock::now();
+    for (auto iter = queries.begin(); iter != queries.end(); iter++) {
+        Clock::time_point op = Clock::now();
+        tree.search_for_leaf(**iter);
+        latencies.push_back(elapsed_ns(op));
+    }
+    report.add("macro/tree/search_single", queries.size(), elapsed_ns(start), latencies);
+
+    start = Clock::now();
+    #pragma omp parallel for
+    for (int32_t i = 0; i < queries.size(); i++) {
+        tree.search_for_leaf(*queries[i]);
+    }
+    report.add("macro/tree/search_batch", queries.size(), elapsed_ns(start));
+}
+
+static int32_t parse_args(int argc, char** argv, BenchOptions& options) {
+    for (int32_t i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "missing value of " << arg << std::endl;
+            return EXK_FAIL;
+        }
+
+        const char* v = argv[++i];
+        if (arg == "--n") {
+            options.data.n = atol(v);
+        } else if (arg == "--dim") {
+            options.data.dim = atoi(v);
+        } else if (arg == "--nnz") {
+            options.data.nnz = atoi(v);
+        } else if (arg == "--clusters") {
+            options.data.clusters = atoi(v);
+        } else if (arg == "--zipf") {
+            options.data.zipf = atof(v);
+        } else if (arg == "--topic-rate") {
+            options.data.topic_rate = atof(v);
+        } else if (arg == "--seed") {
+            options.data.seed = atol(v);
+        } else if (arg == "--queries") {
+            options.queries = atol(v);
+        } else if (arg == "--k") {
+            options.k = atoi(v);
+        } else if (arg == "--iterations") {
+            options.iterations = atoi(v);
+        } else if (arg == "--max-node-size") {
+            options.max_node_size = atoi(v);
+        } else if (arg == "--train-size") {
+            options.train_size = atol(v);
+        } else if (arg == "--filter") {
+            options.filter = v;
+        } else if (arg == "--out") {
+            options.out = v;
+        } else if (arg == "--gen") {
+            options.gen = v;
+        } else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return EXK_FAIL;
+        }
+    }
+
+    return EXK_SUC;
+}
+
+int main(int argc, char** argv) {
+    BenchOptions options;
+    if (EXK_FAIL == parse_args(argc, argv, options)) {
+        return 1;
+    }
+
+    SyntheticCorpus corpus(options.data);
+    if (!options.gen.empty()) {
+        return corpus.write(options.gen, options.data.n) == EXK_SUC ? 0 : 1;
+    }
+
+    VectorBase base;
+    corpus.generate(base, options.data.n + options.queries);
+
+    std::vector<int32_t> ids, query_ids, train_ids;
+    for (int32_t i = 0; i < options.data.n; i++) {
+        ids.push_back(i);
+    }
+    for (int32_t i = 0; i < options.queries; i++) {
+        query_ids.push_back(options.data.n + i);
+    }
+    for (int32_t i = 0; i < std::min(options.train_size, options.data.n); i++) {
+        train_ids.push_back(i);
+    }
+    std::vector<const SPVEC*> queries = base.get_vectors(query_ids);
+    std::vector<const SPVEC*> train = base.get_vectors(train_ids);
+
+    BenchReport report(options);
+    bench_dot_kernels(report, train, queries);
+    bench_predict(report, options, train, queries);
+    bench_training(report, options, train);
+    bench_tree(report, options, base, ids, queries);
+
+    if (options.out.empty()) {
+        std::cout << report.dump() << std::endl;
+    } else {
+        std::ofstream stream(options.out);
+        stream << report.dump() << std::endl;
+    }
+
+    return 0;
+}
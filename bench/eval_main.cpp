@@ -0,0 +1,374 @@
+#include <stdlib.h>
+#include <algorithm>
+#include <cmath>
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+#include <set>
+#include <omp.h>
+#include "json.h"
+#include "synthetic_data.hpp"
+#include "sparse_kmeans.hpp"
+#include "sparse_kmeans_tree.hpp"
+#include "sparse_kmeans_forest.hpp"
+#include "compact_payload.hpp"
+#include "residual_pq_payload.hpp"
+#include "topk.hpp"
+
+// Recall / latency evaluation of the tree search against brute force ground truth.
+// Every combination of the build parameters (k, max_node_size, cut_rate) is built
+// once and searched with every beam width, the candidates of the visited leaves are
+// reranked exactly and compared with the exact top k. With --trees above 1 a forest
+// is built instead and the merged candidates of all its trees are reranked. With
+// --pq-shortlist N the leaves are residual product quantized, and only the N best
+// members by approximated dot product are reranked.
+
+struct EvalOptions {
+    SyntheticConfig data;
+    std::string data_file;
+    size_t queries;
+    int32_t topk;
+    std::string metric;
+    int32_t iterations;
+    size_t subsample;
+    std::string node_k;
+    int32_t trees;
+    float tree_subsample;
+    size_t pq_shortlist;
+    std::vector<int32_t> ks;
+    std::vector<int32_t> max_node_sizes;
+    std::vector<float> cut_rates;
+    std::vector<int32_t> beams;
+    std::string format;
+    std::string out;
+
+    EvalOptions(): queries(200), topk(10), metric("dot"), iterations(10), subsample(0), node_k("fixed"), trees(1), tree_subsample(1), pq_shortlist(0), format("csv") {
+        data.n = 20000;
+        data.dim = 5000;
+        ks.push_back(16);
+        max_node_sizes.push_back(500);
+        cut_rates.push_back(2);
+        beams.push_back(1);
+        beams.push_back(2);
+        beams.push_back(4);
+        beams.push_back(8);
+    }
+};
+
+typedef std::chrono::steady_clock Clock;
+
+static TSVAL sparse_dot(const SPVEC& a, const SPVEC& b) {
+    auto ia = a.begin();
+    auto ib = b.begin();
+    TSVAL s = 0;
+    while (ia != a.end() && ib != b.end()) {
+        if (ia.index() < ib.index()) {
+            ia++;
+        } else if (ia.index() > ib.index()) {
+            ib++;
+        } else {
+            s += *ia * *ib;
+            ia++;
+            ib++;
+        }
+    }
+
+    return s;
+}
+
+// smaller is closer for both metrics
+static TSVAL exact_dist(const std::string& metric, const SPVEC& a, const SPVEC& b, TSVAL norm_a, TSVAL norm_b) {
+    TSVAL dot = sparse_dot(a, b);
+    if (metric == "cosine") {
+        return norm_a > 0 && norm_b > 0 ? -dot / sqrt(norm_a * norm_b) : 0;
+    }
+    return metric == "l2" ? norm_a + norm_b - 2 * dot : -dot;
+}
+
+static TSVAL norm_sq(const SPVEC& v) {
+    TSVAL s = 0;
+    for (auto iter = v.begin(); iter != v.end(); iter++) {
+        s += *iter * *iter;
+    }
+    return s;
+}
+
+template <typename T>
+static std::vector<T> parse_list(const char* v) {
+    std::vector<T> ret;
+    std::stringstream stream(v);
+    std::string item;
+    while (std::getline(stream, item, ',')) {
+        std::stringstream value(item);
+        T t;
+        value >> t;
+        ret.push_back(t);
+    }
+    return ret;
+}
+
+static int32_t parse_args(int argc, char** argv, EvalOptions& options) {
+    for (int32_t i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (i + 1 >= argc) {
+            std::cerr << "missing value of " << arg << std::endl;
+            return EXK_FAIL;
+        }
+
+        const char* v = argv[++i];
+        if (arg == "--n") {
+            options.data.n = atol(v);
+        } else if (arg == "--dim") {
+            options.data.dim = atoi(v);
+        } else if (arg == "--nnz") {
+            options.data.nnz = atoi(v);
+        } else if (arg == "--clusters") {
+            options.data.clusters = atoi(v);
+        } else if (arg == "--seed") {
+            options.data.seed = atol(v);
+        } else if (arg == "--data") {
+            options.data_file = v;
+        } else if (arg == "--queries") {
+            options.queries = atol(v);
+        } else if (arg == "--topk") {
+            options.topk = atoi(v);
+        } else if (arg == "--metric") {
+            options.metric = v;
+        } else if (arg == "--iterations") {
+            options.iterations = atoi(v);
+        } else if (arg == "--subsample") {
+            options.subsample = atol(v);
+        } else if (arg == "--node-k") {
+            options.node_k = v;
+        } else if (arg == "--trees") {
+            options.trees = atoi(v);
+        } else if (arg == "--tree-subsample") {
+            options.tree_subsample = atof(v);
+        } else if (arg == "--pq-shortlist") {
+            options.pq_shortlist = atol(v);
+        } else if (arg == "--ks") {
+            options.ks = parse_list<int32_t>(v);
+        } else if (arg == "--max-node-sizes") {
+            options.max_node_sizes = parse_list<int32_t>(v);
+        } else if (arg == "--cut-rates") {
+            options.cut_rates = parse_list<float>(v);
+        } else if (arg == "--beams") {
+            options.beams = parse_list<int32_t>(v);
+        } else if (arg == "--format") {
+            options.format = v;
+        } else if (arg == "--out") {
+            options.out = v;
+        } else {
+            std::cerr << "unknown option " << arg << std::endl;
+            return EXK_FAIL;
+        }
+    }
+
+    if (options.metric != "dot" && options.metric != "l2" && options.metric != "cosine") {
+        std::cerr << "metric is one of dot, l2 and cosine" << std::endl;
+        return EXK_FAIL;
+    }
+    if (options.pq_shortlist > 0 && (options.metric != "dot" || options.trees > 1)) {
+        std::cerr << "--pq-shortlist needs --metric dot and a single tree" << std::endl;
+        return EXK_FAIL;
+    }
+
+    return EXK_SUC;
+}
+
+int main(int argc, char** argv) {
+    EvalOptions options;
+    if (EXK_FAIL == parse_args(argc, argv, options)) {
+        return 1;
+    }
+
+    // the last queries vectors are held out of the indexed set
+    VectorBase base;
+    if (options.data_file.empty()) {
+        SyntheticCorpus corpus(options.data);
+        corpus.generate(base, options.data.n + options.queries);
+    } else {
+        base = VectorBase(options.data_file, options.data.dim, NULL, true);
+    }
+
+    std::vector<int32_t> ids, query_ids;
+    const std::map<int32_t, SPVEC>& storage = base.get_map();
+    for (auto iter = storage.begin(); iter != storage.end(); iter++) {
+        ids.push_back(iter->first);
+    }
+    if (ids.size() <= options.queries) {
+        std::cerr << "not enough vectors for the queries" << std::endl;
+        return 1;
+    }
+    query_ids.assign(ids.end() - options.queries, ids.end());
+    ids.resize(ids.size() - options.queries);
+
+    std::vector<const SPVEC*> samples = base.get_vectors(ids);
+    std::vector<const SPVEC*> queries = base.get_vectors(query_ids);
+    std::vector<TSVAL> norms(samples.size());
+    for (size_t i = 0; i < samples.size(); i++) {
+        norms[i] = norm_sq(*samples[i]);
+    }
+
+    // exact ground truth
+    std::cerr << "computing ground truth of " << queries.size() << " queries" << std::endl;
+    std::vector<std::set<int32_t>> truth(queries.size());
+    #pragma omp parallel for schedule(dynamic)
+    for (int32_t q = 0; q < queries.size(); q++) {
+        TSVAL qn = norm_sq(*queries[q]);
+        Topk<int32_t, TSVAL> topk(options.topk);
+        for (size_t i = 0; i < samples.size(); i++) {
+            topk.insert(ids[i], exact_dist(options.metric, *samples[i], *queries[q], norms[i], qn));
+        }
+
+        std::vector<std::pair<int32_t, TSVAL>> res;
+        topk.finalize(res);
+        for (auto iter = res.begin(); iter != res.end(); iter++) {
+            truth[q].insert(iter->first);
+        }
+    }
+
+    nlohmann::json rows = nlohmann::json::array();
+    for (auto k = options.ks.begin(); k != options.ks.end(); k++) {
+        for (auto mns = options.max_node_sizes.begin(); mns != options.max_node_sizes.end(); mns++) {
+            for (auto cut = options.cut_rates.begin(); cut != options.cut_rates.end(); cut++) {
+                DENSE_SPARSE_DIST_FUNC(func) = inversed_dense_sparse_dot;
+                if (options.metric == "l2") {
+                    func = dense_sparse_l2_distance_sq;
+                } else if (options.metric == "cosine") {
+                    func = negative_dense_sparse_dot;
+                }
+                SparseKMeansModel prototype(*k, options.iterations, true, "kmeans++", func, constant_degree, *cut);
+                prototype.set_dimension_major(true);
+                prototype.set_seed(options.data.seed);
+                prototype.set_subsample(options.subsample);
+                prototype.set_node_k(options.node_k == "balanced" ? balanced_node_k : fixed_node_k);
+
+                CompactPayLoad compact(&base, *mns);
+                ResidualPQPayLoad pq(&base, *mns);
+                LeafPayLoad* payload = options.pq_shortlist > 0 ? (LeafPayLoad*)&pq : &compact;
+                Clock::time_point start = Clock::now();
+                SparseKMeansForest forest(payload, samples, prototype, options.trees, options.tree_subsample, *mns);
+                double build_ms = std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+                forest.insert_batch(ids, samples);
+
+                for (auto beam = options.beams.begin(); beam != options.beams.end(); beam++) {
+                    std::vector<double> latencies;
+                    double hits = 0;
+                    double candidates = 0;
+                    double leaves = 0;
+                    for (size_t q = 0; q < queries.size(); q++) {
+                        Clock::time_point op = Clock::now();
+                        TSVAL qn = norm_sq(*queries[q]);
+                        Topk<int32_t, TSVAL> topk(options.topk);
+                        size_t scanned = 0;
+                        if (options.pq_shortlist > 0) {
+                            std::vector<const LeafPayLoad*> found = forest.tree(0).search_for_leaves(*queries[q], *beam);
+                            Topk<int32_t, TSVAL> shortlist(options.pq_shortlist);
+                            std::vector<std::pair<int32_t, TSVAL>> scores;
+                            for (auto leaf = found.begin(); leaf != found.end(); leaf++) {
+                                static_cast<const ResidualPQPayLoad*>(*leaf)->score(*queries[q], scores);
+                                for (auto iter = scores.begin(); iter != scores.end(); iter++) {
+                                    shortlist.insert(iter->first, -iter->second);
+                                }
+                                scanned += scores.size();
+                            }
+                            shortlist.finalize(scores);
+                            for (auto iter = scores.begin(); iter != scores.end(); iter++) {
+                                const SPVEC& v = base.at(iter->first);
+                                topk.insert(iter->first, exact_dist(options.metric, v, *queries[q], norm_sq(v), qn));
+                            }
+                        } else if (forest.size() == 1) {
+                            std::vector<const LeafPayLoad*> found = forest.tree(0).search_for_leaves(*queries[q], *beam);
+                            for (auto leaf = found.begin(); leaf != found.end(); leaf++) {
+                                CompactPayLoad::Cursor cur = static_cast<const CompactPayLoad*>(*leaf)->cursor();
+                                int32_t id;
+                                TSVAL weight;
+                                while (cur.next(id, weight)) {
+                                    const SPVEC& v = base.at(id);
+                                    topk.insert(id, exact_dist(options.metric, v, *queries[q], norm_sq(v), qn));
+                                    scanned++;
+                                }
+                            }
+                        } else {
+                            std::vector<int32_t> found;
+                            forest.search_candidates(*queries[q], *beam, found);
+                            for (auto id = found.begin(); id != found.end(); id++) {
+                                const SPVEC& v = base.at(*id);
+                                topk.insert(*id, exact_dist(options.metric, v, *queries[q], norm_sq(v), qn));
+                            }
+                            scanned = found.size();
+                        }
+                        std::vector<std::pair<int32_t, TSVAL>> res;
+                        topk.finalize(res);
+                        latencies.push_back(std::chrono::duration<double, std::micro>(Clock::now() - op).count());
+
+                        for (auto iter = res.begin(); iter != res.end(); iter++) {
+                            hits += truth[q].count(iter->first);
+                        }
+                        candidates += scanned;
+                        // leaves of all the trees, counted out of the timing
+                        for (size_t t = 0; t < forest.size(); t++) {
+                            leaves += forest.tree(t).search_for_leaves(*queries[q], *beam).size();
+                        }
+                    }
+
+                    double total_us = 0;
+                    for (auto iter = latencies.begin(); iter != latencies.end(); iter++) {
+                        total_us += *iter;
+                    }
+                    std::sort(latencies.begin(), latencies.end());
+
+                    nlohmann::json row;
+                    row["trees"] = forest.size();
+                    row["k"] = *k;
+                    row["max_node_size"] = *mns;
+                    row["cut_rate"] = *cut;
+                    row["beam"] = *beam;
+                    row["recall"] = hits / (queries.size() * options.topk);
+                    row["qps"] = queries.size() * 1e6 / total_us;
+                    row["p50_us"] = latencies[latencies.size() / 2];
+                    row["p99_us"] = latencies[std::min(latencies.size() - 1, latencies.size() * 99 / 100)];
+                    row["avg_leaves"] = leaves / queries.size();
+                    row["avg_candidates"] = candidates / queries.size();
+                    row["build_ms"] = build_ms;
+                    rows.push_back(row);
+                    std::cerr << row.dump() << std::endl;
+                }
+            }
+        }
+    }
+
+    std::ostringstream stream;
+    if (options.format == "json") {
+        nlohmann::json obj;
+        obj["topk"] = options.topk;
+        obj["metric"] = options.metric;
+        obj["queries"] = queries.size();
+        obj["indexed"] = samples.size();
+        obj["rows"] = rows;
+        stream << obj.dump(2) << std::endl;
+    } else {
+        const char* columns[] = {"trees", "k", "max_node_size", "cut_rate", "beam", "recall", "qps", "p50_us", "p99_us", "avg_leaves", "avg_candidates", "build_ms"};
+        for (int32_t c = 0; c < 12; c++) {
+            stream << (c ? "," : "") << columns[c];
+        }
+        stream << std::endl;
+        for (auto row = rows.begin(); row != rows.end(); row++) {
+            for (int32_t c = 0; c < 12; c++) {
+                stream << (c ? "," : "") << (*row)[columns[c]];
+            }
+            stream << std::endl;
+        }
+    }
+
+    if (options.out.empty()) {
+        std::cout << stream.str();
+    } else {
+        std::ofstream file(options.out);
+        file << stream.str();
+    }
+
+    return 0;
+}
@@ -0,0 +1,97 @@
+#include "synthetic_data.hpp"
+#include <algorithm>
+#include <cmath>
+#include <fstream>
+#include <map>
+#include "sparse_kmeans.hpp"
+
+SyntheticConfig::SyntheticConfig():
+    n(10000),
+    dim(10000),
+    nnz(30),
+    clusters(50),
+    zipf(1.1),
+    topic_rate(0.7),
+    topic_width(200),
+    seed(42) {
+
+}
+
+static std::vector<double> zipf_cdf(int32_t size, float s) {
+    std::vector<double> cdf(size);
+    double acc = 0;
+    for (int32_t i = 0; i < size; i++) {
+        acc += 1.0 / pow(i + 1, s);
+        cdf[i] = acc;
+    }
+
+    return cdf;
+}
+
+SyntheticCorpus::SyntheticCorpus(const SyntheticConfig& config):
+    _config(config),
+    _rng(config.seed) {
+    this->_config.topic_width = std::min(config.topic_width, config.dim);
+    this->_cdf = zipf_cdf(this->_config.dim, this->_config.zipf);
+
+    std::uniform_int_distribution<int32_t> offset(0, this->_config.dim - this->_config.topic_width);
+    for (int32_t i = 0; i < this->_config.clusters; i++) {
+        this->_topic_offsets.push_back(offset(this->_rng));
+    }
+}
+
+// a Zipf distributed rank in [0, dim), the global ranks double as term ids
+int32_t SyntheticCorpus::draw_rank() {
+    std::uniform_real_distribution<double> u(0, *this->_cdf.rbegin());
+    return std::lower_bound(this->_cdf.begin(), this->_cdf.end(), u(this->_rng)) - this->_cdf.begin();
+}
+
+SPVEC SyntheticCorpus::sample(int32_t& cluster) {
+    std::uniform_int_distribution<int32_t> pick(0, this->_config.clusters - 1);
+    std::uniform_real_distribution<float> coin(0, 1);
+    cluster = pick(this->_rng);
+
+    // term frequencies
+    std::map<int32_t, int32_t> tf;
+    int32_t draws = 0;
+    while (tf.size() < this->_config.nnz && draws < this->_config.nnz * 10) {
+        int32_t term;
+        if (coin(this->_rng) < this->_config.topic_rate) {
+            // ranks inside the window follow the same law, folded into its width
+            term = this->_topic_offsets[cluster] + this->draw_rank() % this->_config.topic_width;
+        } else {
+            term = this->draw_rank();
+        }
+        tf[term]++;
+        draws++;
+    }
+
+    SPVEC ret(this->_config.dim);
+    for (auto iter = tf.begin(); iter != tf.end(); iter++) {
+        TSVAL idf = log(1.0 + (double)this->_config.dim / (iter->first + 1));
+        ret(iter->first) = (1 + log(iter->second)) * idf;
+    }
+
+    return ret;
+}
+
+void SyntheticCorpus::generate(VectorBase& base, size_t n, int32_t first_id) {
+    int32_t cluster;
+    for (size_t i = 0; i < n; i++) {
+        base.insert(first_id + i, this->sample(cluster));
+    }
+}
+
+int32_t SyntheticCorpus::write(const std::string& filename, size_t n) {
+    std::ofstream stream(filename);
+    if (!stream.is_open()) {
+        return EXK_FAIL;
+    }
+
+    int32_t cluster;
+    for (size_t i = 0; i < n; i++) {
+        stream << i << "\t" << sp_vec_to_json(this->sample(cluster)) << "\n";
+    }
+
+    return EXK_SUC;
+}
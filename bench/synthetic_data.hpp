@@ -0,0 +1,49 @@
+#ifndef SYNTHETIC_DATA_HPP
+#define SYNTHETIC_DATA_HPP
+#include <stdint.h>
+#include <random>
+#include <string>
+#include <vector>
+#include "sparse.hpp"
+#include "vector_base.hpp"
+
+// Power-law sparse corpus with cluster structure. Every cluster owns a window of the
+// vocabulary it prefers, terms are drawn by a Zipf law either within the window of the
+// sample's cluster or over the whole vocabulary, and values are tf-idf like.
+struct SyntheticConfig {
+    size_t n;
+    int32_t dim;
+    int32_t nnz;
+    int32_t clusters;
+    float zipf;          // exponent of the term distribution
+    float topic_rate;    // share of the terms drawn from the cluster window
+    int32_t topic_width; // size of the cluster windows
+    uint64_t seed;
+
+    SyntheticConfig();
+};
+
+class SyntheticCorpus {
+public:
+    SyntheticCorpus(const SyntheticConfig& config);
+
+    SPVEC sample(int32_t& cluster);
+    // fills the base with ids [first_id, first_id + n)
+    void generate(VectorBase& base, size_t n, int32_t first_id = 0);
+    // writes n samples in the "id\tjson" format read by VectorBase and SampleStream
+    int32_t write(const std::string& filename, size_t n);
+
+    const SyntheticConfig& config() const {
+        return this->_config;
+    }
+
+private:
+    SyntheticConfig _config;
+    std::mt19937_64 _rng;
+    std::vector<double> _cdf;
+    std::vector<int32_t> _topic_offsets;
+
+    int32_t draw_rank();
+};
+
+#endif
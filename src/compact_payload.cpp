@@ -0,0 +1,204 @@
+#include "compact_payload.hpp"
+#include <algorithm>
+
+static size_t varint_encode(uint32_t v, uint8_t* out) {
+    size_t n = 0;
+    while (v >= 0x80) {
+        out[n++] = (uint8_t)(v | 0x80);
+        v >>= 7;
+    }
+    out[n++] = (uint8_t)v;
+    return n;
+}
+
+static size_t varint_decode(const uint8_t* in, uint32_t& v) {
+    size_t n = 0;
+    int32_t shift = 0;
+    v = 0;
+    do {
+        v |= (uint32_t)(in[n] & 0x7f) << shift;
+        shift += 7;
+    } while (in[n++] & 0x80);
+    return n;
+}
+
+CompactPayLoad::CompactPayLoad(VectorBase* base, size_t max_size, bool compressed):
+    _max_size(max_size),
+    _compressed(compressed),
+    _vec_base(base) {
+    if (!this->_compressed) {
+        this->_ids.reserve(max_size);
+    }
+    this->_weights.reserve(max_size);
+}
+
+size_t CompactPayLoad::size() {
+    return this->_weights.size();
+}
+
+size_t CompactPayLoad::memory_bytes() const {
+    return sizeof(*this)
+        + this->_ids.capacity() * sizeof(int32_t)
+        + this->_codes.capacity() * sizeof(uint8_t)
+        + this->_weights.capacity() * sizeof(TSVAL);
+}
+
+int32_t CompactPayLoad::insert(int32_t id, TSVAL weight, const SPVEC& v) {
+    if (this->_compressed) {
+        return this->insert_code(id, weight);
+    }
+
+    auto pos = std::lower_bound(this->_ids.begin(), this->_ids.end(), id);
+    size_t offset = pos - this->_ids.begin();
+    if (pos != this->_ids.end() && *pos == id) {
+        this->_weights[offset] = weight;
+        return 0;
+    }
+
+    this->_ids.insert(pos, id);
+    this->_weights.insert(this->_weights.begin() + offset, weight);
+    return 0;
+}
+
+int32_t CompactPayLoad::insert_code(int32_t id, TSVAL weight) {
+    // find the first member not less than id
+    size_t offset = 0;
+    size_t code_pos = 0;
+    int32_t prev = 0;
+    uint32_t delta = 0;
+    size_t len = 0;
+    while (code_pos < this->_codes.size()) {
+        len = varint_decode(&this->_codes[code_pos], delta);
+        if (prev + (int32_t)delta >= id) {
+            break;
+        }
+        prev += delta;
+        code_pos += len;
+        offset++;
+    }
+
+    uint8_t buf[10];
+    size_t n = varint_encode(id - prev, buf);
+    if (code_pos < this->_codes.size()) {
+        int32_t next = prev + delta;
+        if (next == id) {
+            this->_weights[offset] = weight;
+            return 0;
+        }
+
+        // the delta of the next member is now relative to id
+        n += varint_encode(next - id, buf + n);
+        this->_codes.erase(this->_codes.begin() + code_pos, this->_codes.begin() + code_pos + len);
+    }
+
+    this->_codes.insert(this->_codes.begin() + code_pos, buf, buf + n);
+    this->_weights.insert(this->_weights.begin() + offset, weight);
+    return 0;
+}
+
+std::vector<SPVEC> CompactPayLoad::get_all_vectors() {
+    std::vector<SPVEC> ret;
+    ret.reserve(this->size());
+
+    int32_t id;
+    TSVAL weight;
+    Cursor cur = this->cursor();
+    while (cur.next(id, weight)) {
+        ret.push_back(this->_vec_base->at(id));
+    }
+
+    return ret;
+}
+
+std::set<int32_t> CompactPayLoad::get_all_ids() {
+    std::set<int32_t> ids;
+
+    int32_t id;
+    TSVAL weight;
+    Cursor cur = this->cursor();
+    while (cur.next(id, weight)) {
+        ids.insert(ids.end(), id);
+    }
+
+    return ids;
+}
+
+size_t CompactPayLoad::get_all_vector_ptrs(std::vector<const SPVEC*>& ret) const {
+    ret.clear();
+
+    int32_t id;
+    TSVAL weight;
+    Cursor cur = this->cursor();
+    while (cur.next(id, weight)) {
+        ret.push_back(&this->_vec_base->at(id));
+    }
+
+    return ret.size();
+}
+
+size_t CompactPayLoad::get_all_ids(std::vector<int32_t>& ret) const {
+    ret.clear();
+
+    int32_t id;
+    TSVAL weight;
+    Cursor cur = this->cursor();
+    while (cur.next(id, weight)) {
+        ret.push_back(id);
+    }
+
+    return ret.size();
+}
+
+ConstSpan<int32_t> CompactPayLoad::get_ids() const {
+    ConstSpan<int32_t> ret = {this->_ids.data(), this->_ids.size()};
+    return ret;
+}
+
+ConstSpan<TSVAL> CompactPayLoad::get_weights() const {
+    ConstSpan<TSVAL> ret = {this->_weights.data(), this->_weights.size()};
+    return ret;
+}
+
+CompactPayLoad::Cursor CompactPayLoad::cursor() const {
+    return Cursor(this);
+}
+
+CompactPayLoad::Cursor::Cursor(const CompactPayLoad* payload):
+    _payload(payload),
+    _pos(0),
+    _code_pos(0),
+    _last_id(0) {
+
+}
+
+bool CompactPayLoad::Cursor::next(int32_t& id, TSVAL& weight) {
+    if (this->_pos >= this->_payload->_weights.size()) {
+        return false;
+    }
+
+    if (this->_payload->_compressed) {
+        uint32_t delta;
+        this->_code_pos += varint_decode(&this->_payload->_codes[this->_code_pos], delta);
+        this->_last_id += delta;
+        id = this->_last_id;
+    } else {
+        id = this->_payload->_ids[this->_pos];
+    }
+
+    weight = this->_payload->_weights[this->_pos];
+    this->_pos++;
+    return true;
+}
+
+LeafPayLoad* CompactPayLoad::clone() const {
+    return new CompactPayLoad(*this);
+}
+
+LeafPayLoad* CompactPayLoad::new_payload() {
+    return new CompactPayLoad(this->_vec_base, this->_max_size, this->_compressed);
+}
+
+void CompactPayLoad::dispose(LeafPayLoad** t) {
+    delete *t;
+    *t = NULL;
+}
@@ -0,0 +1,56 @@
+#ifndef COMPACT_PAYLOAD_HPP
+#define COMPACT_PAYLOAD_HPP
+#include "payload.hpp"
+#include "sparse.hpp"
+#include "vector_base.hpp"
+
+// Leaf payload keeping the member ids sorted in a struct-of-arrays with their weights.
+// In compressed mode the ids are stored as varint encoded deltas, and can only be read
+// through a Cursor.
+class CompactPayLoad : public LeafPayLoad {
+public:
+    class Cursor {
+    public:
+        bool next(int32_t& id, TSVAL& weight);
+        Cursor(const CompactPayLoad* payload);
+    private:
+        const CompactPayLoad* _payload;
+        size_t _pos;
+        size_t _code_pos;
+        int32_t _last_id;
+    };
+
+    size_t size();
+    int32_t insert(int32_t id, TSVAL weight, const SPVEC& v);
+    std::vector<SPVEC> get_all_vectors();
+    std::set<int32_t> get_all_ids();
+    size_t get_all_vector_ptrs(std::vector<const SPVEC*>& ret) const;
+    size_t get_all_ids(std::vector<int32_t>& ret) const;
+    size_t memory_bytes() const;
+
+    // empty in compressed mode
+    ConstSpan<int32_t> get_ids() const;
+    ConstSpan<TSVAL> get_weights() const;
+    Cursor cursor() const;
+    bool is_compressed() const {
+        return this->_compressed;
+    }
+
+    LeafPayLoad* new_payload();
+    LeafPayLoad* clone() const;
+    void dispose(LeafPayLoad** t);
+
+    CompactPayLoad(VectorBase* base, size_t max_size, bool compressed = false);
+private:
+    size_t _max_size;
+    bool _compressed;
+    VectorBase* _vec_base;
+
+    std::vector<int32_t> _ids;
+    std::vector<uint8_t> _codes;
+    std::vector<TSVAL> _weights;
+
+    int32_t insert_code(int32_t id, TSVAL weight);
+};
+
+#endif
@@ -0,0 +1,62 @@
+#ifndef DISTANCE_HPP
+#define DISTANCE_HPP
+#include <math.h>
+#include <algorithm>
+#include "sparse.hpp"
+
+// Distance policies. A policy maps the dot product of a center and a sample to their
+// distance given both squared norms, the scoring loops of SparseKMeansModel are
+// instantiated per policy so that the mapping inlines into them. The function pointer
+// distances only select the instantiation, once per scored sample, and any other
+// function goes through the pointer as before.
+
+#define DP_CUSTOM 0
+#define DP_INVERSED_DOT 1
+#define DP_L2_SQ 2
+#define DP_L2 3
+#define DP_NEGATIVE_DOT 4
+
+struct InversedDotDist {
+    static const int32_t id = DP_INVERSED_DOT;
+    // the distance decreases with the dot product
+    static const bool decreasing = true;
+    static TSVAL dist(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq) {
+        return 1.0 / (dot + 0.000000001);
+    }
+};
+
+struct L2SqDist {
+    static const int32_t id = DP_L2_SQ;
+    static const bool decreasing = false;
+    static TSVAL dist(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq) {
+        return center_norm_sq + sample_norm_sq - 2 * dot;
+    }
+};
+
+struct L2Dist {
+    static const int32_t id = DP_L2;
+    static const bool decreasing = false;
+    static TSVAL dist(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq) {
+        return sqrt(std::max((TSVAL)0, L2SqDist::dist(dot, center_norm_sq, sample_norm_sq)));
+    }
+};
+
+// cosine distance up to the sample norm, for unit centers
+struct NegativeDotDist {
+    static const int32_t id = DP_NEGATIVE_DOT;
+    static const bool decreasing = true;
+    static TSVAL dist(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq) {
+        return -dot;
+    }
+};
+
+// dot product of a dense center with a sparse sample, gathering the center at the nonzeros
+inline TSVAL dense_sparse_dot(const TSVAL* center, const SPVEC& v) {
+    TSVAL s = 0;
+    for (auto iter = v.begin(); iter != v.end(); iter++) {
+        s += center[iter.index()] * *iter;
+    }
+    return s;
+}
+
+#endif
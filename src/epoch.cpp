@@ -0,0 +1,100 @@
+#include "epoch.hpp"
+#include <new>
+#include <stdlib.h>
+
+EpochManager::Guard::Guard(const EpochManager* manager) {
+    Shard& shard = manager->shard();
+    while (true) {
+        uint64_t e = manager->_epoch.load();
+        this->_counter = &shard.readers[e & 1];
+        this->_counter->fetch_add(1);
+        // the epoch moved on before the reader was counted, count it in the new one
+        if (manager->_epoch.load() == e) {
+            break;
+        }
+        this->_counter->fetch_sub(1);
+    }
+}
+
+EpochManager::Guard::Guard(Guard&& other): _counter(other._counter) {
+    other._counter = NULL;
+}
+
+EpochManager::Guard::~Guard() {
+    if (this->_counter != NULL) {
+        this->_counter->fetch_sub(1);
+    }
+}
+
+EpochManager::EpochManager(): _epoch(2) {
+    void* p = NULL;
+    if (posix_memalign(&p, 64, sizeof(Shard) * EPOCH_SHARDS) != 0) {
+        throw std::bad_alloc();
+    }
+    this->_shards = static_cast<Shard*>(p);
+    for (int32_t s = 0; s < EPOCH_SHARDS; s++) {
+        new (this->_shards + s) Shard;
+        this->_shards[s].readers[0].store(0);
+        this->_shards[s].readers[1].store(0);
+    }
+}
+
+EpochManager::~EpochManager() {
+    for (auto iter = this->_retired.begin(); iter != this->_retired.end(); iter++) {
+        iter->deleter(iter->ptr);
+    }
+    free(this->_shards);
+}
+
+EpochManager::Shard& EpochManager::shard() const {
+    static std::atomic<uint32_t> next_thread(0);
+    static thread_local uint32_t index = next_thread.fetch_add(1, std::memory_order_relaxed);
+    return this->_shards[index % EPOCH_SHARDS];
+}
+
+int64_t EpochManager::readers(uint64_t epoch) const {
+    int64_t ret = 0;
+    for (int32_t s = 0; s < EPOCH_SHARDS; s++) {
+        ret += this->_shards[s].readers[epoch & 1].load();
+    }
+    return ret;
+}
+
+void EpochManager::retire(void* p, void (*deleter)(void*)) {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    Retired r = {p, deleter, this->_epoch.load()};
+    this->_retired.push_back(r);
+    if (this->_retired.size() >= EPOCH_BATCH) {
+        this->collect_locked();
+    }
+}
+
+bool EpochManager::collect() {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    return this->collect_locked();
+}
+
+bool EpochManager::collect_locked() {
+    // the readers of e - 1 share the parity of e + 1
+    uint64_t e = this->_epoch.load();
+    if (this->readers(e - 1) == 0) {
+        this->_epoch.store(++e);
+    }
+
+    size_t kept = 0;
+    for (size_t i = 0; i < this->_retired.size(); i++) {
+        if (this->_retired[i].epoch + 2 <= e) {
+            this->_retired[i].deleter(this->_retired[i].ptr);
+        } else {
+            this->_retired[kept++] = this->_retired[i];
+        }
+    }
+    this->_retired.resize(kept);
+
+    return kept == 0;
+}
+
+size_t EpochManager::pending() const {
+    std::lock_guard<std::mutex> lock(this->_mutex);
+    return this->_retired.size();
+}
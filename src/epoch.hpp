@@ -0,0 +1,72 @@
+#ifndef EPOCH_HPP
+#define EPOCH_HPP
+#include <stdint.h>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+#define EPOCH_SHARDS 16
+// retired objects collected at once
+#define EPOCH_BATCH 64
+
+// Epoch based reclamation. A reader enters a guard, counting itself in the shard of its
+// thread under the parity of the current epoch, and never blocks. A writer unlinks an
+// object, publishing its replacement atomically, then retires it. The epoch moves from
+// e to e + 1 only once no reader of e - 1 is left, so the readers in flight are of two
+// epochs at most, and an object retired in epoch e is freed once the epoch is e + 2.
+class EpochManager {
+public:
+    class Guard {
+    public:
+        Guard(const EpochManager* manager);
+        Guard(Guard&& other);
+        ~Guard();
+    private:
+        std::atomic<int64_t>* _counter;
+    };
+
+    Guard enter() const {
+        return Guard(this);
+    }
+
+    // frees p with deleter once no reader can hold it, the caller unlinked it already
+    void retire(void* p, void (*deleter)(void*));
+    // frees what the readers in flight allow, true when nothing is left
+    bool collect();
+
+    uint64_t epoch() const {
+        return this->_epoch.load();
+    }
+
+    size_t pending() const;
+
+    EpochManager();
+    ~EpochManager();
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<int64_t> readers[2];
+    };
+
+    struct Retired {
+        void* ptr;
+        void (*deleter)(void*);
+        uint64_t epoch;
+    };
+
+    std::atomic<uint64_t> _epoch;
+    // cache line aligned, allocated apart so that the owner of the manager keeps the
+    // default alignment
+    Shard* _shards;
+    mutable std::mutex _mutex;
+    std::vector<Retired> _retired;
+
+    Shard& shard() const;
+    int64_t readers(uint64_t epoch) const;
+    bool collect_locked();
+
+    EpochManager(const EpochManager&);
+    EpochManager& operator=(const EpochManager&);
+};
+
+#endif
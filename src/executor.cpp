@@ -0,0 +1,136 @@
+#include "executor.hpp"
+#include <algorithm>
+
+static std::atomic<Executor*> shared_override(NULL);
+
+Executor::Executor(size_t threads): _stop(false) {
+    if (threads == 0) {
+        threads = std::max(std::thread::hardware_concurrency(), 1u);
+    }
+    for (size_t i = 1; i < threads; i++) {
+        this->_workers.push_back(std::thread(&Executor::work, this));
+    }
+}
+
+Executor::~Executor() {
+    {
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        this->_stop = true;
+    }
+    this->_wake.notify_all();
+    for (auto iter = this->_workers.begin(); iter != this->_workers.end(); iter++) {
+        iter->join();
+    }
+}
+
+Executor& Executor::shared() {
+    static Executor pool;
+    Executor* executor = shared_override.load();
+    return executor != NULL ? *executor : pool;
+}
+
+void Executor::set_shared(Executor* executor) {
+    shared_override.store(executor);
+}
+
+void Executor::run(Job* job) {
+    while (true) {
+        int64_t c = job->next.fetch_add(1);
+        if (c >= job->chunks) {
+            return;
+        }
+        try {
+            (*job->body)(c * job->grain, std::min(job->n, (c + 1) * job->grain));
+        } catch (...) {
+            if (!job->failed.exchange(true)) {
+                job->error = std::current_exception();
+            }
+            job->next.store(job->chunks);
+            return;
+        }
+    }
+}
+
+// the first job of the highest priority with chunks left and room for a worker
+Executor::Job* Executor::pick() {
+    for (int32_t p = 0; p < PRIORITY_LEVELS; p++) {
+        for (auto iter = this->_queues[p].begin(); iter != this->_queues[p].end(); iter++) {
+            Job* job = *iter;
+            if (job->next.load() < job->chunks && job->workers + 1 < job->limit) {
+                return job;
+            }
+        }
+    }
+    return NULL;
+}
+
+void Executor::work() {
+    std::unique_lock<std::mutex> lock(this->_mutex);
+    while (true) {
+        Job* job = this->pick();
+        if (job == NULL) {
+            if (this->_stop) {
+                return;
+            }
+            this->_wake.wait(lock);
+            continue;
+        }
+
+        job->workers++;
+        lock.unlock();
+        run(job);
+        lock.lock();
+        if (--job->workers == 0) {
+            this->_left.notify_all();
+        }
+    }
+}
+
+void Executor::parallel_for(int64_t n, const RANGE_FUNC& body, int32_t priority, size_t max_threads, int64_t grain) {
+    if (n <= 0) {
+        return;
+    }
+
+    int32_t limit = max_threads == 0 ? this->threads() : std::min(max_threads, this->threads());
+    if (grain <= 0) {
+        grain = std::max((int64_t)1, n / (4 * limit));
+    }
+    int64_t chunks = (n + grain - 1) / grain;
+    if (limit <= 1 || chunks <= 1) {
+        body(0, n);
+        return;
+    }
+
+    Job job;
+    job.body = &body;
+    job.n = n;
+    job.grain = grain;
+    job.chunks = chunks;
+    job.next.store(0);
+    job.failed.store(false);
+    job.workers = 0;
+    job.limit = limit;
+    priority = std::min(std::max(priority, 0), PRIORITY_LEVELS - 1);
+    {
+        std::lock_guard<std::mutex> lock(this->_mutex);
+        this->_queues[priority].push_back(&job);
+    }
+    for (int64_t i = 1; i < std::min((int64_t)limit, chunks); i++) {
+        this->_wake.notify_one();
+    }
+
+    run(&job);
+
+    // every chunk is claimed, wait for the workers still running theirs
+    std::unique_lock<std::mutex> lock(this->_mutex);
+    std::deque<Job*>& queue = this->_queues[priority];
+    queue.erase(std::find(queue.begin(), queue.end(), &job));
+    while (job.workers > 0) {
+        this->_left.wait(lock);
+    }
+    lock.unlock();
+
+    if (job.error) {
+        std::rethrow_exception(job.error);
+    }
+}
@@ -0,0 +1,74 @@
+#ifndef EXECUTOR_HPP
+#define EXECUTOR_HPP
+#include <stdint.h>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// priorities of the parallel loops, idle workers join queries first, then inserts
+#define PRIORITY_QUERY 0
+#define PRIORITY_INGEST 1
+#define PRIORITY_BUILD 2
+#define PRIORITY_LEVELS 3
+
+#define RANGE_FUNC std::function<void(int64_t begin, int64_t end)>
+
+// Thread pool running every parallel loop of the library. A loop is cut into chunks,
+// the calling thread works through them and idle workers steal the chunks left, so a
+// loop nested in another one (node fits inside a forest build, E-steps inside node
+// fits) runs on the same threads instead of starting more. Each loop can be capped to
+// a number of threads, the caller included, and the pool may be shared by several
+// indexes with different caps.
+class Executor {
+public:
+    // threads counts the callers, threads - 1 workers are started, 0 for one per core
+    explicit Executor(size_t threads = 0);
+    ~Executor();
+
+    // body(begin, end) over chunks of [0, n) of grain items, 0 for a few chunks per
+    // thread, and max_threads threads at most, 0 for all of them. The first exception
+    // thrown by a chunk stops the chunks not started and is rethrown here once the
+    // running ones are done
+    void parallel_for(int64_t n, const RANGE_FUNC& body, int32_t priority = PRIORITY_BUILD,
+                      size_t max_threads = 0, int64_t grain = 0);
+
+    size_t threads() const {
+        return this->_workers.size() + 1;
+    }
+
+    // the executor of everything not given one, the default pool unless set
+    static Executor& shared();
+    static void set_shared(Executor* executor);
+
+private:
+    struct Job {
+        const RANGE_FUNC* body;
+        int64_t n;
+        int64_t grain;
+        int64_t chunks;
+        std::atomic<int64_t> next;
+        std::atomic<bool> failed;
+        std::exception_ptr error;
+        // workers in the job, the caller excluded, guarded by the pool mutex
+        int32_t workers;
+        int32_t limit;
+    };
+
+    std::vector<std::thread> _workers;
+    std::deque<Job*> _queues[PRIORITY_LEVELS];
+    std::mutex _mutex;
+    std::condition_variable _wake;
+    std::condition_variable _left;
+    bool _stop;
+
+    void work();
+    Job* pick();
+    static void run(Job* job);
+};
+
+#endif
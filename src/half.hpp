@@ -0,0 +1,148 @@
+#ifndef HALF_HPP
+#define HALF_HPP
+#include <stdint.h>
+#include <string.h>
+#include <stddef.h>
+
+#if defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#include <immintrin.h>
+#define HALF_F16C_DISPATCH
+#endif
+
+// Scalar IEEE fp16 and bfloat16 conversions, rounding to nearest even.
+
+inline uint32_t float_bits(float f) {
+    uint32_t u;
+    memcpy(&u, &f, sizeof(u));
+    return u;
+}
+
+inline float bits_float(uint32_t u) {
+    float f;
+    memcpy(&f, &u, sizeof(f));
+    return f;
+}
+
+inline uint16_t float_to_half(float f) {
+    uint32_t u = float_bits(f);
+    uint16_t sign = (u >> 16) & 0x8000;
+    int32_t exp = ((u >> 23) & 0xff) - 127 + 15;
+    uint32_t mant = u & 0x7fffff;
+
+    if (((u >> 23) & 0xff) == 0xff) {
+        // inf or nan
+        return sign | 0x7c00 | (mant ? 0x200 : 0);
+    }
+
+    if (exp >= 31) {
+        return sign | 0x7c00;
+    }
+
+    if (exp <= 0) {
+        if (exp < -10) {
+            return sign;
+        }
+
+        // subnormal
+        mant |= 0x800000;
+        int32_t shift = 14 - exp;
+        uint32_t half_mant = mant >> shift;
+        uint32_t rest = mant & ((1u << shift) - 1);
+        uint32_t halfway = 1u << (shift - 1);
+        if (rest > halfway || (rest == halfway && (half_mant & 1))) {
+            half_mant++;
+        }
+        return sign | half_mant;
+    }
+
+    uint16_t h = sign | (exp << 10) | (mant >> 13);
+    uint32_t rest = mant & 0x1fff;
+    if (rest > 0x1000 || (rest == 0x1000 && (h & 1))) {
+        // may carry into the exponent, which is still the correct rounding
+        h++;
+    }
+    return h;
+}
+
+inline float half_to_float(uint16_t h) {
+    uint32_t sign = (uint32_t)(h & 0x8000) << 16;
+    uint32_t exp = (h >> 10) & 0x1f;
+    uint32_t mant = h & 0x3ff;
+
+    if (exp == 0) {
+        if (mant == 0) {
+            return bits_float(sign);
+        }
+
+        // subnormal, normalize it
+        exp = 127 - 15 + 1;
+        while (!(mant & 0x400)) {
+            mant <<= 1;
+            exp--;
+        }
+        mant &= 0x3ff;
+        return bits_float(sign | (exp << 23) | (mant << 13));
+    }
+
+    if (exp == 31) {
+        return bits_float(sign | 0x7f800000 | (mant << 13));
+    }
+
+    return bits_float(sign | ((exp - 15 + 127) << 23) | (mant << 13));
+}
+
+inline uint16_t float_to_bf16(float f) {
+    uint32_t u = float_bits(f);
+    if ((u & 0x7fffffff) > 0x7f800000) {
+        // keep nan quiet
+        return (u >> 16) | 0x40;
+    }
+
+    u += 0x7fff + ((u >> 16) & 1);
+    return u >> 16;
+}
+
+inline float bf16_to_float(uint16_t b) {
+    return bits_float((uint32_t)b << 16);
+}
+
+// acc[i] += w * row[i] over n half precision values, accumulating in fp32
+
+#ifdef HALF_F16C_DISPATCH
+__attribute__((target("avx,f16c")))
+inline void half_axpy_f16c(const uint16_t* row, float w, float* acc, size_t n) {
+    size_t i = 0;
+    __m256 vw = _mm256_set1_ps(w);
+    for (; i + 8 <= n; i += 8) {
+        __m256 c = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i*)(row + i)));
+        __m256 a = _mm256_loadu_ps(acc + i);
+        _mm256_storeu_ps(acc + i, _mm256_add_ps(a, _mm256_mul_ps(vw, c)));
+    }
+    for (; i < n; i++) {
+        acc[i] += w * half_to_float(row[i]);
+    }
+}
+#endif
+
+inline void half_axpy(const uint16_t* row, float w, float* acc, size_t n) {
+#ifdef HALF_F16C_DISPATCH
+    static const bool f16c = __builtin_cpu_supports("avx") && __builtin_cpu_supports("f16c");
+    if (f16c) {
+        half_axpy_f16c(row, w, acc, n);
+        return;
+    }
+#endif
+    for (size_t i = 0; i < n; i++) {
+        acc[i] += w * half_to_float(row[i]);
+    }
+}
+
+// bf16 widens with a shift, which the compiler vectorizes on its own
+inline void bf16_axpy(const uint16_t* row, float w, float* acc, size_t n) {
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        acc[i] += w * bf16_to_float(row[i]);
+    }
+}
+
+#endif
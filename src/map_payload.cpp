@@ -35,6 +35,33 @@ std::set<int32_t> MapPayLoad::get_all_ids() {
     return ids;
 }
 
+size_t MapPayLoad::get_all_vector_ptrs(std::vector<const SPVEC*>& ret) const {
+    ret.clear();
+    for (auto iter = this->_scores.begin(); iter != this->_scores.end(); iter++) {
+        ret.push_back(&this->_vec_base->at(iter.index()));
+    }
+
+    return ret.size();
+}
+
+size_t MapPayLoad::get_all_ids(std::vector<int32_t>& ret) const {
+    ret.clear();
+    for (auto iter = this->_scores.begin(); iter != this->_scores.end(); iter++) {
+        ret.push_back(iter.index());
+    }
+
+    return ret.size();
+}
+
+size_t MapPayLoad::memory_bytes() const {
+    // one red-black tree node per member
+    return sizeof(*this) + this->_scores.nnz() * (4 * sizeof(void*) + sizeof(std::pair<const size_t, TSVAL>));
+}
+
+LeafPayLoad* MapPayLoad::clone() const {
+    return new MapPayLoad(*this);
+}
+
 LeafPayLoad* MapPayLoad::new_payload() {
     return new MapPayLoad(this->_vec_base, this->_max_size);
 }
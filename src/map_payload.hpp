@@ -9,9 +9,13 @@ public:
     int32_t insert(int32_t id, TSVAL weight, const SPVEC& v);
     std::vector<SPVEC> get_all_vectors();
     std::set<int32_t> get_all_ids();
+    size_t get_all_vector_ptrs(std::vector<const SPVEC*>& ret) const;
+    size_t get_all_ids(std::vector<int32_t>& ret) const;
+    size_t memory_bytes() const;
     const SPVEC& get_scores() const { return this->_scores; };
 
     LeafPayLoad* new_payload();
+    LeafPayLoad* clone() const;
     void dispose(LeafPayLoad** t);
 
     MapPayLoad(VectorBase* base, size_t max_size);
@@ -0,0 +1,177 @@
+#include "metrics.hpp"
+#include <chrono>
+#include <new>
+#include <stdlib.h>
+#include "json.h"
+
+static const char* COUNTER_NAMES[MC_COUNT] = {
+    "searches", "inserts", "nodes_visited", "center_dots", "nnz_touched",
+    "leaf_scanned", "nodes_fitted", "fit_iterations", "empty_recoveries",
+    "subsampled_fits"
+};
+
+static const char* HISTOGRAM_NAMES[MH_COUNT] = {
+    "search_ns", "insert_ns", "search_dots", "node_fit_ns", "seeding_ns", "fit_iterations",
+    "subsample_gap_pct"
+};
+
+static uint64_t buckets_percentile(const uint64_t* buckets, double q) {
+    uint64_t total = 0;
+    for (int32_t b = 0; b < METRIC_BUCKETS; b++) {
+        total += buckets[b];
+    }
+    if (total == 0) {
+        return 0;
+    }
+
+    uint64_t rank = (uint64_t)(q * (total - 1)) + 1;
+    uint64_t acc = 0;
+    for (int32_t b = 0; b < METRIC_BUCKETS; b++) {
+        acc += buckets[b];
+        if (acc >= rank) {
+            return b == 0 ? 0 : (1ull << b) - 1;
+        }
+    }
+
+    return UINT64_MAX;
+}
+
+uint64_t MetricsSnapshot::count(MetricHistogram h) const {
+    uint64_t ret = 0;
+    for (int32_t b = 0; b < METRIC_BUCKETS; b++) {
+        ret += this->histograms[h][b];
+    }
+    return ret;
+}
+
+uint64_t MetricsSnapshot::percentile(MetricHistogram h, double q) const {
+    return buckets_percentile(this->histograms[h], q);
+}
+
+uint64_t MetricsSnapshot::level_percentile(int32_t level, double q) const {
+    return buckets_percentile(this->levels[level], q);
+}
+
+std::string MetricsSnapshot::to_string() const {
+    nlohmann::json obj;
+    for (int32_t c = 0; c < MC_COUNT; c++) {
+        obj["counters"][COUNTER_NAMES[c]] = this->counters[c];
+    }
+
+    for (int32_t h = 0; h < MH_COUNT; h++) {
+        nlohmann::json hist;
+        hist["count"] = this->count((MetricHistogram)h);
+        hist["p50"] = this->percentile((MetricHistogram)h, 0.5);
+        hist["p99"] = this->percentile((MetricHistogram)h, 0.99);
+        hist["max"] = this->percentile((MetricHistogram)h, 1);
+        obj["histograms"][HISTOGRAM_NAMES[h]] = hist;
+    }
+
+    for (int32_t l = 0; l < METRIC_LEVELS; l++) {
+        uint64_t n = 0;
+        for (int32_t b = 0; b < METRIC_BUCKETS; b++) {
+            n += this->levels[l][b];
+        }
+        if (n == 0) {
+            continue;
+        }
+
+        nlohmann::json level;
+        level["level"] = l;
+        level["count"] = n;
+        level["p50_ns"] = this->level_percentile(l, 0.5);
+        level["p99_ns"] = this->level_percentile(l, 0.99);
+        obj["levels"].push_back(level);
+    }
+
+    return obj.dump();
+}
+
+Metrics::Metrics(): _shards(NULL) {
+}
+
+Metrics::~Metrics() {
+    free(this->_shards.load());
+}
+
+Metrics::Shard& Metrics::shard() {
+    static std::atomic<uint32_t> next_thread(0);
+    static thread_local uint32_t index = next_thread.fetch_add(1, std::memory_order_relaxed);
+    Shard* shards = this->_shards.load(std::memory_order_acquire);
+    if (shards == NULL) {
+        // the first threads to record race to allocate, one of them publishes
+        void* p = NULL;
+        if (posix_memalign(&p, 64, sizeof(Shard) * METRIC_SHARDS) != 0) {
+            throw std::bad_alloc();
+        }
+        Shard* fresh = static_cast<Shard*>(p);
+        for (int32_t s = 0; s < METRIC_SHARDS; s++) {
+            new (fresh + s) Shard;
+        }
+        clear(fresh);
+        if (this->_shards.compare_exchange_strong(shards, fresh, std::memory_order_acq_rel)) {
+            shards = fresh;
+        } else {
+            free(p);
+        }
+    }
+    return shards[index % METRIC_SHARDS];
+}
+
+MetricsSnapshot Metrics::snapshot() const {
+    const Shard* shards = this->_shards.load(std::memory_order_acquire);
+    MetricsSnapshot ret;
+    for (int32_t c = 0; c < MC_COUNT; c++) {
+        ret.counters[c] = 0;
+        for (int32_t s = 0; shards != NULL && s < METRIC_SHARDS; s++) {
+            ret.counters[c] += shards[s].counters[c].load(std::memory_order_relaxed);
+        }
+    }
+
+    for (int32_t b = 0; b < METRIC_BUCKETS; b++) {
+        for (int32_t h = 0; h < MH_COUNT; h++) {
+            ret.histograms[h][b] = 0;
+            for (int32_t s = 0; shards != NULL && s < METRIC_SHARDS; s++) {
+                ret.histograms[h][b] += shards[s].histograms[h][b].load(std::memory_order_relaxed);
+            }
+        }
+
+        for (int32_t l = 0; l < METRIC_LEVELS; l++) {
+            ret.levels[l][b] = 0;
+            for (int32_t s = 0; shards != NULL && s < METRIC_SHARDS; s++) {
+                ret.levels[l][b] += shards[s].levels[l][b].load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    return ret;
+}
+
+void Metrics::reset() {
+    Shard* shards = this->_shards.load(std::memory_order_acquire);
+    if (shards != NULL) {
+        clear(shards);
+    }
+}
+
+void Metrics::clear(Shard* shards) {
+    for (int32_t s = 0; s < METRIC_SHARDS; s++) {
+        Shard& shard = shards[s];
+        for (int32_t c = 0; c < MC_COUNT; c++) {
+            shard.counters[c].store(0, std::memory_order_relaxed);
+        }
+        for (int32_t b = 0; b < METRIC_BUCKETS; b++) {
+            for (int32_t h = 0; h < MH_COUNT; h++) {
+                shard.histograms[h][b].store(0, std::memory_order_relaxed);
+            }
+            for (int32_t l = 0; l < METRIC_LEVELS; l++) {
+                shard.levels[l][b].store(0, std::memory_order_relaxed);
+            }
+        }
+    }
+}
+
+uint64_t Metrics::now_ns() {
+    return std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
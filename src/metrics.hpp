@@ -0,0 +1,126 @@
+#ifndef METRICS_HPP
+#define METRICS_HPP
+#include <stdint.h>
+#include <atomic>
+#include <string>
+
+// Search, insert and build instrumentation of a tree. Recording is compiled in only
+// with -DKMT_METRICS (the default of the Makefile, `make METRICS=0` compiles it out),
+// otherwise the METRIC_* macros expand to nothing and snapshots stay zero.
+
+enum MetricCounter {
+    MC_SEARCHES = 0,
+    MC_INSERTS,
+    MC_NODES_VISITED,
+    MC_CENTER_DOTS,     // centers scored on the search and insert paths
+    MC_NNZ_TOUCHED,     // sample nonzeros times centers, or postings, read while scoring
+    MC_LEAF_SCANNED,    // members of the leaves returned to the caller
+    MC_NODES_FITTED,
+    MC_FIT_ITERATIONS,
+    MC_EMPTY_RECOVERIES, // empty centers reseeded during the fits
+    MC_SUBSAMPLED_FITS,
+    MC_COUNT
+};
+
+enum MetricHistogram {
+    MH_SEARCH_NS = 0,
+    MH_INSERT_NS,
+    MH_SEARCH_DOTS,     // centers scored per search
+    MH_NODE_FIT_NS,
+    MH_SEEDING_NS,
+    MH_FIT_ITERATIONS,  // iterations until convergence per fitted node
+    MH_SUBSAMPLE_GAP,   // percents the mean distance of all the samples exceeds the subsample one
+    MH_COUNT
+};
+
+// histograms have log2 buckets, bucket b holds values in [2^(b-1), 2^b)
+#define METRIC_BUCKETS 48
+// search time per tree level, deeper levels share the last histogram
+#define METRIC_LEVELS 16
+#define METRIC_SHARDS 16
+
+struct MetricsSnapshot {
+    uint64_t counters[MC_COUNT];
+    uint64_t histograms[MH_COUNT][METRIC_BUCKETS];
+    uint64_t levels[METRIC_LEVELS][METRIC_BUCKETS];
+
+    uint64_t count(MetricHistogram h) const;
+    // upper bound of the bucket holding the q-th quantile
+    uint64_t percentile(MetricHistogram h, double q) const;
+    uint64_t level_percentile(int32_t level, double q) const;
+    std::string to_string() const;
+};
+
+// Every thread records into its own cache line aligned shard with relaxed atomic
+// adds, threads beyond METRIC_SHARDS share shards. A snapshot sums the shards. The
+// shards are allocated apart on the first record, so a Metrics never recorded into,
+// as in builds without KMT_METRICS, holds a pointer only.
+class Metrics {
+public:
+    Metrics();
+    ~Metrics();
+
+    void add(MetricCounter c, uint64_t v) {
+        this->shard().counters[c].fetch_add(v, std::memory_order_relaxed);
+    }
+
+    void record(MetricHistogram h, uint64_t v) {
+        this->shard().histograms[h][bucket(v)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    void record_level(int32_t level, uint64_t ns) {
+        level = level < METRIC_LEVELS ? level : METRIC_LEVELS - 1;
+        this->shard().levels[level][bucket(ns)].fetch_add(1, std::memory_order_relaxed);
+    }
+
+    MetricsSnapshot snapshot() const;
+    void reset();
+
+    static uint64_t now_ns();
+    static int32_t bucket(uint64_t v) {
+        int32_t b = v == 0 ? 0 : 64 - __builtin_clzll(v);
+        return b < METRIC_BUCKETS ? b : METRIC_BUCKETS - 1;
+    }
+
+private:
+    struct alignas(64) Shard {
+        std::atomic<uint64_t> counters[MC_COUNT];
+        std::atomic<uint64_t> histograms[MH_COUNT][METRIC_BUCKETS];
+        std::atomic<uint64_t> levels[METRIC_LEVELS][METRIC_BUCKETS];
+    };
+    std::atomic<Shard*> _shards;
+
+    Shard& shard();
+    static void clear(Shard* shards);
+
+    Metrics(const Metrics&);
+    Metrics& operator=(const Metrics&);
+};
+
+// Scoring work of the calling thread, bumped by SparseKMeansModel without atomics
+// and read as deltas around a single threaded search or insert.
+struct ScoringWork {
+    uint64_t center_dots;
+    uint64_t nnz_touched;
+};
+
+inline ScoringWork& thread_scoring_work() {
+    static thread_local ScoringWork work = {0, 0};
+    return work;
+}
+
+#ifdef KMT_METRICS
+#define METRIC_ADD(m, c, v) do { if ((m) != NULL) (m)->add(c, v); } while (0)
+#define METRIC_RECORD(m, h, v) do { if ((m) != NULL) (m)->record(h, v); } while (0)
+#define METRIC_RECORD_LEVEL(m, l, v) do { if ((m) != NULL) (m)->record_level(l, v); } while (0)
+#define METRIC_SCORING_WORK(dots, nnz) do { ScoringWork& w_ = thread_scoring_work(); w_.center_dots += (dots); w_.nnz_touched += (nnz); } while (0)
+#define METRIC_NOW() Metrics::now_ns()
+#else
+#define METRIC_ADD(m, c, v) do {} while (0)
+#define METRIC_RECORD(m, h, v) do {} while (0)
+#define METRIC_RECORD_LEVEL(m, l, v) do {} while (0)
+#define METRIC_SCORING_WORK(dots, nnz) do {} while (0)
+#define METRIC_NOW() ((uint64_t)0)
+#endif
+
+#endif
@@ -5,15 +5,47 @@
 #include <set>
 #include "sparse.hpp"
 
+class Executor;
+
+// Read-only view over contiguous payload storage, valid until the payload is modified
+template <typename T>
+struct ConstSpan {
+    const T* ptr;
+    size_t len;
+
+    const T* begin() const { return ptr; }
+    const T* end() const { return ptr + len; }
+    size_t size() const { return len; }
+    const T& operator[](size_t i) const { return ptr[i]; }
+};
+
 class LeafPayLoad {
 public:
     virtual size_t size() = 0;
     virtual int32_t insert(int32_t id, TSVAL weight, const SPVEC& v) = 0;
     virtual std::vector<SPVEC> get_all_vectors() = 0;
     virtual std::set<int32_t> get_all_ids() = 0;
+    // fills row pointers into the vector base instead of copying, ret is reused by the caller
+    virtual size_t get_all_vector_ptrs(std::vector<const SPVEC*>& ret) const = 0;
+    // member ids in storage order, ret is reused by the caller
+    virtual size_t get_all_ids(std::vector<int32_t>& ret) const = 0;
+    // bytes held by the payload, the object itself included
+    virtual size_t memory_bytes() const = 0;
+
+    // called by the tree on a new leaf with the training samples routed to it, before
+    // any insert, payloads learning a leaf encoding override it and run their parallel
+    // loops on the executor of the tree, the shared one when NULL
+    virtual int32_t fit(const std::vector<const SPVEC*>& samples, const std::vector<TSVAL>* weights,
+                        Executor* executor = NULL, size_t max_threads = 0) {
+        return 0;
+    }
 
     virtual LeafPayLoad* new_payload() = 0;
+    // copy of the payload and its members, the tree inserts into a copy and publishes it
+    // so that searches in flight keep reading the old one
+    virtual LeafPayLoad* clone() const = 0;
     virtual void dispose(LeafPayLoad** t) = 0;
+    virtual ~LeafPayLoad() {}
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,200 @@
+#include "quantized_payload.hpp"
+#include "half.hpp"
+#include "topk.hpp"
+#include <algorithm>
+#include <cmath>
+
+static inline TSVAL decode(int8_t c) {
+    return c;
+}
+
+static inline TSVAL decode(uint16_t c) {
+    return half_to_float(c);
+}
+
+// dot product of the query with the member stored in [p, e), both sorted by dim
+template <typename C>
+static inline TSVAL merge_dot(const int32_t* dims, const C* codes, uint32_t p, uint32_t e,
+                              const std::vector<int32_t>& qd, const std::vector<TSVAL>& qv) {
+    size_t q = 0;
+    TSVAL s = 0;
+    while (p < e && q < qd.size()) {
+        if (dims[p] < qd[q]) {
+            p++;
+        } else if (dims[p] > qd[q]) {
+            q++;
+        } else {
+            s += qv[q] * decode(codes[p]);
+            p++;
+            q++;
+        }
+    }
+
+    return s;
+}
+
+QuantizedPayLoad::QuantizedPayLoad(VectorBase* base, size_t max_size, int32_t precision):
+    _max_size(max_size),
+    _precision(precision),
+    _vec_base(base) {
+    this->_offsets.push_back(0);
+}
+
+size_t QuantizedPayLoad::size() {
+    return this->_ids.size();
+}
+
+int32_t QuantizedPayLoad::insert(int32_t id, TSVAL weight, const SPVEC& v) {
+    TSVAL scale = 1;
+    if (this->_precision == QUANT_INT8) {
+        TSVAL m = 0;
+        for (auto iter = v.begin(); iter != v.end(); iter++) {
+            m = std::max(m, (TSVAL)fabs(*iter));
+        }
+        scale = m > 0 ? m / 127 : 1;
+    }
+
+    std::vector<int32_t> dims;
+    std::vector<int8_t> codes8;
+    std::vector<uint16_t> codes16;
+    for (auto iter = v.begin(); iter != v.end(); iter++) {
+        dims.push_back(iter.index());
+        if (this->_precision == QUANT_INT8) {
+            codes8.push_back((int8_t)lrintf(*iter / scale));
+        } else {
+            codes16.push_back(float_to_half(*iter));
+        }
+    }
+
+    // a member inserted again replaces its span in place, the later spans shift
+    size_t i = std::find(this->_ids.begin(), this->_ids.end(), id) - this->_ids.begin();
+    if (i == this->_ids.size()) {
+        this->_ids.push_back(id);
+        this->_weights.push_back(weight);
+        this->_scales.push_back(scale);
+        this->_offsets.push_back(this->_offsets.back());
+    }
+    this->_weights[i] = weight;
+    this->_scales[i] = scale;
+
+    uint32_t begin = this->_offsets[i];
+    uint32_t end = this->_offsets[i + 1];
+    this->_dims.erase(this->_dims.begin() + begin, this->_dims.begin() + end);
+    this->_dims.insert(this->_dims.begin() + begin, dims.begin(), dims.end());
+    if (this->_precision == QUANT_INT8) {
+        this->_codes8.erase(this->_codes8.begin() + begin, this->_codes8.begin() + end);
+        this->_codes8.insert(this->_codes8.begin() + begin, codes8.begin(), codes8.end());
+    } else {
+        this->_codes16.erase(this->_codes16.begin() + begin, this->_codes16.begin() + end);
+        this->_codes16.insert(this->_codes16.begin() + begin, codes16.begin(), codes16.end());
+    }
+    for (size_t j = i + 1; j < this->_offsets.size(); j++) {
+        this->_offsets[j] = this->_offsets[j] - end + begin + dims.size();
+    }
+    return 0;
+}
+
+size_t QuantizedPayLoad::score(const SPVEC& x, std::vector<std::pair<int32_t, TSVAL>>& ret) const {
+    std::vector<int32_t> qd;
+    std::vector<TSVAL> qv;
+    qd.reserve(x.nnz());
+    qv.reserve(x.nnz());
+    for (auto iter = x.begin(); iter != x.end(); iter++) {
+        qd.push_back(iter.index());
+        qv.push_back(*iter);
+    }
+
+    ret.resize(this->_ids.size());
+    for (size_t i = 0; i < this->_ids.size(); i++) {
+        TSVAL s;
+        if (this->_precision == QUANT_INT8) {
+            s = merge_dot(this->_dims.data(), this->_codes8.data(), this->_offsets[i], this->_offsets[i + 1], qd, qv);
+        } else {
+            s = merge_dot(this->_dims.data(), this->_codes16.data(), this->_offsets[i], this->_offsets[i + 1], qd, qv);
+        }
+        ret[i] = std::make_pair(this->_ids[i], s * this->_scales[i]);
+    }
+
+    return ret.size();
+}
+
+std::vector<std::pair<int32_t, TSVAL>> QuantizedPayLoad::search(const SPVEC& x, size_t k, size_t rerank) const {
+    std::vector<std::pair<int32_t, TSVAL>> scores;
+    this->score(x, scores);
+
+    // Topk keeps the smallest values, so the scores are negated
+    Topk<int32_t, TSVAL> topk(std::max(k, rerank));
+    for (auto iter = scores.begin(); iter != scores.end(); iter++) {
+        topk.insert(iter->first, -iter->second);
+    }
+
+    std::vector<std::pair<int32_t, TSVAL>> res;
+    topk.finalize(res);
+
+    if (rerank > 0) {
+        for (size_t i = 0; i < std::min(rerank, res.size()); i++) {
+            res[i].second = -boost::numeric::ublas::inner_prod(this->_vec_base->at(res[i].first), x);
+        }
+        std::stable_sort(res.begin(), res.end(), CompareByValue<int32_t, TSVAL>());
+    }
+
+    if (res.size() > k) {
+        res.resize(k);
+    }
+    for (auto iter = res.begin(); iter != res.end(); iter++) {
+        iter->second = -iter->second;
+    }
+
+    return res;
+}
+
+size_t QuantizedPayLoad::memory_bytes() const {
+    return sizeof(*this)
+        + this->_ids.capacity() * sizeof(int32_t)
+        + this->_weights.capacity() * sizeof(TSVAL)
+        + this->_offsets.capacity() * sizeof(uint32_t)
+        + this->_dims.capacity() * sizeof(int32_t)
+        + this->_codes8.capacity() * sizeof(int8_t)
+        + this->_codes16.capacity() * sizeof(uint16_t)
+        + this->_scales.capacity() * sizeof(TSVAL);
+}
+
+std::vector<SPVEC> QuantizedPayLoad::get_all_vectors() {
+    std::vector<SPVEC> ret;
+    for (auto iter = this->_ids.begin(); iter != this->_ids.end(); iter++) {
+        ret.push_back(this->_vec_base->at(*iter));
+    }
+
+    return ret;
+}
+
+std::set<int32_t> QuantizedPayLoad::get_all_ids() {
+    return std::set<int32_t>(this->_ids.begin(), this->_ids.end());
+}
+
+size_t QuantizedPayLoad::get_all_vector_ptrs(std::vector<const SPVEC*>& ret) const {
+    ret.clear();
+    for (auto iter = this->_ids.begin(); iter != this->_ids.end(); iter++) {
+        ret.push_back(&this->_vec_base->at(*iter));
+    }
+
+    return ret.size();
+}
+
+size_t QuantizedPayLoad::get_all_ids(std::vector<int32_t>& ret) const {
+    ret.assign(this->_ids.begin(), this->_ids.end());
+    return ret.size();
+}
+
+LeafPayLoad* QuantizedPayLoad::clone() const {
+    return new QuantizedPayLoad(*this);
+}
+
+LeafPayLoad* QuantizedPayLoad::new_payload() {
+    return new QuantizedPayLoad(this->_vec_base, this->_max_size, this->_precision);
+}
+
+void QuantizedPayLoad::dispose(LeafPayLoad** t) {
+    delete *t;
+    *t = NULL;
+}
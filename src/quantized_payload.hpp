@@ -0,0 +1,48 @@
+#ifndef QUANTIZED_PAYLOAD_HPP
+#define QUANTIZED_PAYLOAD_HPP
+#include "payload.hpp"
+#include "sparse.hpp"
+#include "vector_base.hpp"
+
+#define QUANT_INT8 0
+#define QUANT_FP16 1
+
+// Leaf payload storing the sparse vectors of its members inline and contiguously,
+// with quantized values, so that a leaf is scored in one sequential scan. Exact
+// scores are still available through the VectorBase for reranking.
+class QuantizedPayLoad : public LeafPayLoad {
+public:
+    size_t size();
+    int32_t insert(int32_t id, TSVAL weight, const SPVEC& v);
+    std::vector<SPVEC> get_all_vectors();
+    std::set<int32_t> get_all_ids();
+    size_t get_all_vector_ptrs(std::vector<const SPVEC*>& ret) const;
+    size_t get_all_ids(std::vector<int32_t>& ret) const;
+
+    // approximated dot product of x with every member, in insertion order
+    size_t score(const SPVEC& x, std::vector<std::pair<int32_t, TSVAL>>& ret) const;
+    // top k members by dot product, the best rerank ones of the scan are rescored exactly
+    std::vector<std::pair<int32_t, TSVAL>> search(const SPVEC& x, size_t k, size_t rerank = 0) const;
+    size_t memory_bytes() const;
+
+    LeafPayLoad* new_payload();
+    LeafPayLoad* clone() const;
+    void dispose(LeafPayLoad** t);
+
+    QuantizedPayLoad(VectorBase* base, size_t max_size, int32_t precision = QUANT_INT8);
+private:
+    size_t _max_size;
+    int32_t _precision;
+    VectorBase* _vec_base;
+
+    std::vector<int32_t> _ids;
+    std::vector<TSVAL> _weights;
+    // member i owns [_offsets[i], _offsets[i+1]) of _dims and the codes
+    std::vector<uint32_t> _offsets;
+    std::vector<int32_t> _dims;
+    std::vector<int8_t> _codes8;
+    std::vector<uint16_t> _codes16;
+    std::vector<TSVAL> _scales;
+};
+
+#endif
@@ -0,0 +1,78 @@
+#ifndef RANDOM_HPP
+#define RANDOM_HPP
+#include <stdint.h>
+
+// Counter based generator, Philox4x32-10. Every block of 4 words is a pure function
+// of the key and the counter (block index, stream), so draws can be addressed by index
+// from any thread without locks and reproduce for any thread count.
+class PhiloxRng {
+public:
+    PhiloxRng(uint64_t seed, uint64_t stream = 0): _stream(stream), _pos(0) {
+        this->_key[0] = (uint32_t)seed;
+        this->_key[1] = (uint32_t)(seed >> 32);
+    }
+
+    void block(uint64_t i, uint32_t out[4]) const {
+        uint32_t c[4] = {(uint32_t)i, (uint32_t)(i >> 32), (uint32_t)this->_stream, (uint32_t)(this->_stream >> 32)};
+        uint32_t k0 = this->_key[0];
+        uint32_t k1 = this->_key[1];
+        for (int32_t r = 0; r < 10; r++) {
+            if (r > 0) {
+                k0 += 0x9E3779B9;
+                k1 += 0xBB67AE85;
+            }
+            uint64_t p0 = (uint64_t)0xD2511F53 * c[0];
+            uint64_t p1 = (uint64_t)0xCD9E8D57 * c[2];
+            uint32_t n0 = (uint32_t)(p1 >> 32) ^ c[1] ^ k0;
+            uint32_t n2 = (uint32_t)(p0 >> 32) ^ c[3] ^ k1;
+            c[0] = n0;
+            c[1] = (uint32_t)p1;
+            c[2] = n2;
+            c[3] = (uint32_t)p0;
+        }
+        out[0] = c[0];
+        out[1] = c[1];
+        out[2] = c[2];
+        out[3] = c[3];
+    }
+
+    uint64_t u64_at(uint64_t i) const {
+        uint32_t out[4];
+        this->block(i, out);
+        return ((uint64_t)out[1] << 32) | out[0];
+    }
+
+    // uniform in [0, 1)
+    double uniform_at(uint64_t i) const {
+        return (this->u64_at(i) >> 11) * (1.0 / 9007199254740992.0);
+    }
+
+    // sequential draws, for the serial parts of the training
+    uint64_t next() {
+        return this->u64_at(this->_pos++);
+    }
+
+    double uniform() {
+        return this->uniform_at(this->_pos++);
+    }
+
+    // uniform in [0, n)
+    uint64_t below(uint64_t n) {
+        return this->next() % n;
+    }
+
+private:
+    uint32_t _key[2];
+    uint64_t _stream;
+    uint64_t _pos;
+};
+
+// seed of the i-th child of a node seeded by seed (splitmix64 of both)
+inline uint64_t mix_seed(uint64_t seed, uint64_t i) {
+    uint64_t z = seed + 0x9E3779B97F4A7C15ull * (i + 1);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+    return z ^ (z >> 31);
+}
+
+#endif
@@ -0,0 +1,331 @@
+#include "residual_pq_payload.hpp"
+#include "topk.hpp"
+#include "executor.hpp"
+#include <algorithm>
+#include <cmath>
+#include <map>
+
+ResidualPQPayLoad::ResidualPQPayLoad(VectorBase* base, size_t max_size, int32_t subspaces, int32_t centroids,
+                                     int32_t support, int32_t iterations):
+    _max_size(max_size),
+    _subspaces(std::max(subspaces, 1)),
+    _centroids(std::min(std::max(centroids, 1), 256)),
+    _max_support(std::max(support, 1)),
+    _iterations(iterations),
+    _vec_base(base) {
+}
+
+size_t ResidualPQPayLoad::size() {
+    return this->_ids.size();
+}
+
+int32_t ResidualPQPayLoad::fit(const std::vector<const SPVEC*>& samples, const std::vector<TSVAL>* weights,
+                               Executor* executor, size_t max_threads) {
+    if (samples.empty()) {
+        return 0;
+    }
+
+    // weighted center and absolute mass of every dim of the leaf
+    std::map<int32_t, std::pair<TSVAL, TSVAL>> dims;
+    TSVAL total = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        TSVAL w = weights != NULL ? (*weights)[i] : 1;
+        total += w;
+        for (auto iter = samples[i]->begin(); iter != samples[i]->end(); iter++) {
+            std::pair<TSVAL, TSVAL>& d = dims[iter.index()];
+            d.first += w * *iter;
+            d.second += w * fabs(*iter);
+        }
+    }
+
+    std::shared_ptr<Codebooks> trained = std::make_shared<Codebooks>();
+    trained->center = CPVEC(samples[0]->size(), dims.size());
+    std::vector<std::pair<int32_t, TSVAL>> mass;
+    for (auto iter = dims.begin(); iter != dims.end(); iter++) {
+        trained->center.push_back(iter->first, iter->second.first / total);
+        mass.push_back(std::make_pair(iter->first, -iter->second.second));
+    }
+    if (mass.empty()) {
+        return 0;
+    }
+
+    std::stable_sort(mass.begin(), mass.end(), CompareByValue<int32_t, TSVAL>());
+    if (mass.size() > this->_max_support) {
+        mass.resize(this->_max_support);
+    }
+    for (auto iter = mass.begin(); iter != mass.end(); iter++) {
+        trained->support.push_back(iter->first);
+    }
+    std::sort(trained->support.begin(), trained->support.end());
+    for (auto iter = trained->support.begin(); iter != trained->support.end(); iter++) {
+        trained->support_center.push_back(dims[*iter].first / total);
+    }
+
+    int32_t d = trained->support.size();
+    int32_t m = std::min(this->_subspaces, d);
+    for (int32_t j = 0; j <= m; j++) {
+        trained->bounds.push_back((int64_t)j * d / m);
+    }
+
+    size_t n = samples.size();
+    trained->ks = std::min((size_t)this->_centroids, n);
+    std::vector<TSVAL> residuals(n * d);
+    std::vector<TSVAL> r;
+    for (size_t i = 0; i < n; i++) {
+        trained->residual(*samples[i], r);
+        std::copy(r.begin(), r.end(), residuals.begin() + i * d);
+    }
+
+    // Lloyd iterations per subspace, seeded with evenly spaced samples
+    int32_t ks = trained->ks;
+    trained->codebooks.assign((size_t)ks * d, 0);
+    Executor& pool = executor != NULL ? *executor : Executor::shared();
+    pool.parallel_for(m, [&](int64_t begin, int64_t end) {
+        for (int32_t j = begin; j < end; j++) {
+            int32_t b = trained->bounds[j];
+            int32_t len = trained->bounds[j + 1] - b;
+            TSVAL* cb = trained->codebooks.data() + (size_t)ks * b;
+            for (int32_t c = 0; c < ks; c++) {
+                std::copy_n(residuals.begin() + (c * n / ks) * d + b, len, cb + c * len);
+            }
+
+            std::vector<int32_t> assignment(n, -1);
+            std::vector<TSVAL> sums((size_t)ks * len);
+            std::vector<TSVAL> counts(ks);
+            for (int32_t it = 0; it < this->_iterations; it++) {
+                bool changed = false;
+                for (size_t i = 0; i < n; i++) {
+                    const TSVAL* x = residuals.data() + i * d + b;
+                    int32_t best = 0;
+                    TSVAL best_dist = 0;
+                    for (int32_t c = 0; c < ks; c++) {
+                        TSVAL dist = 0;
+                        for (int32_t o = 0; o < len; o++) {
+                            TSVAL diff = x[o] - cb[c * len + o];
+                            dist += diff * diff;
+                        }
+                        if (c == 0 || dist < best_dist) {
+                            best = c;
+                            best_dist = dist;
+                        }
+                    }
+                    changed = changed || assignment[i] != best;
+                    assignment[i] = best;
+                }
+                if (!changed) {
+                    break;
+                }
+
+                std::fill(sums.begin(), sums.end(), 0);
+                std::fill(counts.begin(), counts.end(), 0);
+                for (size_t i = 0; i < n; i++) {
+                    TSVAL w = weights != NULL ? (*weights)[i] : 1;
+                    const TSVAL* x = residuals.data() + i * d + b;
+                    for (int32_t o = 0; o < len; o++) {
+                        sums[assignment[i] * len + o] += w * x[o];
+                    }
+                    counts[assignment[i]] += w;
+                }
+                // an empty centroid keeps its position
+                for (int32_t c = 0; c < ks; c++) {
+                    if (counts[c] > 0) {
+                        for (int32_t o = 0; o < len; o++) {
+                            cb[c * len + o] = sums[c * len + o] / counts[c];
+                        }
+                    }
+                }
+            }
+        }
+    }, PRIORITY_BUILD, max_threads, 1);
+
+    this->_trained = trained;
+    return 0;
+}
+
+void ResidualPQPayLoad::Codebooks::residual(const SPVEC& v, std::vector<TSVAL>& r) const {
+    r.resize(this->support_center.size());
+    for (size_t p = 0; p < r.size(); p++) {
+        r[p] = -this->support_center[p];
+    }
+    for (auto iter = v.begin(); iter != v.end(); iter++) {
+        auto pos = std::lower_bound(this->support.begin(), this->support.end(), (int32_t)iter.index());
+        if (pos != this->support.end() && *pos == iter.index()) {
+            r[pos - this->support.begin()] += *iter;
+        }
+    }
+}
+
+void ResidualPQPayLoad::Codebooks::encode(const std::vector<TSVAL>& r, uint8_t* codes) const {
+    for (size_t j = 0; j < this->subspaces(); j++) {
+        int32_t b = this->bounds[j];
+        int32_t len = this->bounds[j + 1] - b;
+        const TSVAL* cb = this->codebooks.data() + (size_t)this->ks * b;
+        int32_t best = 0;
+        TSVAL best_dist = 0;
+        for (int32_t c = 0; c < this->ks; c++) {
+            TSVAL dist = 0;
+            for (int32_t o = 0; o < len; o++) {
+                TSVAL diff = r[b + o] - cb[c * len + o];
+                dist += diff * diff;
+            }
+            if (c == 0 || dist < best_dist) {
+                best = c;
+                best_dist = dist;
+            }
+        }
+        codes[j] = best;
+    }
+}
+
+int32_t ResidualPQPayLoad::insert(int32_t id, TSVAL weight, const SPVEC& v) {
+    if (this->is_fitted()) {
+        std::vector<TSVAL> r;
+        this->_trained->residual(v, r);
+        size_t offset = this->_codes.size();
+        this->_codes.resize(offset + this->_trained->subspaces());
+        this->_trained->encode(r, this->_codes.data() + offset);
+    }
+
+    this->_ids.push_back(id);
+    this->_weights.push_back(weight);
+    return 0;
+}
+
+size_t ResidualPQPayLoad::score(const SPVEC& x, std::vector<std::pair<int32_t, TSVAL>>& ret) const {
+    ret.resize(this->_ids.size());
+    if (!this->is_fitted()) {
+        for (size_t i = 0; i < this->_ids.size(); i++) {
+            ret[i] = std::make_pair(this->_ids[i], (TSVAL)boost::numeric::ublas::inner_prod(this->_vec_base->at(this->_ids[i]), x));
+        }
+        return ret.size();
+    }
+
+    // dot product with the center, and one lookup table per subspace
+    const Codebooks& t = *this->_trained;
+    size_t m = t.subspaces();
+    int32_t ks = t.ks;
+    TSVAL qc = 0;
+    std::vector<TSVAL> lut(m * ks, 0);
+    auto c = t.center.begin();
+    for (auto iter = x.begin(); iter != x.end(); iter++) {
+        while (c != t.center.end() && c.index() < iter.index()) {
+            c++;
+        }
+        if (c != t.center.end() && c.index() == iter.index()) {
+            qc += *c * *iter;
+        }
+
+        auto pos = std::lower_bound(t.support.begin(), t.support.end(), (int32_t)iter.index());
+        if (pos == t.support.end() || *pos != iter.index()) {
+            continue;
+        }
+        int32_t p = pos - t.support.begin();
+        int32_t j = std::upper_bound(t.bounds.begin(), t.bounds.end(), p) - t.bounds.begin() - 1;
+        int32_t b = t.bounds[j];
+        int32_t len = t.bounds[j + 1] - b;
+        const TSVAL* cb = t.codebooks.data() + (size_t)ks * b + (p - b);
+        TSVAL* row = lut.data() + j * ks;
+        for (int32_t k = 0; k < ks; k++) {
+            row[k] += *iter * cb[k * len];
+        }
+    }
+
+    for (size_t i = 0; i < this->_ids.size(); i++) {
+        const uint8_t* codes = this->_codes.data() + i * m;
+        TSVAL s = qc;
+        for (size_t j = 0; j < m; j++) {
+            s += lut[j * ks + codes[j]];
+        }
+        ret[i] = std::make_pair(this->_ids[i], s);
+    }
+
+    return ret.size();
+}
+
+std::vector<std::pair<int32_t, TSVAL>> ResidualPQPayLoad::search(const SPVEC& x, size_t k, size_t rerank) const {
+    std::vector<std::pair<int32_t, TSVAL>> scores;
+    this->score(x, scores);
+
+    // Topk keeps the smallest values, so the scores are negated
+    Topk<int32_t, TSVAL> topk(std::max(k, rerank));
+    for (auto iter = scores.begin(); iter != scores.end(); iter++) {
+        topk.insert(iter->first, -iter->second);
+    }
+
+    std::vector<std::pair<int32_t, TSVAL>> res;
+    topk.finalize(res);
+
+    if (rerank > 0) {
+        for (size_t i = 0; i < std::min(rerank, res.size()); i++) {
+            res[i].second = -boost::numeric::ublas::inner_prod(this->_vec_base->at(res[i].first), x);
+        }
+        std::stable_sort(res.begin(), res.end(), CompareByValue<int32_t, TSVAL>());
+    }
+
+    if (res.size() > k) {
+        res.resize(k);
+    }
+    for (auto iter = res.begin(); iter != res.end(); iter++) {
+        iter->second = -iter->second;
+    }
+
+    return res;
+}
+
+size_t ResidualPQPayLoad::Codebooks::memory_bytes() const {
+    return sizeof(*this)
+        + this->center.nnz_capacity() * (sizeof(size_t) + sizeof(TSVAL))
+        + this->support.capacity() * sizeof(int32_t)
+        + this->support_center.capacity() * sizeof(TSVAL)
+        + this->bounds.capacity() * sizeof(int32_t)
+        + this->codebooks.capacity() * sizeof(TSVAL);
+}
+
+size_t ResidualPQPayLoad::memory_bytes() const {
+    return sizeof(*this)
+        + this->_ids.capacity() * sizeof(int32_t)
+        + this->_weights.capacity() * sizeof(TSVAL)
+        + (this->_trained != NULL ? this->_trained->memory_bytes() : 0)
+        + this->_codes.capacity() * sizeof(uint8_t);
+}
+
+std::vector<SPVEC> ResidualPQPayLoad::get_all_vectors() {
+    std::vector<SPVEC> ret;
+    for (auto iter = this->_ids.begin(); iter != this->_ids.end(); iter++) {
+        ret.push_back(this->_vec_base->at(*iter));
+    }
+
+    return ret;
+}
+
+std::set<int32_t> ResidualPQPayLoad::get_all_ids() {
+    return std::set<int32_t>(this->_ids.begin(), this->_ids.end());
+}
+
+size_t ResidualPQPayLoad::get_all_vector_ptrs(std::vector<const SPVEC*>& ret) const {
+    ret.clear();
+    for (auto iter = this->_ids.begin(); iter != this->_ids.end(); iter++) {
+        ret.push_back(&this->_vec_base->at(*iter));
+    }
+
+    return ret.size();
+}
+
+size_t ResidualPQPayLoad::get_all_ids(std::vector<int32_t>& ret) const {
+    ret.assign(this->_ids.begin(), this->_ids.end());
+    return ret.size();
+}
+
+LeafPayLoad* ResidualPQPayLoad::clone() const {
+    return new ResidualPQPayLoad(*this);
+}
+
+LeafPayLoad* ResidualPQPayLoad::new_payload() {
+    return new ResidualPQPayLoad(this->_vec_base, this->_max_size, this->_subspaces, this->_centroids,
+                                 this->_max_support, this->_iterations);
+}
+
+void ResidualPQPayLoad::dispose(LeafPayLoad** t) {
+    delete *t;
+    *t = NULL;
+}
@@ -0,0 +1,80 @@
+#ifndef RESIDUAL_PQ_PAYLOAD_HPP
+#define RESIDUAL_PQ_PAYLOAD_HPP
+#include "payload.hpp"
+#include "sparse.hpp"
+#include "vector_base.hpp"
+#include <memory>
+
+// Leaf payload storing every member as the product quantized residual to the leaf
+// center. fit() learns the center, the support (the dims of the largest mass in the
+// leaf), split into contiguous subspaces, and a codebook per subspace. A member is
+// then one byte per subspace, its residual outside the support is dropped. A query
+// builds one lookup table of dot products per subspace and scores every member with
+// one lookup per subspace, exact scores come from the VectorBase for reranking.
+// A payload never fitted falls back to exact scoring. The trained state never changes
+// after fit(), so the clones made on insert share it and copy only the members.
+class ResidualPQPayLoad : public LeafPayLoad {
+public:
+    size_t size();
+    int32_t insert(int32_t id, TSVAL weight, const SPVEC& v);
+    std::vector<SPVEC> get_all_vectors();
+    std::set<int32_t> get_all_ids();
+    size_t get_all_vector_ptrs(std::vector<const SPVEC*>& ret) const;
+    size_t get_all_ids(std::vector<int32_t>& ret) const;
+    int32_t fit(const std::vector<const SPVEC*>& samples, const std::vector<TSVAL>* weights,
+                Executor* executor = NULL, size_t max_threads = 0);
+
+    // approximated dot product of x with every member, in insertion order
+    size_t score(const SPVEC& x, std::vector<std::pair<int32_t, TSVAL>>& ret) const;
+    // top k members by dot product, the best rerank ones of the scan are rescored exactly
+    std::vector<std::pair<int32_t, TSVAL>> search(const SPVEC& x, size_t k, size_t rerank = 0) const;
+    size_t memory_bytes() const;
+
+    bool is_fitted() const {
+        return this->_trained != NULL;
+    }
+
+    LeafPayLoad* new_payload();
+    LeafPayLoad* clone() const;
+    void dispose(LeafPayLoad** t);
+
+    // codes are one byte, centroids is at most 256
+    ResidualPQPayLoad(VectorBase* base, size_t max_size, int32_t subspaces = 16, int32_t centroids = 64,
+                      int32_t support = 256, int32_t iterations = 10);
+private:
+    size_t _max_size;
+    int32_t _subspaces;
+    int32_t _centroids;
+    int32_t _max_support;
+    int32_t _iterations;
+    VectorBase* _vec_base;
+
+    std::vector<int32_t> _ids;
+    std::vector<TSVAL> _weights;
+
+    struct Codebooks {
+        CPVEC center;
+        // sorted support dims and the center on them
+        std::vector<int32_t> support;
+        std::vector<TSVAL> support_center;
+        // subspace j covers the support positions [bounds[j], bounds[j+1]), its centroid c
+        // is at codebooks[ks * bounds[j] + c * (bounds[j+1] - bounds[j])]
+        std::vector<int32_t> bounds;
+        // centroids per subspace, no more than the training samples
+        int32_t ks;
+        std::vector<TSVAL> codebooks;
+
+        size_t subspaces() const {
+            return this->bounds.size() - 1;
+        }
+        // dense residual of v to the center on the support
+        void residual(const SPVEC& v, std::vector<TSVAL>& r) const;
+        void encode(const std::vector<TSVAL>& r, uint8_t* codes) const;
+        size_t memory_bytes() const;
+    };
+    std::shared_ptr<const Codebooks> _trained;
+    // member i owns [i * subspaces, (i+1) * subspaces)
+    std::vector<uint8_t> _codes;
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include "sample_stream.hpp"
+#include "sparse_kmeans.hpp"
+#include <iostream>
+#include <algorithm>
+
+SampleStream::SampleStream(std::string filename, int32_t dim, STR_HASH_FUNC(f), bool self_inc_id,
+                           Executor* executor, size_t max_threads) {
+    this->_executor = executor;
+    this->_max_threads = max_threads;
+    this->_dim = dim;
+    this->_hash_func = f;
+    this->_self_inc_id = self_inc_id;
+    this->_exhausted = false;
+    this->_inc = 0;
+    this->_read = 0;
+    this->_count = -1;
+    this->_block_bytes = 0;
+    this->_line_bytes = 0;
+    this->_pending = false;
+    this->_pending_id = 0;
+
+    this->_stream.open(filename);
+    if (!this->_stream.is_open()) {
+        std::cerr << "invalid file" << std::endl;
+        this->_exhausted = true;
+    }
+}
+
+bool SampleStream::is_open() const {
+    return this->_stream.is_open();
+}
+
+bool SampleStream::exhausted() const {
+    return this->_exhausted;
+}
+
+int32_t SampleStream::rewind() {
+    if (!this->_stream.is_open()) {
+        return EXK_FAIL;
+    }
+
+    this->_stream.clear();
+    this->_stream.seekg(0);
+    this->_exhausted = false;
+    this->_inc = 0;
+    this->_read = 0;
+    this->_pending = false;
+    return EXK_SUC;
+}
+
+bool SampleStream::read_line(int32_t& id, std::string& json_content) {
+    std::string buf;
+    if (this->_self_inc_id) {
+        std::getline(this->_stream, buf, '\t');
+        if (buf.size() == 0) {
+            return false;
+        }
+        id = std::stol(buf);
+    } else {
+        id = this->_inc;
+        this->_inc++;
+    }
+
+    std::getline(this->_stream, json_content, '\n');
+    return json_content.size() > 0;
+}
+
+int32_t SampleStream::next_block(std::vector<std::pair<int32_t, SPVEC>>& block, size_t max_bytes, size_t min_count,
+                                 size_t sample_bytes) {
+    block.clear();
+    if (this->_exhausted) {
+        return EXK_END;
+    }
+
+    // the nnz of a line is bounded by its ':' separators before parsing, so that the
+    // raw lines can be parsed in parallel afterwards. A line is held with its id and
+    // string, twice for the growth of their vectors, and its characters. A line past
+    // max_bytes is kept for the next block, a block has one line at least
+    size_t bytes = 0;
+    size_t raw = 0;
+    std::vector<int32_t> ids;
+    std::vector<std::string> lines;
+    while (true) {
+        int32_t id;
+        std::string json_content;
+        if (this->_pending) {
+            id = this->_pending_id;
+            json_content.swap(this->_pending_line);
+            this->_pending = false;
+        } else if (!this->read_line(id, json_content)) {
+            this->_exhausted = true;
+            break;
+        }
+
+        size_t line = 2 * (sizeof(int32_t) + sizeof(std::string)) + json_content.capacity();
+        size_t parsed = SPVEC_BASE_BYTES + sample_bytes + std::count(json_content.begin(), json_content.end(), ':') * SPVEC_NNZ_BYTES;
+        if (bytes + line + parsed > max_bytes && lines.size() >= std::max(min_count, (size_t)1)) {
+            this->_pending = true;
+            this->_pending_id = id;
+            this->_pending_line.swap(json_content);
+            break;
+        }
+
+        bytes += line + parsed;
+        raw += line;
+        ids.push_back(id);
+        lines.push_back(std::string());
+        lines.back().swap(json_content);
+    }
+    this->_read += lines.size();
+
+    if (!this->_pending && this->_stream.peek() == EOF) {
+        this->_exhausted = true;
+    }
+    if (this->_exhausted) {
+        this->_count = this->_read;
+    }
+
+    block.resize(lines.size());
+    Executor& pool = this->_executor != NULL ? *this->_executor : Executor::shared();
+    pool.parallel_for(lines.size(), [&](int64_t begin, int64_t end) {
+        for (int32_t i = begin; i < end; i++) {
+            block[i].first = ids[i];
+            if (this->_hash_func == NULL) {
+                block[i].second = sp_vec_from_string(lines[i], this->_dim);
+            } else {
+                block[i].second = sp_vec_from_string(lines[i], this->_dim, this->_hash_func);
+            }
+        }
+    }, PRIORITY_BUILD, this->_max_threads);
+
+    this->_line_bytes = raw;
+    this->_block_bytes = 0;
+    for (auto iter = block.begin(); iter != block.end(); iter++) {
+        this->_block_bytes += sp_vec_bytes(iter->second) + sample_bytes;
+    }
+
+    return block.size() > 0 ? EXK_SUC : EXK_END;
+}
+
+size_t SampleStream::count() {
+    if (this->_count >= 0) {
+        return this->_count;
+    }
+    this->rewind();
+
+    size_t ret = 0;
+    int32_t id;
+    std::string json_content;
+    while (this->read_line(id, json_content)) {
+        ret++;
+    }
+
+    this->rewind();
+    this->_count = ret;
+    return ret;
+}
+
+size_t sp_vec_bytes(const SPVEC& v) {
+    return SPVEC_BASE_BYTES + v.nnz() * SPVEC_NNZ_BYTES;
+}
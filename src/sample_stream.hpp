@@ -0,0 +1,73 @@
+#ifndef SAMPLE_STREAM_HPP
+#define SAMPLE_STREAM_HPP
+
+#include "sparse.hpp"
+#include <fstream>
+#include <vector>
+
+class Executor;
+
+// rough heap cost of a mapped_vector, used to keep blocks within the memory budget
+#define SPVEC_BASE_BYTES 64
+#define SPVEC_NNZ_BYTES 48
+
+// Reads samples from a file in the same "[id\t]json" line format as VectorBase,
+// one bounded block at a time, so that corpora larger than RAM can be trained on.
+class SampleStream {
+public:
+    bool is_open() const;
+    int32_t rewind();
+    // sample_bytes is what the caller keeps per sample of the block besides the vector,
+    // counted against max_bytes too, with the raw lines held until they are parsed
+    int32_t next_block(std::vector<std::pair<int32_t, SPVEC>>& block, size_t max_bytes, size_t min_count = 0,
+                       size_t sample_bytes = 0);
+    // of the last block, the parsed samples with their sample_bytes, and the raw lines
+    // freed once it is returned, together they are its peak
+    size_t block_bytes() const {
+        return this->_block_bytes;
+    }
+    size_t line_bytes() const {
+        return this->_line_bytes;
+    }
+    bool exhausted() const;
+    // number of samples, scanned once and kept, or known from a pass of next_block
+    // reaching the end
+    size_t count();
+    // for files whose writer knows how many samples it wrote, count() then never scans
+    void set_count(size_t count) {
+        this->_count = count;
+    }
+    int32_t dim() const {
+        return this->_dim;
+    }
+
+    // blocks are parsed in parallel on executor, the shared one when NULL, with at most
+    // max_threads threads
+    SampleStream(std::string filename, int32_t dim, STR_HASH_FUNC(f) = NULL, bool self_inc_id = false,
+                 Executor* executor = NULL, size_t max_threads = 0);
+
+private:
+    std::ifstream _stream;
+    int32_t _dim;
+    STR_HASH_FUNC(_hash_func);
+    bool _self_inc_id;
+    bool _exhausted;
+    int32_t _inc;
+    // lines read since the last rewind, and the count once known, -1 before
+    size_t _read;
+    int64_t _count;
+    size_t _block_bytes;
+    size_t _line_bytes;
+    // the line read past the end of the last block, first of the next one
+    bool _pending;
+    int32_t _pending_id;
+    std::string _pending_line;
+    Executor* _executor;
+    size_t _max_threads;
+
+    bool read_line(int32_t& id, std::string& json_content);
+};
+
+size_t sp_vec_bytes(const SPVEC& v);
+
+#endif
@@ -12,6 +12,7 @@
 #define SPVEC boost::numeric::ublas::mapped_vector<TSVAL>
 #define DSVEC boost::numeric::ublas::vector<TSVAL>
 #define SPMTX boost::numeric::ublas::mapped_matrix<TSVAL>
+#define CPVEC boost::numeric::ublas::compressed_vector<TSVAL>
 
 #define STR_HASH_FUNC(n) int32_t (*n)(std::string)
 
@@ -56,8 +57,17 @@ inline std::string sp_vec_to_string(const SPVEC& v) {
     } 
 
     stream << "]";
-    
+
     return stream.str();
 }
 
+inline std::string sp_vec_to_json(const SPVEC& v) {
+    nlohmann::json obj = nlohmann::json::object();
+    for (auto iter = v.begin(); iter != v.end(); iter++) {
+        obj[std::to_string(iter.index())] = *iter;
+    }
+
+    return obj.dump();
+}
+
 #endif 
\ No newline at end of file
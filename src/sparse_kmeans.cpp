@@ -1,13 +1,75 @@
 #include "sparse_kmeans.hpp"
 #include "topk.hpp"
+#include "sample_stream.hpp"
+#include "half.hpp"
+#include "distance.hpp"
+#include "random.hpp"
 
 #include <stdlib.h>
 #include <string>
 #include <set>
-#include <omp.h>
 #include <algorithm>
+#include <functional>
+#include <queue>
 
 
+// inversed norm, zero vectors stay zero
+static TSVAL sample_scale(const SPVEC& v) {
+    TSVAL norm = boost::numeric::ublas::norm_2(v);
+    return norm > 0 ? 1 / norm : 0;
+}
+
+// c += w * v
+static void add_scaled(DSVEC& c, const SPVEC& v, TSVAL w) {
+    for (auto iter = v.begin(); iter != v.end(); iter++) {
+        c(iter.index()) += w * *iter;
+    }
+}
+
+static void normalize_center(DSVEC& c) {
+    TSVAL norm = boost::numeric::ublas::norm_2(c);
+    if (norm > 0) {
+        c /= norm;
+    }
+}
+
+static int32_t dist_policy_of(DENSE_SPARSE_DIST_FUNC(f)) {
+    if (f == inversed_dense_sparse_dot) {
+        return DP_INVERSED_DOT;
+    } else if (f == dense_sparse_l2_distance_sq) {
+        return DP_L2_SQ;
+    } else if (f == dense_sparse_l2_distance) {
+        return DP_L2;
+    } else if (f == negative_dense_sparse_dot) {
+        return DP_NEGATIVE_DOT;
+    }
+
+    return DP_CUSTOM;
+}
+
+static int32_t sparse_dist_policy_of(SPARSE_SPARSE_DIST_FUNC(f)) {
+    if (f == inversed_sparse_sparse_dot) {
+        return DP_INVERSED_DOT;
+    } else if (f == sparse_sparse_l2_distance_sq) {
+        return DP_L2_SQ;
+    } else if (f == sparse_sparse_l2_distance) {
+        return DP_L2;
+    } else if (f == negative_sparse_sparse_dot) {
+        return DP_NEGATIVE_DOT;
+    }
+
+    return DP_CUSTOM;
+}
+
+// maps the dot products in scores to the distances, in place
+template <typename P>
+static void finish_scores(TSVAL* scores, const TSVAL* center_norms, TSVAL x_norm, size_t n) {
+    #pragma omp simd
+    for (size_t i = 0; i < n; i++) {
+        scores[i] = P::dist(scores[i], center_norms[i], x_norm);
+    }
+}
+
 SparseKMeansModel::SparseKMeansModel(size_t k, size_t iterations, 
                                      bool exclusive, 
                                      const char* initiator, 
@@ -15,6 +77,8 @@ SparseKMeansModel::SparseKMeansModel(size_t k, size_t iterations,
                                      SAMPLE_DEGREE_FUNC(degree_func),
                                      float cut_rate) {
     this->_k = k;
+    this->_max_k = k;
+    this->_node_k_func = fixed_node_k;
     this->_iters = iterations;
     this->_exclusive = exclusive;
     this->_init_mode = initiator;   
@@ -24,26 +88,316 @@ SparseKMeansModel::SparseKMeansModel(size_t k, size_t iterations,
         //std::cerr << "Distance function is NULL, the clustering algorith will crash!" << std::endl;
     }
     this->_cut_rate = cut_rate;
+    this->_prune_top_m = 0;
+    this->_prune_mass = 0;
+    this->_sparse_dist_func = NULL;
+    this->_dim_major = false;
+    this->_policy = dist_policy_of(dist_func);
+    this->_sparse_policy = DP_CUSTOM;
+    this->_inverted = false;
+    this->_precision = CENTER_FP32;
+    this->_balance = BALANCE_NONE;
+    this->_balance_param = 0;
+    this->_seed = 0;
+    this->_metrics = NULL;
+    this->_executor = NULL;
+    this->_max_threads = 0;
+    this->_parallel_fits = 0;
+    this->_recoveries = 0;
+    this->_subsample_max = 0;
+    this->_subsample_fraction = 0;
+    this->_subsample_quality = SubsampleQuality{0, 0, 0, 0};
+    this->_fit_iterations = 0;
+    this->_inertia = 0;
+    this->_samples = NULL;
+    this->_weights = NULL;
 }
 
 SparseKMeansModel::SparseKMeansModel(const SparseKMeansModel& t) {
     this->_k = t._k;
+    this->_max_k = t._max_k;
+    this->_node_k_func = t._node_k_func;
+    this->_level_k_caps = t._level_k_caps;
     this->_iters = t._iters;
     this->_exclusive = t._exclusive;
     this->_init_mode = t._init_mode;
     this->_dist_func = t._dist_func;
+    this->_sample_degree_func = t._sample_degree_func;
     if (this->_dist_func == NULL) {
         //std::cerr << "Distance function is NULL, the clustering algorith will crash!" << std::endl;
     }
     this->_cut_rate = t._cut_rate;
+    this->_prune_top_m = t._prune_top_m;
+    this->_prune_mass = t._prune_mass;
+    this->_sparse_dist_func = t._sparse_dist_func;
+    this->_dim_major = t._dim_major;
+    this->_policy = t._policy;
+    this->_sparse_policy = t._sparse_policy;
+    this->_inverted = t._inverted;
+    this->_precision = t._precision;
+    this->_balance = t._balance;
+    this->_balance_param = t._balance_param;
+    this->_seed = t._seed;
+    this->_metrics = t._metrics;
+    this->_executor = t._executor;
+    this->_max_threads = t._max_threads;
+    this->_parallel_fits = t._parallel_fits;
+    this->_recoveries = 0;
+    this->_subsample_max = t._subsample_max;
+    this->_subsample_fraction = t._subsample_fraction;
+    this->_subsample_quality = SubsampleQuality{0, 0, 0, 0};
+    this->_fit_iterations = 0;
+    this->_inertia = 0;
+    this->_samples = NULL;
+    this->_weights = NULL;
+}
+
+int32_t SparseKMeansModel::set_dimension_major(bool dim_major) {
+    if (!dim_major) {
+        this->_dim_major = false;
+        return EXK_SUC;
+    }
+
+    if (this->_policy == DP_CUSTOM) {
+        std::cerr << "The distance function is not dot based, dimension major layout is not enabled" << std::endl;
+        return EXK_FAIL;
+    }
+
+    this->_dim_major = true;
+    return EXK_SUC;
+}
+
+int32_t SparseKMeansModel::set_inverted_index(bool inverted) {
+    if (!inverted) {
+        this->_inverted = false;
+        return EXK_SUC;
+    }
+
+    if (!this->is_pruned()) {
+        std::cerr << "The inverted index is built from pruned centers, enable pruning first" << std::endl;
+        return EXK_FAIL;
+    }
+
+    if (this->_policy == DP_CUSTOM) {
+        std::cerr << "The distance function is not dot based, inverted index is not enabled" << std::endl;
+        return EXK_FAIL;
+    }
+
+    this->_inverted = true;
+    return EXK_SUC;
+}
+
+int32_t SparseKMeansModel::set_balance(int32_t mode, float param) {
+    if (mode == BALANCE_SOFT && param < 0) {
+        return EXK_FAIL;
+    } else if (mode == BALANCE_HARD && param < 1) {
+        return EXK_FAIL;
+    } else if (mode != BALANCE_NONE && mode != BALANCE_SOFT && mode != BALANCE_HARD) {
+        return EXK_FAIL;
+    }
+
+    this->_balance = mode;
+    this->_balance_param = param;
+    return EXK_SUC;
+}
+
+void SparseKMeansModel::set_node_k(NODE_K_FUNC(func), const std::vector<size_t>& level_k_caps) {
+    this->_node_k_func = func;
+    this->_level_k_caps = level_k_caps;
+}
+
+size_t SparseKMeansModel::node_k(size_t samples, size_t max_node_size, size_t depth) const {
+    size_t k = this->_node_k_func(samples, max_node_size, this->_max_k);
+    if (depth < this->_level_k_caps.size() && this->_level_k_caps[depth] > 0) {
+        k = std::min(k, this->_level_k_caps[depth]);
+    }
+    return std::max(std::min(k, this->_max_k), (size_t)1);
+}
+
+int32_t SparseKMeansModel::set_k(size_t k) {
+    if (k == 0 || k > this->_max_k) {
+        return EXK_FAIL;
+    }
+
+    this->_k = k;
+    return EXK_SUC;
+}
+
+int32_t SparseKMeansModel::set_initial_centers(const std::vector<DSVEC>& centers) {
+    if (centers.empty() || centers.size() > this->_max_k) {
+        return EXK_FAIL;
+    }
+
+    this->_initial_centers = centers;
+    this->_k = centers.size();
+    return EXK_SUC;
+}
+
+std::vector<DSVEC> SparseKMeansModel::export_centers() const {
+    if (!this->_centers.empty()) {
+        return this->_centers;
+    }
+
+    std::vector<DSVEC> ret;
+    if (this->is_pruned()) {
+        for (auto iter = this->_sparse_centers.begin(); iter != this->_sparse_centers.end(); iter++) {
+            DSVEC c(iter->size());
+            std::fill(c.begin(), c.end(), 0);
+            for (auto w = iter->begin(); w != iter->end(); w++) {
+                c(w.index()) = *w;
+            }
+            ret.push_back(c);
+        }
+    } else {
+        for (size_t i = 0; i < this->_center_norms.size(); i++) {
+            ret.push_back(this->frozen_center(i));
+        }
+    }
+
+    return ret;
+}
+
+int32_t SparseKMeansModel::set_subsample(size_t max_samples, float fraction) {
+    if (!this->_exclusive || fraction < 0 || fraction > 1) {
+        return EXK_FAIL;
+    }
+
+    this->_subsample_max = max_samples;
+    this->_subsample_fraction = fraction;
+    return EXK_SUC;
+}
+
+size_t SparseKMeansModel::subsample_size(size_t n) const {
+    size_t m = n;
+    if (this->_subsample_fraction > 0) {
+        m = (size_t)ceil(this->_subsample_fraction * n);
+    }
+    if (this->_subsample_max > 0) {
+        m = std::min(m, this->_subsample_max);
+    }
+    return std::min(n, std::max(m, this->_k));
+}
+
+int32_t SparseKMeansModel::set_center_pruning(size_t top_m, float mass, SPARSE_SPARSE_DIST_FUNC(sparse_dist_func)) {
+    if (sparse_dist_func == NULL) {
+        if (this->_dist_func == inversed_dense_sparse_dot) {
+            sparse_dist_func = inversed_sparse_sparse_dot;
+        } else if (this->_dist_func == dense_sparse_l2_distance_sq) {
+            sparse_dist_func = sparse_sparse_l2_distance_sq;
+        } else if (this->_dist_func == dense_sparse_l2_distance) {
+            sparse_dist_func = sparse_sparse_l2_distance;
+        } else if (this->_dist_func == negative_dense_sparse_dot) {
+            sparse_dist_func = negative_sparse_sparse_dot;
+        } else {
+            std::cerr << "No sparse counterpart of the distance function, pruning is not enabled" << std::endl;
+            return EXK_FAIL;
+        }
+    }
+
+    this->_prune_top_m = top_m;
+    this->_prune_mass = mass;
+    this->_sparse_dist_func = sparse_dist_func;
+    this->_sparse_policy = sparse_dist_policy_of(sparse_dist_func);
+    return EXK_SUC;
 }
     
-int32_t SparseKMeansModel::fit(const std::vector<const SPVEC*>& samples) {
+int32_t SparseKMeansModel::fit(const std::vector<const SPVEC*>& samples, const std::vector<TSVAL>* weights) {
+    if (weights != NULL) {
+        if (weights->size() != samples.size()) {
+            return EXK_FAIL;
+        }
+        for (auto iter = weights->begin(); iter != weights->end(); iter++) {
+            if (!(*iter > 0)) {
+                return EXK_FAIL;
+            }
+        }
+    }
+
+    this->_recoveries = 0;
+    size_t m = this->subsample_size(samples.size());
+    if (m < samples.size()) {
+        return this->fit_subsample(samples, weights, m);
+    }
+
+    this->_subsample_quality = SubsampleQuality{samples.size(), samples.size(), 0, 0};
+    return this->fit_samples(samples, weights);
+}
+
+// Fits on m samples drawn without replacement, kept in sample order, then routes every
+// sample to its closest center. The assignment pass runs on the frozen centers, the
+// way the tree routes afterwards.
+int32_t SparseKMeansModel::fit_subsample(const std::vector<const SPVEC*>& samples, const std::vector<TSVAL>* weights, size_t m) {
+    PhiloxRng rng(this->_seed, RNG_SUBSAMPLE);
+    std::vector<int32_t> picks(samples.size());
+    for (int32_t i = 0; i < picks.size(); i++) {
+        picks[i] = i;
+    }
+    for (size_t i = 0; i < m; i++) {
+        std::swap(picks[i], picks[i + rng.below(picks.size() - i)]);
+    }
+    picks.resize(m);
+    std::sort(picks.begin(), picks.end());
+
+    // the picks keep their weights
+    std::vector<const SPVEC*> subsample(m);
+    std::vector<TSVAL> subsample_weights(weights != NULL ? m : 0);
+    std::vector<bool> picked(samples.size(), false);
+    for (size_t i = 0; i < m; i++) {
+        subsample[i] = samples[picks[i]];
+        picked[picks[i]] = true;
+        if (weights != NULL) {
+            subsample_weights[i] = (*weights)[picks[i]];
+        }
+    }
+
+    if (EXK_FAIL == this->fit_samples(subsample, weights != NULL ? &subsample_weights : NULL)) {
+        return EXK_FAIL;
+    }
+    METRIC_ADD(this->_metrics, MC_SUBSAMPLED_FITS, 1);
+
+    this->_assignment.resize(samples.size());
+    std::vector<TSVAL> dists(samples.size());
+    this->parallel_for(samples.size(), [&](int64_t begin, int64_t end) {
+        for (int32_t i = begin; i < end; i++) {
+            this->_assignment[i] = this->predict(*samples[i], &dists[i]);
+        }
+    });
+
+    // sums in sample order, independent of the thread count
+    double subsample_dist = 0;
+    double subsample_weight = 0;
+    double full_dist = 0;
+    double full_weight = 0;
+    for (size_t i = 0; i < samples.size(); i++) {
+        TSVAL w = weights != NULL ? (*weights)[i] : 1;
+        full_dist += w * dists[i];
+        full_weight += w;
+        if (picked[i]) {
+            subsample_dist += w * dists[i];
+            subsample_weight += w;
+        }
+    }
+    subsample_dist /= subsample_weight;
+    full_dist /= full_weight;
+    this->_subsample_quality = SubsampleQuality{samples.size(), m, subsample_dist, full_dist};
+    if (subsample_dist > 0) {
+        double gap = full_dist / subsample_dist - 1;
+        METRIC_RECORD(this->_metrics, MH_SUBSAMPLE_GAP, (uint64_t)(std::max(0.0, gap) * 100));
+    }
+
+    return EXK_SUC;
+}
+
+int32_t SparseKMeansModel::fit_samples(const std::vector<const SPVEC*>& samples, const std::vector<TSVAL>* weights) {
     this->_samples = &samples;
+    this->_weights = weights;
+    this->_inertia = 0;
     //std::cerr << "Initializing" << std::endl;
+    uint64_t start = METRIC_NOW();
     if (EXK_FAIL == initialize_centers()) {
         return EXK_FAIL;
     }
+    METRIC_RECORD(this->_metrics, MH_SEEDING_NS, METRIC_NOW() - start);
 
     if (this->_exclusive) {
         this->_assignment.clear();
@@ -57,31 +411,424 @@ int32_t SparseKMeansModel::fit(const std::vector<const SPVEC*>& samples) {
         this->_u.resize(this->_samples->size());
     }
     
+    int32_t iters = 0;
     for (int32_t i = 0; i < this->_iters; i++) {
         //std::cerr << "Iter@" << i << std::endl;
         int32_t res = this->iterate();
+        iters++;
         if (EXK_END == res) {
             break;
         } else if (EXK_FAIL == res) {
             return EXK_FAIL;
         }
     }
+    this->_fit_iterations = iters;
+    METRIC_ADD(this->_metrics, MC_FIT_ITERATIONS, iters);
+    METRIC_RECORD(this->_metrics, MH_FIT_ITERATIONS, iters);
 
     // defer
     this->_samples = NULL;
+    this->_weights = NULL;
+    std::vector<TSVAL>().swap(this->_sample_scales);
+
+    // the dense centers are only needed for accumulating during the training
+    this->freeze_centers();
 
     return EXK_SUC;
 }
 
+// Out-of-core variant of fit, only exclusive assignment is supported. Each iteration
+// streams the samples block by block, assigning them and accumulating the new centers
+// in the same pass, so that only one block plus the centers is resident at a time.
+int32_t SparseKMeansModel::fit_stream(SampleStream& stream, size_t memory_budget) {
+    if (!this->_exclusive) {
+        return EXK_FAIL;
+    }
+
+    // centers and their accumulators, and the assignment of the whole corpus
+    size_t center_bytes = 2 * this->_k * stream.dim() * sizeof(TSVAL);
+    size_t assignment_bytes = stream.count() * sizeof(int32_t);
+    if (memory_budget <= center_bytes + assignment_bytes) {
+        std::cerr << "Memory budget cannot hold the centers and the assignment" << std::endl;
+        return EXK_FAIL;
+    }
+    size_t block_bytes = memory_budget - center_bytes - assignment_bytes;
+
+    // seeding is done over a uniform sample of the whole stream, every sample draws a
+    // key from its position and the smallest keys are kept while they fit in half of the
+    // block bytes (k of them at least), the blocks of the pass take the other half. A
+    // warm start only needs the first block.
+    uint64_t start = METRIC_NOW();
+    PhiloxRng rng(this->_seed, RNG_RESERVOIR);
+    size_t reservoir_bytes = block_bytes / 2;
+    size_t held = 0;
+    std::priority_queue<std::pair<double, size_t>> keys;
+    std::vector<std::pair<size_t, SPVEC>> reservoir;
+    std::vector<size_t> free_slots;
+    std::vector<std::pair<int32_t, SPVEC>> block;
+    size_t position = 0;
+    stream.rewind();
+    while (EXK_SUC == stream.next_block(block, block_bytes - reservoir_bytes, position == 0 ? this->_k : 0)) {
+        for (size_t i = 0; i < block.size(); i++, position++) {
+            double key = rng.uniform_at(position);
+            size_t bytes = sp_vec_bytes(block[i].second);
+            if (keys.size() >= this->_k && held + bytes > reservoir_bytes && key > keys.top().first) {
+                continue;
+            }
+
+            size_t slot = reservoir.size();
+            if (!free_slots.empty()) {
+                slot = free_slots.back();
+                free_slots.pop_back();
+            } else {
+                reservoir.push_back(std::pair<size_t, SPVEC>());
+            }
+            reservoir[slot].first = position;
+            reservoir[slot].second.swap(block[i].second);
+            keys.push(std::make_pair(key, slot));
+            held += bytes;
+
+            while (keys.size() > this->_k && held > reservoir_bytes) {
+                size_t drop = keys.top().second;
+                keys.pop();
+                held -= sp_vec_bytes(reservoir[drop].second);
+                SPVEC().swap(reservoir[drop].second);
+                free_slots.push_back(drop);
+            }
+        }
+        if (!this->_initial_centers.empty()) {
+            break;
+        }
+    }
+    block.clear();
+
+    // the seeds in stream order, whatever the order they were drawn in
+    std::vector<std::pair<size_t, const SPVEC*>> kept;
+    while (!keys.empty()) {
+        kept.push_back(std::make_pair(reservoir[keys.top().second].first, &reservoir[keys.top().second].second));
+        keys.pop();
+    }
+    std::sort(kept.begin(), kept.end());
+    std::vector<const SPVEC*> seeds;
+    for (auto iter = kept.begin(); iter != kept.end(); iter++) {
+        seeds.push_back(iter->second);
+    }
+    if (seeds.empty()) {
+        return EXK_FAIL;
+    }
+
+    this->_samples = &seeds;
+    int32_t res = this->initialize_centers();
+    this->_samples = NULL;
+    std::vector<std::pair<size_t, SPVEC>>().swap(reservoir);
+    if (EXK_FAIL == res) {
+        return EXK_FAIL;
+    }
+    METRIC_RECORD(this->_metrics, MH_SEEDING_NS, METRIC_NOW() - start);
+
+    this->_assignment.clear();
+    this->_recoveries = 0;
+    this->_hist.resize(this->_k);
+    std::vector<DSVEC> sums(this->_k, DSVEC(stream.dim()));
+
+    // member of every cluster the farthest from its center over a pass, the samples
+    // are not resident so these are the candidates to reseed empty centers, clusters
+    // whose members are all at the same distance do not donate
+    const TSVAL none = -std::numeric_limits<TSVAL>::max();
+    std::vector<TSVAL> far_dists(this->_k);
+    std::vector<TSVAL> near_dists(this->_k);
+    std::vector<size_t> far_ids(this->_k);
+    std::vector<SPVEC> fars(this->_k);
+
+    res = EXK_SUC;
+    int32_t iters = 0;
+    for (int32_t it = 0; it < this->_iters; it++) {
+        iters++;
+        for (int32_t i = 0; i < this->_k; i++) {
+            std::fill(sums[i].begin(), sums[i].end(), 0);
+            this->_hist[i] = 0;
+            far_dists[i] = none;
+            near_dists[i] = std::numeric_limits<TSVAL>::max();
+        }
+
+        size_t offset = 0;
+        size_t changed = 0;
+        stream.rewind();
+        while (EXK_SUC == stream.next_block(block, block_bytes, 0, FIT_STREAM_SAMPLE_BYTES)) {
+            if (this->_assignment.size() < offset + block.size()) {
+                this->_assignment.resize(offset + block.size(), -1);
+            }
+
+            std::vector<TSVAL> dists(block.size());
+            std::atomic<size_t> block_changed(0);
+            this->parallel_for(block.size(), [&](int64_t begin, int64_t end) {
+                size_t local = 0;
+                for (int32_t i = begin; i < end; i++) {
+                    int32_t cid = this->predict(block[i].second, &dists[i]);
+                    if (this->_assignment[offset + i] != cid) {
+                        this->_assignment[offset + i] = cid;
+                        local++;
+                    }
+                }
+                block_changed += local;
+            });
+            changed += block_changed;
+
+            // sums in stream order, independent of the thread count
+            std::vector<std::vector<int32_t>> members(this->_k);
+            for (int32_t i = 0; i < block.size(); i++) {
+                members[this->_assignment[offset + i]].push_back(i);
+            }
+
+            this->parallel_for(this->_k, [&](int64_t begin, int64_t end) {
+                for (int32_t cid = begin; cid < end; cid++) {
+                    int32_t far = -1;
+                    for (auto iter = members[cid].begin(); iter != members[cid].end(); iter++) {
+                        const SPVEC& v = block[*iter].second;
+                        TSVAL w = this->is_spherical() ? sample_scale(v) : 1;
+                        add_scaled(sums[cid], v, w);
+                        if (dists[*iter] * w > far_dists[cid]) {
+                            far_dists[cid] = dists[*iter] * w;
+                            far = *iter;
+                        }
+                        near_dists[cid] = std::min(near_dists[cid], dists[*iter] * w);
+                    }
+                    this->_hist[cid] += members[cid].size();
+                    if (far >= 0) {
+                        far_ids[cid] = offset + far;
+                        fars[cid] = block[far].second;
+                    }
+                }
+            }, 1);
+
+            offset += block.size();
+        }
+
+        if (changed == 0) {
+            break;
+        }
+
+        // an empty center takes the farthest member of the largest cluster left
+        size_t recovered = 0;
+        for (int32_t cid = 0; cid < this->_k && res == EXK_SUC; cid++) {
+            if (this->_hist[cid] != 0) {
+                continue;
+            }
+
+            int32_t donor = -1;
+            for (int32_t i = 0; i < this->_k; i++) {
+                if (far_dists[i] > near_dists[i] && this->_hist[i] >= 2 && (donor < 0 || this->_hist[i] > this->_hist[donor])) {
+                    donor = i;
+                }
+            }
+            if (donor < 0) {
+                res = EXK_FAIL;
+                break;
+            }
+
+            TSVAL w = this->is_spherical() ? sample_scale(fars[donor]) : 1;
+            add_scaled(sums[donor], fars[donor], -w);
+            add_scaled(sums[cid], fars[donor], w);
+            this->_hist[donor] -= 1;
+            this->_hist[cid] = 1;
+            this->_assignment[far_ids[donor]] = cid;
+            far_dists[donor] = none;
+            recovered++;
+        }
+        this->_recoveries += recovered;
+        METRIC_ADD(this->_metrics, MC_EMPTY_RECOVERIES, recovered);
+        if (res == EXK_FAIL) {
+            break;
+        }
+
+        this->parallel_for(this->_k, [&](int64_t begin, int64_t end) {
+            for (int32_t i = begin; i < end; i++) {
+                this->_centers[i] = sums[i] / this->_hist[i];
+                if (this->is_spherical()) {
+                    normalize_center(this->_centers[i]);
+                }
+            }
+        });
+        this->update_layout();
+    }
+
+    this->_fit_iterations = iters;
+    METRIC_ADD(this->_metrics, MC_FIT_ITERATIONS, iters);
+    METRIC_RECORD(this->_metrics, MH_FIT_ITERATIONS, iters);
+
+    this->freeze_centers();
+
+    return res;
+}
+
+// Term at a time scoring over the postings. When only the top closest centers are
+// needed and the distance decreases with the dot product, the query terms are visited
+// by decreasing upper bound, and once the top-th best dot exceeds what the remaining
+// terms can add, centers not seen yet are skipped (max-score).
+template <typename P>
+void SparseKMeansModel::score_inverted(const SPVEC& x, std::vector<TSVAL>& scores, size_t top) const {
+    static thread_local std::vector<std::pair<TSVAL, std::pair<int32_t, TSVAL>>> terms;
+    static thread_local std::vector<uint8_t> touched;
+    static thread_local std::vector<int32_t> touched_ids;
+    static thread_local std::vector<TSVAL> best;
+
+    size_t n = this->_sparse_centers.size();
+    scores.assign(n, 0);
+
+    TSVAL x_norm = 0;
+    TSVAL remaining = 0;
+    terms.clear();
+    for (auto iter = x.begin(); iter != x.end(); iter++) {
+        x_norm += *iter * *iter;
+        auto pos = std::lower_bound(this->_posting_dims.begin(), this->_posting_dims.end(), (int32_t)iter.index());
+        if (pos == this->_posting_dims.end() || *pos != iter.index()) {
+            continue;
+        }
+
+        int32_t t = pos - this->_posting_dims.begin();
+        TSVAL bound = fabs(*iter) * this->_posting_max[t];
+        terms.push_back(std::make_pair(-bound, std::make_pair(t, *iter)));
+        remaining += bound;
+    }
+
+    bool early = P::decreasing && top > 0 && top < n;
+    if (early) {
+        std::sort(terms.begin(), terms.end());
+    }
+
+    touched.assign(n, 0);
+    touched_ids.clear();
+    bool skip_new = false;
+    uint64_t postings = 0;
+    for (auto iter = terms.begin(); iter != terms.end(); iter++) {
+        int32_t t = iter->second.first;
+        TSVAL w = iter->second.second;
+        remaining += iter->first;
+
+        postings += this->_posting_offsets[t + 1] - this->_posting_offsets[t];
+        for (uint32_t p = this->_posting_offsets[t]; p < this->_posting_offsets[t + 1]; p++) {
+            int32_t cid = this->_posting_cids[p];
+            if (!touched[cid]) {
+                if (skip_new) {
+                    continue;
+                }
+                touched[cid] = 1;
+                touched_ids.push_back(cid);
+            }
+            scores[cid] += w * this->_posting_weights[p];
+        }
+
+        if (early && !skip_new && touched_ids.size() >= top) {
+            best.clear();
+            for (auto cid = touched_ids.begin(); cid != touched_ids.end(); cid++) {
+                best.push_back(-scores[*cid]);
+            }
+            std::nth_element(best.begin(), best.begin() + top - 1, best.end());
+            skip_new = -best[top - 1] >= remaining;
+        }
+    }
+
+    finish_scores<P>(scores.data(), this->_center_norms.data(), x_norm, n);
+    METRIC_SCORING_WORK(touched_ids.size(), postings);
+}
+
+// distances from x to all the centers
+void SparseKMeansModel::score_centers(const SPVEC& x, std::vector<TSVAL>& scores, size_t top) const {
+    scores.resize(this->num_centers());
+
+    switch (this->_policy) {
+    case DP_INVERSED_DOT:
+        this->score_with<InversedDotDist>(x, scores, top);
+        break;
+    case DP_L2_SQ:
+        this->score_with<L2SqDist>(x, scores, top);
+        break;
+    case DP_L2:
+        this->score_with<L2Dist>(x, scores, top);
+        break;
+    case DP_NEGATIVE_DOT:
+        this->score_with<NegativeDotDist>(x, scores, top);
+        break;
+    default:
+        this->score_custom(x, scores);
+    }
+}
+
+template <typename P>
+void SparseKMeansModel::score_with(const SPVEC& x, std::vector<TSVAL>& scores, size_t top) const {
+    size_t n = scores.size();
+    if (this->is_inverted()) {
+        // counts its own work
+        this->score_inverted<P>(x, scores, top);
+        return;
+    }
+    METRIC_SCORING_WORK(n, n * x.nnz());
+
+    if (this->is_half()) {
+        this->score_half<P>(x, scores);
+        return;
+    } else if (this->is_pruned() && this->_sparse_policy != P::id) {
+        // a custom sparse distance
+        this->score_custom(x, scores);
+        return;
+    }
+
+    TSVAL x_norm = 0;
+    for (auto iter = x.begin(); iter != x.end(); iter++) {
+        x_norm += *iter * *iter;
+    }
+
+    if (this->is_pruned()) {
+        for (size_t i = 0; i < n; i++) {
+            scores[i] = sparse_sparse_dot(this->_sparse_centers[i], x);
+        }
+    } else if (this->is_dim_major()) {
+        // accumulate the dot products in scores, one row of the matrix per nonzero
+        std::fill(scores.begin(), scores.end(), 0);
+        TSVAL* acc = scores.data();
+        for (auto iter = x.begin(); iter != x.end(); iter++) {
+            const TSVAL w = *iter;
+            const TSVAL* row = &this->_center_matrix[iter.index() * n];
+            #pragma omp simd
+            for (size_t i = 0; i < n; i++) {
+                acc[i] += w * row[i];
+            }
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            scores[i] = dense_sparse_dot(&this->_centers[i].data()[0], x);
+        }
+    }
+
+    finish_scores<P>(scores.data(), this->_center_norms.data(), x_norm, n);
+}
+
+// distances through the function pointers, for the distances without a policy
+void SparseKMeansModel::score_custom(const SPVEC& x, std::vector<TSVAL>& scores) const {
+    size_t n = scores.size();
+    if (this->is_pruned()) {
+        for (size_t i = 0; i < n; i++) {
+            scores[i] = this->_sparse_dist_func(this->_sparse_centers[i], x);
+        }
+    } else {
+        for (size_t i = 0; i < n; i++) {
+            scores[i] = this->_dist_func(this->_centers[i], x);
+        }
+    }
+}
+
 int32_t SparseKMeansModel::predict(const SPVEC& x, TSVAL* dist) {
     // predict should be single thread
+    static thread_local std::vector<TSVAL> scores;
+    this->score_centers(x, scores, 1);
+
     TSVAL m = std::numeric_limits<TSVAL>::max();
     int32_t ret = 0;
-    for (auto iter = this->_centers.begin(); iter != this->_centers.end(); iter++) {
-        TSVAL s = this->_dist_func(*iter, x);
+    for (size_t i = 0; i < scores.size(); i++) {
+        TSVAL s = scores[i];
         if (m > s) {
             m = s;
-            ret = iter - this->_centers.begin();
+            ret = i;
         }
     }
 
@@ -93,10 +840,12 @@ int32_t SparseKMeansModel::predict(const SPVEC& x, TSVAL* dist) {
 } 
 
 std::vector<std::pair<int32_t, TSVAL>> SparseKMeansModel::predict(const SPVEC& x, int32_t k) {
+    static thread_local std::vector<TSVAL> scores;
+    this->score_centers(x, scores, k);
+
     Topk<int32_t, TSVAL> topk(k);
-    for (auto iter = this->_centers.begin(); iter != this->_centers.end(); iter++) {
-        TSVAL s = this->_dist_func(*iter, x);
-        topk.insert(iter - this->_centers.begin(), s);
+    for (size_t i = 0; i < scores.size(); i++) {
+        topk.insert(i, scores[i]);
     }
 
     std::vector<std::pair<int32_t, TSVAL>> res;
@@ -106,10 +855,13 @@ std::vector<std::pair<int32_t, TSVAL>> SparseKMeansModel::predict(const SPVEC& x
         std::cerr << "The topk list size is not k: " << res.size() << " | " << k << std::endl;
     } 
 
-    TSVAL thres = res.begin()->second * this->_cut_rate;
+    // negative distances are similarities, the cut keeps those within the rate of the best
+    TSVAL best = res.begin()->second;
+    TSVAL thres = best >= 0 ? best * this->_cut_rate : best / this->_cut_rate;
     for (auto iter = res.begin() + 1; iter != res.end(); iter++) {
         if (iter->second > thres) {
             res.resize(iter - res.begin());
+            break;
         }
     }
 
@@ -137,12 +889,13 @@ int32_t SparseKMeansModel::kmeans_m_step() {
 
     if (this->_exclusive) {
         //std::cerr << "M Ste reset centers" << std::endl;
-        #pragma omp parallel for
-        for (int32_t i = 0; i < this->_k; i++) {
-            DSVEC& v = this->_centers[i];
-            std::fill(v.begin(), v.end(), 0);
-            this->_hist[i] = 0;
-        }
+        this->parallel_for(this->_k, [&](int64_t begin, int64_t end) {
+            for (int32_t i = begin; i < end; i++) {
+                DSVEC& v = this->_centers[i];
+                std::fill(v.begin(), v.end(), 0);
+                this->_hist[i] = 0;
+            }
+        });
 
         //std::cerr << "M adding centers" << std::endl;
         if (this->_samples->size() != this->_assignment.size()) {
@@ -150,99 +903,211 @@ int32_t SparseKMeansModel::kmeans_m_step() {
             return EXK_FAIL;
         }
 
-        omp_lock_t* locks = new omp_lock_t[this->_centers.size()];
-        for (int32_t i = 0; i < this->_centers.size(); i++) {
-            omp_init_lock(locks + i);
-        }
-
-        #pragma omp parallel for
+        // every center sums its members in sample order, so that it does not depend
+        // on the thread count
+        std::vector<std::vector<int32_t>> members(this->_k);
         for (int32_t i = 0; i < this->_samples->size(); i++) {
-            int32_t cid = this->_assignment[i];
-            
-            omp_set_lock(locks + cid);
-            DSVEC& cnt = this->_centers[cid];
-            cnt += *this->_samples->at(i);
-            this->_hist[cid]++;
-            omp_unset_lock(locks + cid);
+            members[this->_assignment[i]].push_back(i);
         }
 
-        for (int32_t i = 0; i < this->_centers.size(); i++) {
-            omp_destroy_lock(locks + i);
-        }
-        delete [] locks;
+        this->parallel_for(this->_k, [&](int64_t begin, int64_t end) {
+            for (int32_t cid = begin; cid < end; cid++) {
+                DSVEC& cnt = this->_centers[cid];
+                for (auto iter = members[cid].begin(); iter != members[cid].end(); iter++) {
+                    TSVAL w = this->sample_weight(*iter);
+                    add_scaled(cnt, *this->_samples->at(*iter), this->is_spherical() ? w * this->_sample_scales[*iter] : w);
+                    this->_hist[cid] += w;
+                }
+            }
+        }, 1);
 
-        if(std::find(this->_hist.begin(), this->_hist.end(), 0) != this->_hist.end()) {
+        //std::cerr << "M avg centers" << std::endl;
+        this->parallel_for(this->_k, [&](int64_t begin, int64_t end) {
+            for (int32_t i = begin; i < end; i++) {
+                DSVEC& v = this->_centers[i];
+                if (this->_hist[i] > 0) {
+                    v /= this->_hist[i];
+                }
+            }
+        });
+
+        if (EXK_FAIL == this->recover_empty_centers(members)) {
             //std::cerr << "There is empty center, clustering failed" << std::endl;
             return EXK_FAIL;
         }
 
-        //std::cerr << "M avg centers" << std::endl;
-        #pragma omp parallel for
-        for (int32_t i = 0; i < this->_k; i++) {
-            DSVEC& v = this->_centers[i];
-            v /= this->_hist[i];
-        }
-
         for (int32_t i = 0; i < this->_k; i++) {
             DSVEC& v = this->_centers[i];
             //std::cerr << "p@" << i << "\t x=" << v(0) << "\t y=" << v(1) << std::endl;
         }
     } else {
         //std::cerr << "M Ste reset centers" << std::endl;
-        #pragma omp parallel for
+        this->parallel_for(this->_k, [&](int64_t begin, int64_t end) {
+            for (int32_t i = begin; i < end; i++) {
+                DSVEC& v = this->_centers[i];
+                std::fill(v.begin(), v.end(), 0);
+                this->_hist[i] = 0;
+            }
+        });
+
+        // (sample, weight) of every center in sample order
+        std::vector<std::vector<std::pair<int32_t, TSVAL>>> members(this->_k);
+        for (int32_t i = 0; i < this->_samples->size(); i++) {
+            for (auto iter = this->_u[i].begin(); iter != this->_u[i].end(); iter++) {
+                members[iter->first].push_back(std::make_pair(i, this->sample_weight(i) / (iter->second + 10)));
+            }
+        }
+
+        this->parallel_for(this->_k, [&](int64_t begin, int64_t end) {
+            for (int32_t cid = begin; cid < end; cid++) {
+                DSVEC& cnt = this->_centers[cid];
+                for (auto iter = members[cid].begin(); iter != members[cid].end(); iter++) {
+                    TSVAL w = iter->second;
+                    add_scaled(cnt, *this->_samples->at(iter->first), this->is_spherical() ? w * this->_sample_scales[iter->first] : w);
+                    this->_hist[cid] += w;
+                }
+            }
+        }, 1);
+
+        //std::cerr << "M avg centers" << std::endl;
+        this->parallel_for(this->_k, [&](int64_t begin, int64_t end) {
+            for (int32_t i = begin; i < end; i++) {
+                DSVEC& v = this->_centers[i];
+                if (this->_hist[i] > 0) {
+                    v /= this->_hist[i];
+                }
+            }
+        });
+
+        if (EXK_FAIL == this->recover_empty_fuzzy_centers()) {
+            std::cerr << "There is empty center, clustering failed" << std::endl;
+            return EXK_FAIL;
+        }
+
         for (int32_t i = 0; i < this->_k; i++) {
             DSVEC& v = this->_centers[i];
-            std::fill(v.begin(), v.end(), 0);
-            this->_hist[i] = 0;
+            //std::cerr << "p@" << i << "\t x=" << v(0) << "\t y=" << v(1) << std::endl;
         }
+    }
 
-        omp_lock_t* locks = new omp_lock_t[this->_centers.size()];
-        for (int32_t i = 0; i < this->_centers.size(); i++) {
-            omp_init_lock(locks + i);
-        }
+    if (this->is_spherical()) {
+        this->parallel_for(this->_k, [&](int64_t begin, int64_t end) {
+            for (int32_t i = begin; i < end; i++) {
+                normalize_center(this->_centers[i]);
+            }
+        });
+    }
 
-        #pragma omp parallel for
-        for (int32_t i = 0; i < this->_samples->size(); i++) {
-            auto eus = this->_u[i];
-            for (auto iter = eus.begin(); iter != eus.end(); iter++) {
-                int32_t cid = iter->first;
+    this->update_layout();
+    return EXK_SUC;
+}
 
-                omp_set_lock(locks + cid);
-                DSVEC& cnt = this->_centers[iter->first];
-                SPVEC v = *this->_samples->at(i);
-                TSVAL w = 1.0 / (iter->second + 10);
+// Reseeds every empty center of the exclusive fit with the member of the largest cluster
+// the farthest from its center, and moves that member over. Clusters whose members are
+// all at the same distance, duplicates mostly, cannot be split and do not donate. The
+// centers are the means of their members here, the donor mean is updated for the
+// member it loses.
+int32_t SparseKMeansModel::recover_empty_centers(std::vector<std::vector<int32_t>>& members) {
+    size_t recovered = 0;
+    int32_t ret = EXK_SUC;
+    for (int32_t cid = 0; cid < this->_k; cid++) {
+        if (this->_hist[cid] != 0) {
+            continue;
+        }
 
-                v *= w;
-                cnt += v;
-                this->_hist[cid] += w;
-                omp_unset_lock(locks + cid);
-            }   
+        std::vector<int32_t> order;
+        for (int32_t i = 0; i < this->_k; i++) {
+            if (members[i].size() >= 2) {
+                order.push_back(i);
+            }
+        }
+        std::stable_sort(order.begin(), order.end(), [this](int32_t a, int32_t b) {
+            return this->_hist[a] > this->_hist[b];
+        });
+
+        int32_t donor = -1;
+        size_t far = 0;
+        for (auto iter = order.begin(); iter != order.end() && donor < 0; iter++) {
+            TSVAL far_dist = -std::numeric_limits<TSVAL>::max();
+            TSVAL near_dist = std::numeric_limits<TSVAL>::max();
+            for (size_t m = 0; m < members[*iter].size(); m++) {
+                int32_t i = members[*iter][m];
+                TSVAL d = this->_dist_func(this->_centers[*iter], *this->_samples->at(i));
+                if (this->is_spherical()) {
+                    d *= this->_sample_scales[i];
+                }
+                if (d > far_dist) {
+                    far_dist = d;
+                    far = m;
+                }
+                near_dist = std::min(near_dist, d);
+            }
+            if (far_dist > near_dist) {
+                donor = *iter;
+            }
         }
 
-        for (int32_t i = 0; i < this->_centers.size(); i++) {
-            omp_destroy_lock(locks + i);
+        if (donor < 0) {
+            ret = EXK_FAIL;
+            break;
         }
-        delete [] locks;
 
-        if(std::find(this->_hist.begin(), this->_hist.end(), 0) != this->_hist.end()) {
-            std::cerr << "There is empty center, clustering failed" << std::endl;
-            return EXK_FAIL;
+        int32_t i = members[donor][far];
+        const SPVEC& v = *this->_samples->at(i);
+        TSVAL weight = this->sample_weight(i);
+        TSVAL w = this->is_spherical() ? weight * this->_sample_scales[i] : weight;
+        DSVEC& c = this->_centers[donor];
+        c *= this->_hist[donor];
+        add_scaled(c, v, -w);
+        this->_hist[donor] -= weight;
+        c /= this->_hist[donor];
+
+        add_scaled(this->_centers[cid], v, w / weight);
+        this->_hist[cid] = weight;
+        members[donor].erase(members[donor].begin() + far);
+        members[cid].push_back(i);
+        this->_assignment[i] = cid;
+        recovered++;
+    }
+
+    this->_recoveries += recovered;
+    METRIC_ADD(this->_metrics, MC_EMPTY_RECOVERIES, recovered);
+    return ret;
+}
+
+// Reseeds every empty center of the non exclusive fit with the samples the farthest
+// from their closest center.
+int32_t SparseKMeansModel::recover_empty_fuzzy_centers() {
+    std::vector<std::pair<TSVAL, int32_t>> errors;
+    for (int32_t i = 0; i < this->_samples->size(); i++) {
+        if (!this->_u[i].empty()) {
+            TSVAL d = this->_u[i].front().second;
+            errors.push_back(std::make_pair(this->is_spherical() ? d * this->_sample_scales[i] : d, i));
         }
+    }
+    std::sort(errors.begin(), errors.end(), std::greater<std::pair<TSVAL, int32_t>>());
 
-        //std::cerr << "M avg centers" << std::endl;
-        #pragma omp parallel for
-        for (int32_t i = 0; i < this->_k; i++) {
-            DSVEC& v = this->_centers[i];
-            v /= this->_hist[i];
+    size_t recovered = 0;
+    int32_t ret = EXK_SUC;
+    for (int32_t cid = 0; cid < this->_k; cid++) {
+        if (this->_hist[cid] != 0) {
+            continue;
         }
 
-        for (int32_t i = 0; i < this->_k; i++) {
-            DSVEC& v = this->_centers[i];
-            //std::cerr << "p@" << i << "\t x=" << v(0) << "\t y=" << v(1) << std::endl;
+        if (recovered >= errors.size()) {
+            ret = EXK_FAIL;
+            break;
         }
+
+        int32_t i = errors[recovered].second;
+        add_scaled(this->_centers[cid], *this->_samples->at(i), this->is_spherical() ? this->_sample_scales[i] : 1);
+        this->_hist[cid] = 1;
+        recovered++;
     }
 
-    return EXK_SUC;
+    this->_recoveries += recovered;
+    METRIC_ADD(this->_metrics, MC_EMPTY_RECOVERIES, recovered);
+    return ret;
 }
 
 bool assignment_changed(const std::vector<int32_t>& assa, const std::vector<int32_t>& assb) {
@@ -273,21 +1138,28 @@ int32_t SparseKMeansModel::kmeans_e_step() {
     if (this->_exclusive) {
         std::vector<int32_t> new_assignment;
         new_assignment.resize(this->_samples->size());
-
-        bool failed = false;
-        #pragma omp parallel for
-        for (int32_t i = 0; i < _samples->size(); i++) {
-            int32_t cid = this->predict(*this->_samples->at(i));
-            if (EXK_FAIL == cid) {
-                failed = true;
-            } else {
-                new_assignment[i] = cid;
-            }
+        std::vector<TSVAL> dists(this->_samples->size());
+
+        std::atomic<bool> failed(false);
+        if (this->_balance != BALANCE_NONE) {
+            this->balanced_assignment(new_assignment, dists);
+        } else {
+            this->parallel_for(_samples->size(), [&](int64_t begin, int64_t end) {
+                for (int32_t i = begin; i < end; i++) {
+                    int32_t cid = this->predict(*this->_samples->at(i), &dists[i]);
+                    if (EXK_FAIL == cid) {
+                        failed = true;
+                    } else {
+                        new_assignment[i] = cid;
+                    }
+                }
+            });
         }
 
         if (failed) {
             return EXK_FAIL;
         }
+        this->update_inertia(dists);
 
         for (auto iter = new_assignment.begin(); iter != new_assignment.end(); iter++) {
             //std::cerr << *iter << ",";
@@ -306,13 +1178,19 @@ int32_t SparseKMeansModel::kmeans_e_step() {
     } else {
         std::vector<std::vector<std::pair<int32_t, TSVAL>>> nu;
         nu.resize(this->_samples->size());
+        std::vector<TSVAL> dists(this->_samples->size(), 0);
        
         bool failed = false;
-        #pragma omp parallel for
-        for (int32_t i = 0; i < _samples->size(); i++) {
-            auto top_match = this->predict(*this->_samples->at(i), this->_degrees[i]);
-            nu[i] = top_match;
-        }
+        this->parallel_for(_samples->size(), [&](int64_t begin, int64_t end) {
+            for (int32_t i = begin; i < end; i++) {
+                auto top_match = this->predict(*this->_samples->at(i), this->_degrees[i]);
+                if (!top_match.empty()) {
+                    dists[i] = top_match.front().second;
+                }
+                nu[i] = top_match;
+            }
+        });
+        this->update_inertia(dists);
 
         //std::cerr << "E comparing" << std::endl;
         int32_t rett = EXK_SUC;
@@ -329,32 +1207,186 @@ int32_t SparseKMeansModel::kmeans_e_step() {
     return EXK_SUC;
 }
 
+// summed in sample order, the same whatever the thread count
+void SparseKMeansModel::update_inertia(const std::vector<TSVAL>& dists) {
+    double inertia = 0;
+    for (size_t i = 0; i < dists.size(); i++) {
+        inertia += (double)this->sample_weight(i) * dists[i];
+    }
+    this->_inertia = inertia;
+}
+
+// Greedy regret assignment. Samples pick in decreasing order of the gap between their
+// two closest centers, since they lose the most when pushed away from the closest one.
+// Each takes the closest center that is not full (hard), or the cheapest one once the
+// centers are charged for the samples they already hold (soft).
+void SparseKMeansModel::balanced_assignment(std::vector<int32_t>& assignment, std::vector<TSVAL>& dists) const {
+    size_t n = this->_samples->size();
+    size_t k = this->num_centers();
+    // only the closest m centers of every sample are kept, (score, cid) closest first
+    size_t m = std::min(k, (size_t)BALANCE_CANDIDATES);
+    std::vector<std::pair<TSVAL, int32_t>> candidates(n * m);
+    std::vector<std::pair<TSVAL, int32_t>> order(n);
+
+    this->parallel_for(n, [&](int64_t begin, int64_t end) {
+        static thread_local std::vector<TSVAL> s;
+        static thread_local std::vector<std::pair<TSVAL, int32_t>> ranked;
+        for (int32_t i = begin; i < end; i++) {
+            this->score_centers(*this->_samples->at(i), s);
+            ranked.resize(k);
+            for (size_t j = 0; j < k; j++) {
+                ranked[j] = std::make_pair(s[j], (int32_t)j);
+            }
+            std::partial_sort(ranked.begin(), ranked.begin() + m, ranked.end());
+            std::copy(ranked.begin(), ranked.begin() + m, candidates.begin() + i * m);
+            order[i] = std::make_pair(m > 1 ? ranked[0].first - ranked[1].first : 0, i);
+        }
+    });
+    std::sort(order.begin(), order.end());
+
+    // the soft penalty is measured in mean regrets
+    double scale = 0;
+    for (auto iter = order.begin(); iter != order.end(); iter++) {
+        scale -= iter->first;
+    }
+    scale = scale > 0 ? scale / n : 1;
+
+    // sizes are the weights the centers hold
+    double total = 0;
+    for (size_t i = 0; i < n; i++) {
+        total += this->sample_weight(i);
+    }
+    double mean_size = total / k;
+    double penalty = this->_balance_param * scale / mean_size;
+    double capacity = this->_weights != NULL ? this->_balance_param * mean_size : ceil(this->_balance_param * mean_size);
+    std::vector<double> sizes(k, 0);
+    std::vector<TSVAL> s;
+    for (auto iter = order.begin(); iter != order.end(); iter++) {
+        // the dropped centers score at least the last candidate and are never cheaper,
+        // a sample is rescored on all the centers only when that bound is reached
+        const std::pair<TSVAL, int32_t>* c = &candidates[iter->second * m];
+        int32_t pick = -1;
+        TSVAL dist = 0;
+        double best = std::numeric_limits<double>::max();
+        for (size_t j = 0; j < m; j++) {
+            int32_t cid = c[j].second;
+            double cost = c[j].first;
+            if (this->_balance == BALANCE_HARD) {
+                if (sizes[cid] >= capacity) {
+                    continue;
+                }
+            } else {
+                cost += penalty * sizes[cid];
+            }
+
+            if (cost < best || (cost == best && cid < pick)) {
+                best = cost;
+                pick = cid;
+                dist = c[j].first;
+            }
+        }
+
+        if (pick < 0 || (m < k && best >= c[m - 1].first)) {
+            this->score_centers(*this->_samples->at(iter->second), s);
+            pick = 0;
+            best = std::numeric_limits<double>::max();
+            for (size_t j = 0; j < k; j++) {
+                double cost = s[j];
+                if (this->_balance == BALANCE_HARD) {
+                    if (sizes[j] >= capacity) {
+                        continue;
+                    }
+                } else {
+                    cost += penalty * sizes[j];
+                }
+
+                if (cost < best) {
+                    best = cost;
+                    pick = j;
+                }
+            }
+            dist = s[pick];
+        }
+
+        assignment[iter->second] = pick;
+        dists[iter->second] = dist;
+        sizes[pick] += this->sample_weight(iter->second);
+    }
+}
+
 int32_t SparseKMeansModel::initialize_centers() {
+    if (this->is_spherical()) {
+        this->_sample_scales.resize(this->_samples->size());
+        this->parallel_for(this->_samples->size(), [&](int64_t begin, int64_t end) {
+            for (int32_t i = begin; i < end; i++) {
+                this->_sample_scales[i] = sample_scale(*this->_samples->at(i));
+            }
+        });
+    }
+
+    if (!this->_initial_centers.empty()) {
+        // warm start, the supplied centers are used once
+        for (auto iter = this->_initial_centers.begin(); iter != this->_initial_centers.end(); iter++) {
+            if (iter->size() != this->_samples->at(0)->size()) {
+                return EXK_FAIL;
+            }
+        }
+
+        this->_centers.swap(this->_initial_centers);
+        std::vector<DSVEC>().swap(this->_initial_centers);
+        if (this->is_spherical()) {
+            for (int32_t i = 0; i < this->_k; i++) {
+                normalize_center(this->_centers[i]);
+            }
+        }
+        this->update_layout();
+        return EXK_SUC;
+    }
+
+    PhiloxRng rng(this->_seed, RNG_SEEDING);
     if (this->_init_mode == "kmeans++") {
         std::vector<TSVAL> scs;
         scs.resize(this->_samples->size());
 
-        int32_t first = rand() % this->_samples->size();
+        int32_t first;
+        if (this->_weights != NULL) {
+            // in proportion to the weights, as the following centers
+            for (int32_t i = 0; i < this->_samples->size(); i++) {
+                scs[i] = this->sample_weight(i) + (i > 0 ? scs[i - 1] : 0);
+            }
+            first = std::lower_bound(scs.begin(), scs.end(), rng.uniform() * *scs.rbegin()) - scs.begin();
+        } else {
+            first = rng.below(this->_samples->size());
+        }
         //std::cerr << "first = " << first << std::endl;
         this->_centers.clear();    
         DSVEC last_center = *this->_samples->at(first);
         
         //std::cerr << "start selecting...." << std::endl;
         while (this->_centers.size() < this->_k) {
+            if (this->is_spherical()) {
+                normalize_center(last_center);
+            }
             this->_centers.push_back(last_center);
             
-            #pragma omp parallel for
-            for (int32_t i = 0; i < this->_samples->size(); i++){
-                scs[i] = this->_dist_func(*this->_samples->at(i), last_center);
-            }
+            this->parallel_for(this->_samples->size(), [&](int64_t begin, int64_t end) {
+                for (int32_t i = begin; i < end; i++) {
+                    if (this->is_spherical()) {
+                        // 1 - cosine, the negative dot is not a valid weight
+                        scs[i] = std::max((TSVAL)0, 1 + this->_dist_func(last_center, *this->_samples->at(i)) * this->_sample_scales[i]);
+                    } else {
+                        scs[i] = this->_dist_func(last_center, *this->_samples->at(i));
+                    }
+                    scs[i] *= this->sample_weight(i);
+                }
+            });
 
             // integral
             for (int32_t i = 1; i < this->_samples->size(); i++){
                 scs[i] += scs[i-1];
             }
 
-            float seed = (float)rand() / RAND_MAX;
-            seed *= *scs.rbegin();
+            TSVAL seed = rng.uniform() * *scs.rbegin();
             //std::cerr << "seed = " << seed  << "; max = " << *scs.rbegin() << std::endl;
 
             auto pick = std::lower_bound(scs.begin(), scs.end(), seed);
@@ -366,32 +1398,345 @@ int32_t SparseKMeansModel::initialize_centers() {
             //std::cerr << "p@" << i << "\t x=" << v(0) << "\t y=" << v(1) << std::endl;
         }
     } else if (this->_init_mode == "random") {
+        // drawn in proportion to the weights
+        std::vector<double> cumulative(this->_samples->size());
+        double total = 0;
+        for (size_t i = 0; i < cumulative.size(); i++) {
+            total += this->sample_weight(i);
+            cumulative[i] = total;
+        }
+
         std::set<int32_t> cids;
         while (cids.size() < this->_k) {
-            cids.insert(rand() % this->_samples->size());
+            auto pick = std::upper_bound(cumulative.begin(), cumulative.end(), rng.uniform() * total);
+            cids.insert(std::min(pick - cumulative.begin(), (ptrdiff_t)cumulative.size() - 1));
         }
 
         this->_centers.resize(this->_k);
         int32_t t = 0;
         for (auto iter = cids.begin(); iter != cids.end(); iter++) {
             this->_centers[t] = *this->_samples->at(*iter);
+            if (this->is_spherical()) {
+                normalize_center(this->_centers[t]);
+            }
             t++;
         }
     } else {
         return EXK_FAIL;
     }
 
+    this->update_layout();
     return EXK_SUC;
 }
 
+void SparseKMeansModel::update_layout() {
+    // the training always runs in fp32
+    std::vector<uint16_t>().swap(this->_centers16);
+    this->prune_centers();
+    this->build_center_norms();
+    this->build_center_matrix();
+    this->build_inverted_index();
+}
+
+void SparseKMeansModel::build_inverted_index() {
+    if (!this->is_inverted()) {
+        return;
+    }
+
+    // ((dim, cid), weight) of every nonzero of the centers
+    std::vector<std::pair<std::pair<int32_t, int32_t>, TSVAL>> entries;
+    size_t n = this->_sparse_centers.size();
+    for (size_t i = 0; i < n; i++) {
+        const CPVEC& c = this->_sparse_centers[i];
+        for (size_t p = 0; p < c.nnz(); p++) {
+            entries.push_back(std::make_pair(std::make_pair((int32_t)c.index_data()[p], (int32_t)i), c.value_data()[p]));
+        }
+    }
+    std::sort(entries.begin(), entries.end());
+
+    this->_posting_dims.clear();
+    this->_posting_offsets.clear();
+    this->_posting_cids.resize(entries.size());
+    this->_posting_weights.resize(entries.size());
+    this->_posting_max.clear();
+    for (size_t p = 0; p < entries.size(); p++) {
+        int32_t dim = entries[p].first.first;
+        TSVAL w = entries[p].second;
+        if (this->_posting_dims.empty() || *this->_posting_dims.rbegin() != dim) {
+            this->_posting_dims.push_back(dim);
+            this->_posting_offsets.push_back(p);
+            this->_posting_max.push_back(0);
+        }
+
+        this->_posting_cids[p] = entries[p].first.second;
+        this->_posting_weights[p] = w;
+        *this->_posting_max.rbegin() = std::max(*this->_posting_max.rbegin(), (TSVAL)fabs(w));
+    }
+    this->_posting_offsets.push_back(entries.size());
+}
+
+int32_t SparseKMeansModel::set_center_precision(int32_t precision) {
+    if (precision != CENTER_FP32 && this->_policy == DP_CUSTOM) {
+        std::cerr << "The distance function is not dot based, center precision is not changed" << std::endl;
+        return EXK_FAIL;
+    }
+
+    this->_precision = precision;
+    return EXK_SUC;
+}
+
+void SparseKMeansModel::freeze_centers() {
+    if (this->_precision != CENTER_FP32 && !this->is_pruned()) {
+        uint16_t (*convert)(float) = this->_precision == CENTER_FP16 ? float_to_half : float_to_bf16;
+        float (*restore)(uint16_t) = this->_precision == CENTER_FP16 ? half_to_float : bf16_to_float;
+
+        if (this->is_dim_major() && !this->_center_matrix.empty()) {
+            size_t k = this->_center_norms.size();
+            this->_centers16.resize(this->_center_matrix.size());
+            std::fill(this->_center_norms.begin(), this->_center_norms.end(), 0);
+            for (size_t p = 0; p < this->_center_matrix.size(); p++) {
+                this->_centers16[p] = convert(this->_center_matrix[p]);
+                TSVAL v = restore(this->_centers16[p]);
+                this->_center_norms[p % k] += v * v;
+            }
+            std::vector<TSVAL>().swap(this->_center_matrix);
+        } else if (!this->_centers.empty()) {
+            // the norms are taken from the rounded centers to keep L2 consistent
+            size_t k = this->_centers.size();
+            size_t dim = this->_centers[0].size();
+            this->_centers16.resize(k * dim);
+            this->_center_norms.resize(k);
+            this->parallel_for(k, [&](int64_t begin, int64_t end) {
+                for (int32_t i = begin; i < end; i++) {
+                    TSVAL norm = 0;
+                    for (size_t j = 0; j < dim; j++) {
+                        uint16_t h = convert(this->_centers[i](j));
+                        this->_centers16[i * dim + j] = h;
+                        norm += restore(h) * restore(h);
+                    }
+                    this->_center_norms[i] = norm;
+                }
+            });
+        }
+    }
+
+    if (this->is_pruned() || this->is_dim_major() || this->is_half()) {
+        std::vector<DSVEC>().swap(this->_centers);
+    }
+}
+
+size_t SparseKMeansModel::center_bytes() const {
+    size_t ret = this->_center_matrix.size() * sizeof(TSVAL)
+        + this->_center_norms.size() * sizeof(TSVAL)
+        + this->_centers16.size() * sizeof(uint16_t)
+        + this->_posting_dims.size() * sizeof(int32_t)
+        + this->_posting_offsets.size() * sizeof(uint32_t)
+        + this->_posting_cids.size() * sizeof(int32_t)
+        + (this->_posting_weights.size() + this->_posting_max.size()) * sizeof(TSVAL);
+    for (auto iter = this->_centers.begin(); iter != this->_centers.end(); iter++) {
+        ret += iter->size() * sizeof(TSVAL);
+    }
+    for (auto iter = this->_sparse_centers.begin(); iter != this->_sparse_centers.end(); iter++) {
+        ret += iter->nnz() * (sizeof(TSVAL) + sizeof(size_t));
+    }
+
+    return ret;
+}
+
+// dot products against the fp16 / bf16 centers, accumulated in fp32
+template <typename P>
+void SparseKMeansModel::score_half(const SPVEC& x, std::vector<TSVAL>& scores) const {
+    size_t n = this->_center_norms.size();
+    size_t dim = this->_centers16.size() / n;
+    std::fill(scores.begin(), scores.end(), 0);
+
+    TSVAL x_norm = 0;
+    for (auto iter = x.begin(); iter != x.end(); iter++) {
+        x_norm += *iter * *iter;
+    }
+
+    if (this->is_dim_major()) {
+        for (auto iter = x.begin(); iter != x.end(); iter++) {
+            const uint16_t* row = &this->_centers16[iter.index() * n];
+            if (this->_precision == CENTER_FP16) {
+                half_axpy(row, *iter, scores.data(), n);
+            } else {
+                bf16_axpy(row, *iter, scores.data(), n);
+            }
+        }
+    } else {
+        float (*restore)(uint16_t) = this->_precision == CENTER_FP16 ? half_to_float : bf16_to_float;
+        for (size_t i = 0; i < n; i++) {
+            const uint16_t* c = &this->_centers16[i * dim];
+            TSVAL dot = 0;
+            for (auto iter = x.begin(); iter != x.end(); iter++) {
+                dot += *iter * restore(c[iter.index()]);
+            }
+            scores[i] = dot;
+        }
+    }
+
+    finish_scores<P>(scores.data(), this->_center_norms.data(), x_norm, n);
+}
+
+void SparseKMeansModel::build_center_matrix() {
+    if (!this->is_dim_major() || this->_centers.empty()) {
+        return;
+    }
+
+    size_t k = this->_centers.size();
+    size_t dim = this->_centers[0].size();
+    this->_center_matrix.assign(dim * k, 0);
+
+    this->parallel_for(k, [&](int64_t begin, int64_t end) {
+        for (int32_t i = begin; i < end; i++) {
+            const DSVEC& c = this->_centers[i];
+            for (size_t j = 0; j < dim; j++) {
+                this->_center_matrix[j * k + i] = c(j);
+            }
+        }
+    });
+}
+
+// squared norms of the centers of the current layout, used by the distance policies
+void SparseKMeansModel::build_center_norms() {
+    if (this->is_pruned()) {
+        this->_center_norms.resize(this->_sparse_centers.size());
+        for (size_t i = 0; i < this->_sparse_centers.size(); i++) {
+            const CPVEC& c = this->_sparse_centers[i];
+            TSVAL norm = 0;
+            for (size_t p = 0; p < c.nnz(); p++) {
+                norm += c.value_data()[p] * c.value_data()[p];
+            }
+            this->_center_norms[i] = norm;
+        }
+    } else {
+        this->_center_norms.resize(this->_centers.size());
+        this->parallel_for(this->_centers.size(), [&](int64_t begin, int64_t end) {
+            for (int32_t i = begin; i < end; i++) {
+                this->_center_norms[i] = boost::numeric::ublas::inner_prod(this->_centers[i], this->_centers[i]);
+            }
+        });
+    }
+}
+
+void SparseKMeansModel::prune_centers() {
+    if (!this->is_pruned()) {
+        return;
+    }
+
+    this->_sparse_centers.resize(this->_centers.size());
+    this->parallel_for(this->_centers.size(), [&](int64_t begin, int64_t end) {
+        for (int32_t i = begin; i < end; i++) {
+            this->_sparse_centers[i] = prune_center(this->_centers[i], this->_prune_top_m, this->_prune_mass);
+        }
+    });
+}
+
+CPVEC prune_center(const DSVEC& d, size_t top_m, float mass) {
+    std::vector<std::pair<TSVAL, int32_t>> nz;
+    TSVAL total = 0;
+    for (int32_t i = 0; i < d.size(); i++) {
+        if (d(i) != 0) {
+            nz.push_back(std::make_pair(-fabs(d(i)), i));
+            total += fabs(d(i));
+        }
+    }
+
+    size_t keep = nz.size();
+    if (top_m > 0 && top_m < keep) {
+        keep = top_m;
+        std::nth_element(nz.begin(), nz.begin() + keep, nz.end());
+        nz.resize(keep);
+    }
+    std::sort(nz.begin(), nz.end());
+
+    if (mass > 0 && mass < 1) {
+        TSVAL acc = 0;
+        for (size_t i = 0; i < keep; i++) {
+            acc -= nz[i].first;
+            if (acc >= mass * total) {
+                keep = i + 1;
+                break;
+            }
+        }
+        nz.resize(keep);
+    }
+
+    std::vector<int32_t> idx;
+    for (auto iter = nz.begin(); iter != nz.end(); iter++) {
+        idx.push_back(iter->second);
+    }
+    std::sort(idx.begin(), idx.end());
+
+    CPVEC ret(d.size(), idx.size());
+    for (auto iter = idx.begin(); iter != idx.end(); iter++) {
+        ret.push_back(*iter, d(*iter));
+    }
+
+    return ret;
+}
+
 int32_t constant_degree(const DSVEC& d) {
     return 1;
 }
 
+size_t fixed_node_k(size_t samples, size_t max_node_size, size_t k) {
+    return k;
+}
+
+size_t balanced_node_k(size_t samples, size_t max_node_size, size_t k) {
+    double leaves = (double)samples / std::max(max_node_size, (size_t)1);
+    if (leaves <= 1 || k < 2) {
+        return std::min(k, (size_t)2);
+    }
+
+    double levels = ceil(log(leaves) / log((double)k) - 1e-9);
+    size_t ret = (size_t)ceil(pow(leaves, 1 / levels) - 1e-9);
+    return std::max((size_t)2, std::min(ret, k));
+}
+
+// rebuilds a center from the dimension major or half precision storage
+DSVEC SparseKMeansModel::frozen_center(size_t cid) const {
+    size_t n = this->_center_norms.size();
+    size_t dim = (this->is_half() ? this->_centers16.size() : this->_center_matrix.size()) / n;
+    float (*restore)(uint16_t) = this->_precision == CENTER_FP16 ? half_to_float : bf16_to_float;
+
+    DSVEC ret(dim);
+    for (size_t j = 0; j < dim; j++) {
+        size_t p = this->is_dim_major() ? j * n + cid : cid * dim + j;
+        ret(j) = this->is_half() ? restore(this->_centers16[p]) : this->_center_matrix[p];
+    }
+
+    return ret;
+}
+
 std::string SparseKMeansModel::to_string() const {
     std::ostringstream stream;
     stream << "{\"centers\": [";
-    
+
+    if ((this->is_dim_major() || this->is_half()) && this->_centers.empty() && !this->_center_norms.empty()) {
+        size_t n = this->_center_norms.size();
+        stream << "@0:" << sp_vec_to_string(this->frozen_center(0));
+        if (n > 1) {
+            stream << (n > 2 ? " ... " : " , ") << "@" << n - 1 << ":" << sp_vec_to_string(this->frozen_center(n - 1));
+        }
+        stream << "]}";
+        return stream.str();
+    }
+
+    if (this->is_pruned()) {
+        size_t n = this->_sparse_centers.size();
+        if (n > 0) {
+            stream << "@0:" << sp_vec_to_string(this->_sparse_centers[0]);
+        }
+        if (n > 1) {
+            stream << (n > 2 ? " ... " : " , ") << "@" << n - 1 << ":" << sp_vec_to_string(this->_sparse_centers[n - 1]);
+        }
+        stream << "]}";
+        return stream.str();
+    }
+
     stream << "@0:" << sp_vec_to_string(this->_centers[0]);
     if (this->_centers.size() > 2) {
         stream << " ... " << "@" << this->_centers.size() - 1 << ":" << sp_vec_to_string(this->_centers[this->_centers.size() - 1]);
@@ -404,6 +1749,26 @@ std::string SparseKMeansModel::to_string() const {
     return stream.str();
 }
 
+TSVAL inversed_dot_dist(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq) {
+    return InversedDotDist::dist(dot, center_norm_sq, sample_norm_sq);
+}
+
+TSVAL l2_sq_dot_dist(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq) {
+    return L2SqDist::dist(dot, center_norm_sq, sample_norm_sq);
+}
+
+TSVAL l2_dot_dist(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq) {
+    return L2Dist::dist(dot, center_norm_sq, sample_norm_sq);
+}
+
+TSVAL negative_dot_dist(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq) {
+    return NegativeDotDist::dist(dot, center_norm_sq, sample_norm_sq);
+}
+
+TSVAL negative_dense_sparse_dot(const DSVEC& d, const SPVEC& v) {
+    return -boost::numeric::ublas::inner_prod(d, v);
+}
+
 TSVAL inversed_dense_sparse_dot(const DSVEC& d, const SPVEC& v) {
     return 1.0 / (boost::numeric::ublas::inner_prod(d, v) + 0.000000001);
 }
@@ -419,3 +1784,48 @@ TSVAL dense_sparse_l2_distance(const DSVEC& d, const SPVEC& v) {
     return sqrt(dense_sparse_l2_distance_sq(d, v));
 }
 
+
+
+TSVAL sparse_sparse_dot(const CPVEC& c, const SPVEC& v) {
+    const size_t nnz = c.nnz();
+    const auto* idx = &c.index_data()[0];
+    const TSVAL* val = &c.value_data()[0];
+
+    size_t p = 0;
+    TSVAL s = 0;
+    for (auto iter = v.begin(); iter != v.end() && p < nnz; iter++) {
+        p = std::lower_bound(idx + p, idx + nnz, iter.index()) - idx;
+        if (p < nnz && idx[p] == iter.index()) {
+            s += val[p] * *iter;
+        }
+    }
+
+    return s;
+}
+
+TSVAL inversed_sparse_sparse_dot(const CPVEC& c, const SPVEC& v) {
+    return 1.0 / (sparse_sparse_dot(c, v) + 0.000000001);
+}
+
+TSVAL negative_sparse_sparse_dot(const CPVEC& c, const SPVEC& v) {
+    return -sparse_sparse_dot(c, v);
+}
+
+TSVAL sparse_sparse_l2_distance_sq(const CPVEC& c, const SPVEC& v) {
+    const size_t nnz = c.nnz();
+    const TSVAL* val = &c.value_data()[0];
+
+    TSVAL s = 0;
+    for (size_t p = 0; p < nnz; p++) {
+        s += val[p] * val[p];
+    }
+    for (auto iter = v.begin(); iter != v.end(); iter++) {
+        s += *iter * *iter;
+    }
+
+    return s - 2 * sparse_sparse_dot(c, v);
+}
+
+TSVAL sparse_sparse_l2_distance(const CPVEC& c, const SPVEC& v) {
+    return sqrt(std::max((TSVAL)0, sparse_sparse_l2_distance_sq(c, v)));
+}
\ No newline at end of file
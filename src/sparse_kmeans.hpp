@@ -3,26 +3,89 @@
 #include <stdint.h>
 #include <stdio.h>
 #include "sparse.hpp"
+#include "metrics.hpp"
+#include "executor.hpp"
 #include <vector>
 
 #define EXK_FAIL -1
 #define EXK_END 1
 #define EXK_SUC 0
 
+#define CENTER_FP32 0
+#define CENTER_FP16 1
+#define CENTER_BF16 2
+
+#define BALANCE_NONE 0
+#define BALANCE_SOFT 1
+#define BALANCE_HARD 2
+// closest centers kept per sample by the balanced assignment, the others are rescored
+// only for the samples their bound can't rule out
+#define BALANCE_CANDIDATES 8
+
+// bytes fit_stream keeps per sample of a block, its distance and its member index
+#define FIT_STREAM_SAMPLE_BYTES (sizeof(TSVAL) + sizeof(int32_t))
+// bytes fit keeps per sample, its assignment, distance, scale and member index
+#define FIT_SAMPLE_BYTES (2 * sizeof(TSVAL) + 2 * sizeof(int32_t))
+
+// streams of the model random generator
+#define RNG_SEEDING 0
+#define RNG_SUBSAMPLE 1
+#define RNG_RESERVOIR 2
+
+// mean distance of the samples to their centers, for a subsampled fit
+struct SubsampleQuality {
+    size_t samples;
+    size_t subsample;
+    double subsample_dist;
+    double full_dist;
+};
+
 #define DENSE_SPARSE_DIST_FUNC(x) TSVAL(*x)(const DSVEC& d, const SPVEC& v)
 #define SAMPLE_DEGREE_FUNC(x) int32_t(*x)(const DSVEC& d)
+#define SPARSE_SPARSE_DIST_FUNC(x) TSVAL(*x)(const CPVEC& c, const SPVEC& v)
+// maps the dot product of a center and a sample to their distance, given both squared norms
+#define DOT_DIST_FUNC(x) TSVAL(*x)(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq)
+// number of children of a tree node holding samples, at most k
+#define NODE_K_FUNC(x) size_t(*x)(size_t samples, size_t max_node_size, size_t k)
 
 TSVAL inversed_dense_sparse_dot(const DSVEC& d, const SPVEC& v);
 TSVAL dense_sparse_l2_distance_sq(const DSVEC& d, const SPVEC& v);
 TSVAL dense_sparse_l2_distance(const DSVEC& d, const SPVEC& v);
+// selects spherical k-means, the cosine distance up to the sample norm for unit centers
+TSVAL negative_dense_sparse_dot(const DSVEC& d, const SPVEC& v);
+
+TSVAL sparse_sparse_dot(const CPVEC& c, const SPVEC& v);
+TSVAL inversed_sparse_sparse_dot(const CPVEC& c, const SPVEC& v);
+TSVAL sparse_sparse_l2_distance_sq(const CPVEC& c, const SPVEC& v);
+TSVAL sparse_sparse_l2_distance(const CPVEC& c, const SPVEC& v);
+TSVAL negative_sparse_sparse_dot(const CPVEC& c, const SPVEC& v);
+
+TSVAL inversed_dot_dist(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq);
+TSVAL l2_sq_dot_dist(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq);
+TSVAL l2_dot_dist(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq);
+TSVAL negative_dot_dist(TSVAL dot, TSVAL center_norm_sq, TSVAL sample_norm_sq);
+
+CPVEC prune_center(const DSVEC& d, size_t top_m, float mass);
 
 int32_t constant_degree(const DSVEC& d);
 
+// always k
+size_t fixed_node_k(size_t samples, size_t max_node_size, size_t k);
+// the fewest levels of at most k children down to max_node_size leaves, with the same
+// fan-out on every level, e.g. 1500 samples over 1000 sample leaves take 2 children
+size_t balanced_node_k(size_t samples, size_t max_node_size, size_t k);
+
+class SampleStream;
+
 class SparseKMeansModel {
 private:
     std::vector<DSVEC> _centers;
     std::vector<TSVAL> _hist;
     size_t _k;
+    // k of the prototype, the bound of the per-node k
+    size_t _max_k;
+    NODE_K_FUNC(_node_k_func);
+    std::vector<size_t> _level_k_caps;
     size_t _iters;
     bool _exclusive;
     std::string _init_mode;
@@ -30,17 +93,110 @@ private:
     SAMPLE_DEGREE_FUNC(_sample_degree_func);
     float _cut_rate;
 
+    // pruned centers, when enabled they replace _centers once the training is done
+    size_t _prune_top_m;
+    float _prune_mass;
+    std::vector<CPVEC> _sparse_centers;
+    SPARSE_SPARSE_DIST_FUNC(_sparse_dist_func);
+
+    // dimension major layout, row j holds the j-th weight of all the centers
+    bool _dim_major;
+    std::vector<TSVAL> _center_matrix;
+    std::vector<TSVAL> _center_norms;
+
+    // distance policies of _dist_func and _sparse_dist_func, DP_CUSTOM without one
+    int32_t _policy;
+    int32_t _sparse_policy;
+
+    // inverted index over the pruned centers, postings of dim _posting_dims[i] are
+    // [_posting_offsets[i], _posting_offsets[i+1]) of _posting_cids and _posting_weights
+    bool _inverted;
+    std::vector<int32_t> _posting_dims;
+    std::vector<uint32_t> _posting_offsets;
+    std::vector<int32_t> _posting_cids;
+    std::vector<TSVAL> _posting_weights;
+    std::vector<TSVAL> _posting_max;
+
+    // frozen half precision centers, in the dense or dimension major layout
+    int32_t _precision;
+    std::vector<uint16_t> _centers16;
+
+    // balanced assignment of the exclusive in-memory fit
+    int32_t _balance;
+    float _balance_param;
+
+    // all the training draws derive from it, see random.hpp
+    uint64_t _seed;
+
+    // build instrumentation, shared by the models of a tree
+    Metrics* _metrics;
+    // runs the parallel loops, the shared executor when NULL, with at most _max_threads
+    Executor* _executor;
+    size_t _max_threads;
+    // node models a tree trains at once, 0 for one per thread
+    size_t _parallel_fits;
+    void parallel_for(int64_t n, const RANGE_FUNC& body, int64_t grain = 0) const {
+        this->executor().parallel_for(n, body, PRIORITY_BUILD, this->_max_threads, grain);
+    }
+    // empty centers reseeded by the last fit
+    size_t _recoveries;
+    size_t _fit_iterations;
+    double _inertia;
+    // centers the next fit starts from instead of seeding
+    std::vector<DSVEC> _initial_centers;
+
+    // subsampled fit of the exclusive in-memory training
+    size_t _subsample_max;
+    float _subsample_fraction;
+    SubsampleQuality _subsample_quality;
+
     // training premise will be cleared after training is done
     std::vector<int32_t> _assignment;
     std::vector<std::vector<std::pair<int32_t, TSVAL>>> _u;
     std::vector<int32_t> _degrees;
     const std::vector<const SPVEC*>* _samples;
+    // weights of the samples, NULL when they all weigh 1
+    const std::vector<TSVAL>* _weights;
+    // inversed sample norms of the spherical k-means
+    std::vector<TSVAL> _sample_scales;
 
+    int32_t fit_samples(const std::vector<const SPVEC*>& samples, const std::vector<TSVAL>* weights);
+    int32_t fit_subsample(const std::vector<const SPVEC*>& samples, const std::vector<TSVAL>* weights, size_t m);
+    TSVAL sample_weight(size_t i) const {
+        return this->_weights != NULL ? (*this->_weights)[i] : 1;
+    }
     int32_t iterate();
     int32_t kmeans_m_step();
     int32_t kmeans_e_step();
 
     int32_t initialize_centers();
+    int32_t recover_empty_centers(std::vector<std::vector<int32_t>>& members);
+    int32_t recover_empty_fuzzy_centers();
+    void balanced_assignment(std::vector<int32_t>& assignment, std::vector<TSVAL>& dists) const;
+    // _inertia of the E-step from the distance of every sample to its center
+    void update_inertia(const std::vector<TSVAL>& dists);
+    void prune_centers();
+    void build_center_matrix();
+    void build_center_norms();
+    void build_inverted_index();
+    void update_layout();
+    size_t num_centers() const {
+        if (this->is_pruned()) {
+            return this->_sparse_centers.size();
+        }
+        return this->is_dim_major() || this->is_half() ? this->_center_norms.size() : this->_centers.size();
+    }
+    bool is_half() const {
+        return !this->_centers16.empty();
+    }
+    template <typename P> void score_half(const SPVEC& x, std::vector<TSVAL>& scores) const;
+    DSVEC frozen_center(size_t cid) const;
+    // with top > 0 only the top closest scores have to be exact
+    void score_centers(const SPVEC& x, std::vector<TSVAL>& scores, size_t top = 0) const;
+    template <typename P> void score_inverted(const SPVEC& x, std::vector<TSVAL>& scores, size_t top) const;
+    // the scoring loops with the distance inlined, instantiated in the cpp only
+    template <typename P> void score_with(const SPVEC& x, std::vector<TSVAL>& scores, size_t top) const;
+    void score_custom(const SPVEC& x, std::vector<TSVAL>& scores) const;
 
 public:
     size_t get_k() const {
@@ -51,10 +207,150 @@ public:
         return this->_exclusive;
     }
 
+    // Spherical k-means, selected by negative_dense_sparse_dot. Samples count by their
+    // direction and centers are renormalized to unit length after every M-step, so the
+    // assignment is the largest dot product, with no sample normalization at query time.
+    bool is_spherical() const {
+        return this->_dist_func == negative_dense_sparse_dot;
+    }
+
+    DENSE_SPARSE_DIST_FUNC(get_dist_func() const) {
+        return this->_dist_func;
+    }
+
     const std::vector<DSVEC>& get_centers() const {
         return this->_centers;
     }
 
+    const std::vector<CPVEC>& get_sparse_centers() const {
+        return this->_sparse_centers;
+    }
+
+    bool is_pruned() const {
+        return this->_prune_top_m > 0 || (this->_prune_mass > 0 && this->_prune_mass < 1);
+    }
+
+    bool is_dim_major() const {
+        return this->_dim_major && !this->is_pruned();
+    }
+
+    // store the dense centers transposed, so that every nonzero of a sample is
+    // scored against all the centers with one contiguous multiply-add
+    int32_t set_dimension_major(bool dim_major);
+
+    bool is_inverted() const {
+        return this->_inverted && this->is_pruned();
+    }
+
+    // score the pruned centers term at a time through an inverted index, with
+    // max-score early termination when only the closest few are needed
+    int32_t set_inverted_index(bool inverted);
+
+    // store the centers in fp16 or bf16 once the training is done, scoring still
+    // accumulates in fp32, not applied to pruned centers
+    int32_t set_center_precision(int32_t precision);
+    // drops the training only dense centers and applies the center precision,
+    // called at the end of fit
+    void freeze_centers();
+    size_t center_bytes() const;
+    // peak a fit of n samples of dimension dim holds besides the samples, for the k the
+    // model was built with: the dense centers, their accumulators or the dimension major
+    // copy, and FIT_SAMPLE_BYTES per sample
+    size_t training_bytes(size_t n, size_t dim) const {
+        return 2 * this->_max_k * dim * sizeof(TSVAL) + n * FIT_SAMPLE_BYTES;
+    }
+
+    // records seeding time and iterations of every fit, copied models share it
+    void set_metrics(Metrics* metrics) {
+        this->_metrics = metrics;
+    }
+
+    // executor of the training loops, copied models share it, max_threads caps the
+    // threads of every loop, 0 for all of the executor
+    void set_executor(Executor* executor, size_t max_threads = 0) {
+        this->_executor = executor;
+        this->_max_threads = max_threads;
+    }
+
+    Executor& executor() const {
+        return this->_executor != NULL ? *this->_executor : Executor::shared();
+    }
+
+    size_t get_max_threads() const {
+        return this->_max_threads;
+    }
+
+    // Trees built with this model train at most fits node models at once, 0 for one
+    // per thread of the executor. Each training holds training_bytes() until its
+    // centers are frozen, pruned or not, so this caps the peak of a build
+    void set_parallel_fits(size_t fits) {
+        this->_parallel_fits = fits;
+    }
+
+    size_t get_parallel_fits() const {
+        return this->_parallel_fits;
+    }
+
+    // The training is a function of the seed and the samples only, whatever the thread
+    // count. Trees give every node the seed of its parent mixed with its child index.
+    void set_seed(uint64_t seed) {
+        this->_seed = seed;
+    }
+
+    uint64_t get_seed() const {
+        return this->_seed;
+    }
+
+    // Balance the cluster sizes of the exclusive fit: BALANCE_SOFT charges every center
+    // param times the mean regret for each mean cluster size it already holds,
+    // BALANCE_HARD caps the clusters at ceil(param * n / k) samples, param >= 1
+    int32_t set_balance(int32_t mode, float param);
+
+    // Children of the tree nodes, func of the node size, max_node_size and the k the
+    // model was built with, capped by level_k_caps[depth] on the levels it covers
+    void set_node_k(NODE_K_FUNC(func), const std::vector<size_t>& level_k_caps = std::vector<size_t>());
+    size_t node_k(size_t samples, size_t max_node_size, size_t depth) const;
+    // k of the next fit, at most the k the model was built with
+    int32_t set_k(size_t k);
+
+    // Fit on a uniform subsample of at most max_samples samples (0 for no cap), or of
+    // fraction of them (0 for all), never fewer than k, then assign all the samples to
+    // the fitted centers in one parallel pass. Exclusive only, the final pass is the
+    // plain closest center assignment even when balanced.
+    int32_t set_subsample(size_t max_samples, float fraction = 0);
+    size_t subsample_size(size_t n) const;
+
+    // of the last fit, samples == subsample when it was not subsampled
+    const SubsampleQuality& get_subsample_quality() const {
+        return this->_subsample_quality;
+    }
+
+    // keep every center as its top_m weights, or the largest ones carrying mass of its total,
+    // once the training is done, the iterations still run on the dense centers
+    int32_t set_center_pruning(size_t top_m, float mass = 0, SPARSE_SPARSE_DIST_FUNC(sparse_dist_func) = NULL);
+
+    // Warm start, the next fit (or fit_stream) starts its iterations from these centers
+    // instead of seeding, k becomes their number, at most the k the model was built with
+    int32_t set_initial_centers(const std::vector<DSVEC>& centers);
+    // dense copies of the centers in any layout, pruned and half precision ones included
+    std::vector<DSVEC> export_centers() const;
+
+    size_t get_fit_iterations() const {
+        return this->_fit_iterations;
+    }
+
+    // weighted sum of the distances of the samples to their closest center in the last
+    // E-step of fit, the training objective
+    double get_inertia() const {
+        return this->_inertia;
+    }
+
+    // An iteration leaving a center without members reseeds it instead of failing the
+    // fit, the fit fails only when no cluster has a member to spare.
+    size_t get_recoveries() const {
+        return this->_recoveries;
+    }
+
     const std::vector<int32_t>& get_assignment() const {
         return this->_assignment;
     }
@@ -67,6 +363,8 @@ public:
         this->_assignment.clear();
         this->_u.clear();
         this->_samples = NULL;
+        this->_weights = NULL;
+        std::vector<TSVAL>().swap(this->_sample_scales);
         return EXK_SUC;
     }
 
@@ -76,7 +374,11 @@ public:
                       SAMPLE_DEGREE_FUNC(degree_func) = constant_degree, 
                       float cut_rate = 2);
     SparseKMeansModel(const SparseKMeansModel& t);
-    int32_t fit(const std::vector<const SPVEC*>& samples);
+    // weights, one positive weight per sample, count a sample as that many copies of
+    // it in the seeding, the balancing and the center sums
+    int32_t fit(const std::vector<const SPVEC*>& samples, const std::vector<TSVAL>* weights = NULL);
+    // memory_budget bounds the centers, the assignment of the whole stream and the blocks
+    int32_t fit_stream(SampleStream& stream, size_t memory_budget);
     int32_t predict(const SPVEC& x, TSVAL* dist=NULL); 
     std::vector<std::pair<int32_t, TSVAL>> predict(const SPVEC& x, int32_t k); 
 
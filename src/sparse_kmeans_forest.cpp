@@ -0,0 +1,186 @@
+#include "sparse_kmeans_forest.hpp"
+#include "topk.hpp"
+#include "random.hpp"
+#include <algorithm>
+#include <cmath>
+
+SparseKMeansForest::SparseKMeansForest(
+    LeafPayLoad* sample_payload,
+    const std::vector<const SPVEC*>& training_samples,
+    const SparseKMeansModel& prototype,
+    int32_t trees,
+    float subsample_fraction,
+    int32_t max_node_size,
+    const std::vector<TSVAL>* training_weights) {
+    this->_func = prototype.get_dist_func();
+    this->_max_id = -1;
+    this->_executor = &prototype.executor();
+    this->_max_threads = prototype.get_max_threads();
+    this->_trees.assign(std::max(trees, 1), NULL);
+
+    // new_payload of the shared payload only allocates and is safe to call from every
+    // tree at once
+    this->_executor->parallel_for(this->_trees.size(), [&](int64_t begin, int64_t end) {
+        for (int32_t t = begin; t < end; t++) {
+            uint64_t seed = mix_seed(prototype.get_seed(), t);
+            SparseKMeansModel model(prototype);
+            model.set_seed(seed);
+
+            std::vector<size_t> picked;
+            this->subsample(training_samples.size(), subsample_fraction, seed, picked);
+            std::vector<const SPVEC*> samples;
+            std::vector<TSVAL> weights;
+            for (auto iter = picked.begin(); iter != picked.end(); iter++) {
+                samples.push_back(training_samples[*iter]);
+                if (training_weights != NULL) {
+                    weights.push_back((*training_weights)[*iter]);
+                }
+            }
+
+            this->_trees[t] = new SparseKMeansTree(sample_payload, samples, model, max_node_size,
+                                                   training_weights != NULL ? &weights : NULL);
+        }
+    }, PRIORITY_BUILD, this->_max_threads, 1);
+}
+
+// picks round(fraction * n) indices without replacement, in increasing order
+void SparseKMeansForest::subsample(size_t n, float fraction, uint64_t seed, std::vector<size_t>& picked) const {
+    picked.resize(n);
+    for (size_t i = 0; i < n; i++) {
+        picked[i] = i;
+    }
+    if (fraction >= 1 || n == 0) {
+        return;
+    }
+
+    size_t m = std::max((size_t)1, (size_t)std::round(fraction * n));
+    PhiloxRng rng(seed, RNG_SUBSAMPLE);
+    for (size_t i = 0; i < m; i++) {
+        std::swap(picked[i], picked[i + rng.below(n - i)]);
+    }
+    picked.resize(m);
+    std::sort(picked.begin(), picked.end());
+}
+
+int32_t SparseKMeansForest::insert(int32_t id, const SPVEC& v, TSVAL weight) {
+    std::atomic<bool> failed(false);
+    this->_executor->parallel_for(this->_trees.size(), [&](int64_t begin, int64_t end) {
+        for (int32_t t = begin; t < end; t++) {
+            if (EXK_FAIL == this->_trees[t]->insert(id, v, weight)) {
+                failed = true;
+            }
+        }
+    }, PRIORITY_INGEST, this->_max_threads, 1);
+    int32_t max_id = this->_max_id.load();
+    while (max_id < id && !this->_max_id.compare_exchange_weak(max_id, id)) {
+    }
+
+    return failed ? EXK_FAIL : EXK_SUC;
+}
+
+int32_t SparseKMeansForest::insert_batch(const std::vector<int32_t>& ids, const std::vector<const SPVEC*>& vecs,
+                                         const std::vector<TSVAL>* weights) {
+    std::atomic<bool> failed(false);
+    this->_executor->parallel_for(this->_trees.size(), [&](int64_t begin, int64_t end) {
+        for (int32_t t = begin; t < end; t++) {
+            if (EXK_FAIL == this->_trees[t]->insert_batch(ids, vecs, weights)) {
+                failed = true;
+            }
+        }
+    }, PRIORITY_INGEST, this->_max_threads, 1);
+    int32_t max_id = this->_max_id.load();
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        while (max_id < *iter && !this->_max_id.compare_exchange_weak(max_id, *iter)) {
+        }
+    }
+
+    return failed ? EXK_FAIL : EXK_SUC;
+}
+
+size_t SparseKMeansForest::search_candidates(const SPVEC& v, int32_t beam, std::vector<int32_t>& ret) const {
+    std::vector<std::vector<int32_t>> found(this->_trees.size());
+    this->_executor->parallel_for(this->_trees.size(), [&](int64_t begin, int64_t end) {
+        for (int32_t t = begin; t < end; t++) {
+            EpochManager::Guard guard = this->_trees[t]->read_guard();
+            std::vector<const LeafPayLoad*> leaves = this->_trees[t]->search_for_leaves(v, beam);
+            std::vector<int32_t> ids;
+            for (auto leaf = leaves.begin(); leaf != leaves.end(); leaf++) {
+                (*leaf)->get_all_ids(ids);
+                found[t].insert(found[t].end(), ids.begin(), ids.end());
+            }
+        }
+    }, PRIORITY_QUERY, this->_max_threads, 1);
+
+    // one bit per id, kept by the thread and cleared through the ids it set
+    static thread_local std::vector<uint64_t> seen;
+    size_t words = (size_t)(this->_max_id + 1) / 64 + 1;
+    if (seen.size() < words) {
+        seen.resize(words, 0);
+    }
+
+    ret.clear();
+    for (auto tree = found.begin(); tree != found.end(); tree++) {
+        for (auto iter = tree->begin(); iter != tree->end(); iter++) {
+            size_t w = (size_t)*iter / 64;
+            if (w >= seen.size()) {
+                seen.resize(w + 1, 0);
+            }
+            uint64_t bit = 1ull << (*iter % 64);
+            if ((seen[w] & bit) == 0) {
+                seen[w] |= bit;
+                ret.push_back(*iter);
+            }
+        }
+    }
+    for (auto iter = ret.begin(); iter != ret.end(); iter++) {
+        seen[*iter / 64] = 0;
+    }
+
+    return ret.size();
+}
+
+std::vector<std::pair<int32_t, TSVAL>> SparseKMeansForest::search(const SPVEC& v, int32_t topk, int32_t beam,
+                                                                  const VectorBase& base) const {
+    std::vector<int32_t> candidates;
+    this->search_candidates(v, beam, candidates);
+
+    // dense query kept by the thread, only the nonzeros of v are set and cleared
+    static thread_local DSVEC q;
+    if (q.size() != v.size()) {
+        q.resize(v.size(), false);
+        q.clear();
+    }
+    for (auto iter = v.begin(); iter != v.end(); iter++) {
+        q(iter.index()) = *iter;
+    }
+
+    std::vector<TSVAL> dists(candidates.size());
+    try {
+        this->_executor->parallel_for(candidates.size(), [&](int64_t begin, int64_t end) {
+            for (int32_t i = begin; i < end; i++) {
+                dists[i] = this->_func(q, base.at(candidates[i]));
+            }
+        }, PRIORITY_QUERY, this->_max_threads);
+    } catch (...) {
+        q.clear();
+        throw;
+    }
+    for (auto iter = v.begin(); iter != v.end(); iter++) {
+        q(iter.index()) = 0;
+    }
+
+    Topk<int32_t, TSVAL> top(topk);
+    for (size_t i = 0; i < candidates.size(); i++) {
+        top.insert(candidates[i], dists[i]);
+    }
+
+    std::vector<std::pair<int32_t, TSVAL>> ret;
+    top.finalize(ret);
+    return ret;
+}
+
+SparseKMeansForest::~SparseKMeansForest() {
+    for (auto iter = this->_trees.begin(); iter != this->_trees.end(); iter++) {
+        delete *iter;
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef SPARSE_KMEANS_FOREST_HPP
+#define SPARSE_KMEANS_FOREST_HPP
+#include <vector>
+#include <atomic>
+#include "sparse_kmeans_tree.hpp"
+#include "vector_base.hpp"
+
+// Randomized k-means forest. Every tree is fitted with its own seed, mixed from the
+// prototype seed and the tree index, on its own uniform subsample of the training
+// samples, so the trees cut the space differently and their leaves miss different
+// neighbors. Members are inserted into every tree and point into one shared VectorBase.
+class SparseKMeansForest {
+private:
+    std::vector<SparseKMeansTree*> _trees;
+    DENSE_SPARSE_DIST_FUNC(_func);
+    // largest inserted id, sizes the candidate bitset
+    std::atomic<int32_t> _max_id;
+    // executor and thread cap of the prototype
+    Executor* _executor;
+    size_t _max_threads;
+
+    void subsample(size_t n, float fraction, uint64_t seed, std::vector<size_t>& picked) const;
+public:
+    // the trees are built in parallel on the executor of the prototype, training_weights,
+    // one per sample when given, follow the samples into the subsamples
+    SparseKMeansForest(LeafPayLoad* sample_payload,
+                       const std::vector<const SPVEC*>& training_samples,
+                       const SparseKMeansModel& prototype,
+                       int32_t trees,
+                       float subsample_fraction = 1,
+                       int32_t max_node_size = 1000,
+                       const std::vector<TSVAL>* training_weights = NULL
+                       );
+
+    int32_t insert(int32_t id, const SPVEC& v, TSVAL weight);
+    // SparseKMeansTree::insert_batch into every tree
+    int32_t insert_batch(const std::vector<int32_t>& ids, const std::vector<const SPVEC*>& vecs,
+                         const std::vector<TSVAL>* weights = NULL);
+
+    // union of the leaf members found by a beam search of every tree, searched in
+    // parallel, each id once in the order of the first tree holding it
+    size_t search_candidates(const SPVEC& v, int32_t beam, std::vector<int32_t>& ret) const;
+    // candidates reranked exactly against base with the distance of the trees,
+    // closest first
+    std::vector<std::pair<int32_t, TSVAL>> search(const SPVEC& v, int32_t topk, int32_t beam, const VectorBase& base) const;
+
+    size_t size() const {
+        return this->_trees.size();
+    }
+
+    const SparseKMeansTree& tree(size_t i) const {
+        return *this->_trees[i];
+    }
+
+    ~SparseKMeansForest();
+};
+
+#endif
@@ -1,8 +1,45 @@
 #include "sparse_kmeans_tree.hpp"
+#include "topk.hpp"
 #include <vector>
 #include <iostream>
+#include <fstream>
+#include <cstdio>
+#include <algorithm>
+#include <unordered_map>
+#include "random.hpp"
 #include <boost/algorithm/string/join.hpp>
 
+#ifdef KMT_METRICS
+// accounts the time and the scoring work of one search or insert, on the calling thread
+struct PathRecord {
+    Metrics* metrics;
+    bool search;
+    uint64_t start;
+    ScoringWork before;
+
+    PathRecord(Metrics* m, bool s): metrics(m), search(s), start(Metrics::now_ns()), before(thread_scoring_work()) {}
+
+    ~PathRecord() {
+        const ScoringWork& after = thread_scoring_work();
+        uint64_t dots = after.center_dots - this->before.center_dots;
+        this->metrics->add(this->search ? MC_SEARCHES : MC_INSERTS, 1);
+        this->metrics->add(MC_CENTER_DOTS, dots);
+        this->metrics->add(MC_NNZ_TOUCHED, after.nnz_touched - this->before.nnz_touched);
+        if (this->search) {
+            this->metrics->record(MH_SEARCH_DOTS, dots);
+        }
+        this->metrics->record(this->search ? MH_SEARCH_NS : MH_INSERT_NS, Metrics::now_ns() - this->start);
+    }
+};
+#define METRIC_PATH(m, search) PathRecord path_record_(m, search)
+#else
+#define METRIC_PATH(m, search) do {} while (0)
+#endif
+
+static void dispose_payload(void* p) {
+    delete static_cast<LeafPayLoad*>(p);
+}
+
 SparseKMeansTree::SparseKMeansTree(
     LeafPayLoad* sample_payload,
     const std::vector<const SPVEC*>& training_samples, 
@@ -17,6 +54,14 @@ SparseKMeansTree::SparseKMeansTree(
     this->_max_node_size = max_node_size;
     this->_root = new KMeansNode;
     this->_root->model = new SparseKMeansModel(k, iterations, exclusive, initiator, func, deg_func, cut_rate);
+    this->_root->model->set_metrics(&this->_metrics);
+    this->_executor = &this->_root->model->executor();
+    this->_max_threads = this->_root->model->get_max_threads();
+    this->_build_bytes = 0;
+    this->_build_peak = 0;
+    this->_parallel_fits = this->_root->model->get_parallel_fits();
+    this->_fits = 0;
+    this->_root->storage = NULL;
     this->_root->count = 0;
     this->_root->children.clear();
     this->_sample_payload = sample_payload;
@@ -26,15 +71,102 @@ SparseKMeansTree::SparseKMeansTree(
     this->fit(training_samples);
 }
 
-int32_t SparseKMeansTree::fit(const std::vector<const SPVEC*>& training_samples) {
-    return fit_node(this->_root, training_samples);
+SparseKMeansTree::SparseKMeansTree(
+    LeafPayLoad* sample_payload,
+    const std::vector<const SPVEC*>& training_samples,
+    const SparseKMeansModel& prototype,
+    int32_t max_node_size,
+    const std::vector<TSVAL>* training_weights) {
+    this->_max_node_size = max_node_size;
+    this->_root = new KMeansNode;
+    this->_root->model = new SparseKMeansModel(prototype);
+    this->_root->model->set_metrics(&this->_metrics);
+    this->_executor = &this->_root->model->executor();
+    this->_max_threads = this->_root->model->get_max_threads();
+    this->_build_bytes = 0;
+    this->_build_peak = 0;
+    this->_parallel_fits = this->_root->model->get_parallel_fits();
+    this->_fits = 0;
+    this->_root->storage = NULL;
+    this->_root->count = 0;
+    this->_root->children.clear();
+    this->_sample_payload = sample_payload;
+    this->_func = prototype.get_dist_func();
+
+    this->fit(training_samples, training_weights);
+}
+
+SparseKMeansTree::SparseKMeansTree(
+    LeafPayLoad* sample_payload,
+    const std::vector<const SPVEC*>& training_samples,
+    const SparseKMeansModel& prototype,
+    const SparseKMeansTree& previous,
+    int32_t max_node_size,
+    const std::vector<TSVAL>* training_weights) {
+    this->_max_node_size = max_node_size;
+    this->_root = new KMeansNode;
+    this->_root->model = new SparseKMeansModel(prototype);
+    this->_root->model->set_metrics(&this->_metrics);
+    this->_executor = &this->_root->model->executor();
+    this->_max_threads = this->_root->model->get_max_threads();
+    this->_build_bytes = 0;
+    this->_build_peak = 0;
+    this->_parallel_fits = this->_root->model->get_parallel_fits();
+    this->_fits = 0;
+    this->_root->storage = NULL;
+    this->_root->count = 0;
+    this->_root->children.clear();
+    this->_sample_payload = sample_payload;
+    this->_func = prototype.get_dist_func();
+
+    this->fit(training_samples, training_weights, previous._root);
+}
+
+SparseKMeansTree::SparseKMeansTree(
+    LeafPayLoad* sample_payload,
+    SampleStream& training_stream,
+    const std::string& work_dir,
+    size_t memory_budget,
+    int32_t max_node_size,
+    int32_t k,
+    int32_t iterations,
+    const char* initiator,
+    DENSE_SPARSE_DIST_FUNC(func),
+    float cut_rate) {
+    this->_max_node_size = max_node_size;
+    this->_root = new KMeansNode;
+    this->_root->model = new SparseKMeansModel(k, iterations, true, initiator, func, constant_degree, cut_rate);
+    this->_root->model->set_metrics(&this->_metrics);
+    this->_executor = &this->_root->model->executor();
+    this->_max_threads = this->_root->model->get_max_threads();
+    this->_build_bytes = 0;
+    this->_build_peak = 0;
+    this->_parallel_fits = this->_root->model->get_parallel_fits();
+    this->_fits = 0;
+    this->_root->storage = NULL;
+    this->_root->count = 0;
+    this->_root->children.clear();
+    this->_sample_payload = sample_payload;
+    this->_func = func;
+    this->_work_dir = work_dir;
+    this->_memory_budget = memory_budget;
+
+    this->fit_node_stream(this->_root, training_stream, "", this->_root->model->get_seed(), 0);
+}
+
+int32_t SparseKMeansTree::fit(const std::vector<const SPVEC*>& training_samples, const std::vector<TSVAL>* training_weights,
+                              const KMeansNode* warm) {
+    return fit_node(this->_root, training_samples, training_weights, this->_root->model->get_seed(), 0, warm);
 }
 
-int32_t SparseKMeansTree::fit_node(KMeansNode* n, const std::vector<const SPVEC*>& training_samples) {
+int32_t SparseKMeansTree::fit_node(KMeansNode* n, const std::vector<const SPVEC*>& training_samples,
+                                   const std::vector<TSVAL>* training_weights, uint64_t seed, size_t depth,
+                                   const KMeansNode* warm) {
     //std::cerr << "Fitting..." << std::endl;
     if (training_samples.size() <= this->_max_node_size) {
         // This is leaf node, initialize payload
         n->storage = this->_sample_payload->new_payload();
+        n->storage.load()->fit(training_samples, training_weights, this->_executor, this->_max_threads);
 
         return EXK_END;
     }
@@ -46,30 +178,272 @@ int32_t SparseKMeansTree::fit_node(KMeansNode* n, const std::vector<const SPVEC*
     if (n->model == NULL) {
         n->model = new SparseKMeansModel(*this->_root->model);
     }
+    n->model->set_seed(seed);
+    int32_t node_k = n->model->node_k(training_samples.size(), this->_max_node_size, depth);
+    n->model->set_k(node_k);
+    if (warm != NULL && warm->model != NULL && !warm->children.empty()) {
+        // the old centers are only reused with the k and the dimension of this node,
+        // otherwise the node is seeded
+        std::vector<DSVEC> centers = warm->model->export_centers();
+        bool fits = centers.size() == (size_t)node_k;
+        for (auto iter = centers.begin(); fits && iter != centers.end(); iter++) {
+            fits = iter->size() == training_samples[0]->size();
+        }
+        if (fits) {
+            n->model->set_initial_centers(centers);
+        }
+    }
 
     //std::cerr << "Model Fitting..." << std::endl;
-    n->model->fit(training_samples);
+    uint64_t start = METRIC_NOW();
+    size_t training = n->model->training_bytes(training_samples.size(), training_samples[0]->size());
+    this->begin_fit();
+    this->hold(training);
+    int32_t fitted = n->model->fit(training_samples, training_weights);
+    this->end_fit();
+    if (EXK_FAIL == fitted) {
+        // fewer distinct samples than centers, the node cannot be split
+        this->release(training);
+        int32_t ret = this->fail_node(n);
+        n->storage.load()->fit(training_samples, training_weights, this->_executor, this->_max_threads);
+        return ret;
+    }
+    METRIC_ADD(&this->_metrics, MC_NODES_FITTED, 1);
+    METRIC_RECORD(&this->_metrics, MH_NODE_FIT_NS, METRIC_NOW() - start);
     //std::cerr << "Model Fitted..." << std::endl;
+    int32_t ret = EXK_SUC;
     if (n->model->is_exclusive()) {
         const std::vector<int32_t>& assignment = n->model->get_assignment();
-        for (int32_t i = 0; i < n->model->get_k(); i++) {
-            std::vector<const SPVEC*> segment;
-            for (auto iter = assignment.begin(); iter != assignment.end(); iter ++) {
-                if (*iter == i) {
-                    segment.push_back(training_samples.at(iter - assignment.begin()));
-                }
+        int32_t k = n->model->get_k();
+        std::vector<size_t> counts(k, 0);
+        for (size_t i = 0; i < assignment.size(); i++) {
+            counts[assignment[i]]++;
+        }
+
+        // the segments are held while the children are fitted, the training outcome
+        // is dropped once they are built
+        size_t segment_bytes = k * 2 * sizeof(std::vector<const SPVEC*>)
+            + assignment.size() * (sizeof(const SPVEC*) + (training_weights != NULL ? sizeof(TSVAL) : 0));
+        this->hold(segment_bytes);
+        std::vector<std::vector<const SPVEC*>> segments(k);
+        std::vector<std::vector<TSVAL>> segment_weights(k);
+        for (int32_t i = 0; i < k; i++) {
+            segments[i].reserve(counts[i]);
+            if (training_weights != NULL) {
+                segment_weights[i].reserve(counts[i]);
+            }
+        }
+        for (size_t i = 0; i < assignment.size(); i++) {
+            segments[assignment[i]].push_back(training_samples[i]);
+            if (training_weights != NULL) {
+                segment_weights[assignment[i]].push_back((*training_weights)[i]);
             }
+        }
+        n->model->clean_training_outcome();
+        this->release(training);
 
-            KMeansNode* nnd = new KMeansNode{NULL, std::vector<KMeansNode*>(), 0, NULL};
-            this->fit_node(nnd, segment);
-            n->children.push_back(nnd);
+        // the children are fitted in parallel, their own loops share the threads
+        for (int32_t i = 0; i < k; i++) {
+            n->children.push_back(new KMeansNode);
         }
+        std::atomic<bool> failed(false);
+        this->parallel_for(k, [&](int64_t begin, int64_t end) {
+            for (int32_t i = begin; i < end; i++) {
+                if (EXK_FAIL == this->fit_node(n->children[i], segments[i], training_weights != NULL ? &segment_weights[i] : NULL,
+                                               mix_seed(seed, i), depth + 1,
+                                               warm != NULL && i < warm->children.size() ? warm->children[i] : NULL)) {
+                    failed = true;
+                }
+            }
+        }, PRIORITY_BUILD, 1);
+        this->release(segment_bytes);
+        ret = failed ? EXK_FAIL : EXK_SUC;
     } else {
         // Not implemented
+        this->release(training);
     }
     n->model->clean_training_outcome();
 
-    return EXK_SUC;
+    return ret;
+}
+
+// a node whose model failed to fit keeps its samples as an oversized leaf
+int32_t SparseKMeansTree::fail_node(KMeansNode* n) {
+    delete n->model;
+    n->model = NULL;
+    n->storage = this->_sample_payload->new_payload();
+    return EXK_FAIL;
+}
+
+void SparseKMeansTree::begin_fit() {
+    if (this->_parallel_fits == 0) {
+        return;
+    }
+
+    std::unique_lock<std::mutex> lock(this->_fit_lock);
+    this->_fit_done.wait(lock, [this]() {
+        return this->_fits < this->_parallel_fits;
+    });
+    this->_fits++;
+}
+
+void SparseKMeansTree::end_fit() {
+    if (this->_parallel_fits == 0) {
+        return;
+    }
+
+    std::lock_guard<std::mutex> lock(this->_fit_lock);
+    this->_fits--;
+    this->_fit_done.notify_one();
+}
+
+void SparseKMeansTree::hold(size_t bytes) {
+    size_t now = this->_build_bytes += bytes;
+    size_t peak = this->_build_peak.load();
+    while (peak < now && !this->_build_peak.compare_exchange_weak(peak, now)) {
+    }
+}
+
+int32_t SparseKMeansTree::fit_node_stream(KMeansNode* n, SampleStream& stream, const std::string& tag, uint64_t seed, size_t depth) {
+    if (this->_root->model == NULL) {
+        return EXK_FAIL;
+    }
+
+    // what the ancestors of the node still hold is not available to it
+    size_t held = this->_build_bytes.load();
+    size_t available = this->_memory_budget > held ? this->_memory_budget - held : 0;
+
+    // a node whose samples fit in the budget with the training of its subtree is built
+    // in memory: fit_slots() trainings at once, and per sample the block, the training
+    // and a segment pointer for each level, levels counted as if every split halved
+    std::vector<std::pair<int32_t, SPVEC>> block;
+    size_t trainings = this->fit_slots() * this->_root->model->training_bytes(0, stream.dim());
+    if (available > trainings) {
+        size_t most = (available - trainings) / SPVEC_BASE_BYTES;
+        size_t levels = 1;
+        for (size_t m = std::max(this->_max_node_size, 1); m < most; m *= 2) {
+            levels++;
+        }
+        size_t sample_bytes = FIT_SAMPLE_BYTES + (levels + 1) * sizeof(const SPVEC*);
+
+        stream.rewind();
+        stream.next_block(block, available - trainings, 0, sample_bytes);
+        size_t vectors = stream.block_bytes() - block.size() * sample_bytes;
+        this->hold(vectors + stream.line_bytes());
+        this->release(stream.line_bytes());
+        if (stream.exhausted()) {
+            size_t pointers = block.size() * sizeof(const SPVEC*);
+            this->hold(pointers);
+            std::vector<const SPVEC*> samples;
+            samples.reserve(block.size());
+            for (auto iter = block.begin(); iter != block.end(); iter++) {
+                samples.push_back(&iter->second);
+            }
+
+            int32_t ret = this->fit_node(n, samples, NULL, seed, depth);
+            this->release(pointers + vectors);
+            return ret;
+        }
+        this->release(vectors);
+        std::vector<std::pair<int32_t, SPVEC>>().swap(block);
+    }
+
+    // scanned once here, the partitions of the children are told their counts
+    size_t count = stream.count();
+    if (count <= this->_max_node_size) {
+        n->storage = this->_sample_payload->new_payload();
+        return EXK_END;
+    }
+
+    if (n->model == NULL) {
+        n->model = new SparseKMeansModel(*this->_root->model);
+    }
+    n->model->set_seed(seed);
+    n->model->set_k(n->model->node_k(count, this->_max_node_size, depth));
+
+    // fit_stream holds the centers, the assignment and its blocks within what it is given
+    uint64_t start = METRIC_NOW();
+    this->hold(available);
+    int32_t fitted = n->model->fit_stream(stream, available);
+    this->release(available);
+    if (EXK_FAIL == fitted) {
+        return this->fail_node(n);
+    }
+    METRIC_ADD(&this->_metrics, MC_NODES_FITTED, 1);
+    METRIC_RECORD(&this->_metrics, MH_NODE_FIT_NS, METRIC_NOW() - start);
+
+    // write the samples of every child into its own partition file, at most
+    // STREAM_OPEN_PARTS files open at once, fewer when their buffers and a block of
+    // one sample at least don't fit beside the assignment
+    int32_t k = n->model->get_k();
+    std::vector<std::string> names;
+    size_t names_bytes = k * (sizeof(std::string) + sizeof(size_t));
+    for (int32_t i = 0; i < k; i++) {
+        names.push_back(this->_work_dir + "/kmt" + tag + "_" + std::to_string(i) + ".part");
+        names_bytes += names.back().capacity();
+    }
+
+    const std::vector<int32_t>& assignment = n->model->get_assignment();
+    std::vector<size_t> counts(k, 0);
+    for (auto iter = assignment.begin(); iter != assignment.end(); iter++) {
+        counts[*iter]++;
+    }
+    size_t assignment_bytes = assignment.size() * sizeof(int32_t);
+    size_t line_bytes = SPVEC_BASE_BYTES + stream.dim() * SPVEC_NNZ_BYTES;
+    if (available <= names_bytes + assignment_bytes + STREAM_PART_BYTES + line_bytes) {
+        std::cerr << "Memory budget cannot hold the partition files" << std::endl;
+        n->model->clean_training_outcome();
+        return this->fail_node(n);
+    }
+    size_t room = available - names_bytes - assignment_bytes;
+    int32_t open = std::max((size_t)1, std::min((size_t)STREAM_OPEN_PARTS, (room - line_bytes) / STREAM_PART_BYTES));
+    size_t block_bytes = room - open * STREAM_PART_BYTES;
+
+    this->hold(names_bytes + assignment_bytes + open * STREAM_PART_BYTES);
+    for (int32_t first = 0; first < k; first += open) {
+        int32_t last = std::min(k, first + open);
+        std::vector<std::ofstream*> parts;
+        for (int32_t i = first; i < last; i++) {
+            parts.push_back(new std::ofstream(names[i]));
+        }
+
+        size_t offset = 0;
+        stream.rewind();
+        while (EXK_SUC == stream.next_block(block, block_bytes)) {
+            this->hold(stream.block_bytes() + stream.line_bytes());
+            this->release(stream.line_bytes());
+            for (int32_t i = 0; i < block.size(); i++) {
+                int32_t cid = assignment[offset + i];
+                if (cid >= first && cid < last) {
+                    *parts[cid - first] << block[i].first << "\t" << sp_vec_to_json(block[i].second) << "\n";
+                }
+            }
+            offset += block.size();
+            this->release(stream.block_bytes());
+        }
+        std::vector<std::pair<int32_t, SPVEC>>().swap(block);
+
+        for (auto iter = parts.begin(); iter != parts.end(); iter++) {
+            delete *iter;
+        }
+    }
+    n->model->clean_training_outcome();
+    this->release(assignment_bytes + open * STREAM_PART_BYTES);
+
+    int32_t ret = EXK_SUC;
+    for (int32_t i = 0; i < k; i++) {
+        KMeansNode* nnd = new KMeansNode;
+        SampleStream child(names[i], stream.dim(), NULL, true, this->_executor, this->_max_threads);
+        child.set_count(counts[i]);
+        if (EXK_FAIL == this->fit_node_stream(nnd, child, tag + "_" + std::to_string(i), mix_seed(seed, i), depth + 1)) {
+            ret = EXK_FAIL;
+        }
+        n->children.push_back(nnd);
+        std::remove(names[i].c_str());
+    }
+    this->release(names_bytes);
+
+    return ret;
 }
 
 void SparseKMeansTree::dispose_sub_tree(KMeansNode* n) {
@@ -79,18 +453,72 @@ void SparseKMeansTree::dispose_sub_tree(KMeansNode* n) {
         }
     } 
 
-    if (n->storage != NULL) {
-        this->_sample_payload->dispose(&n->storage);
+    LeafPayLoad* storage = n->storage;
+    if (storage != NULL) {
+        this->_sample_payload->dispose(&storage);
     }
 
     delete n->model;
 }
 
 const LeafPayLoad* SparseKMeansTree::search_for_leaf(const SPVEC& v) const {
-    auto path = this->search_for_path(v);
+    METRIC_PATH(&this->_metrics, true);
+    EpochManager::Guard guard = this->read_guard();
+    auto path = this->_search_for_path(v);
+    METRIC_ADD(&this->_metrics, MC_LEAF_SCANNED, (*path.rbegin())->count);
     return (*path.rbegin())->storage;
 }
 
+std::vector<const LeafPayLoad*> SparseKMeansTree::search_for_leaves(const SPVEC& v, int32_t beam) const {
+    METRIC_PATH(&this->_metrics, true);
+    EpochManager::Guard guard = this->read_guard();
+    int32_t level = 0;
+    std::vector<std::pair<KMeansNode*, TSVAL>> frontier(1, std::make_pair(this->_root, (TSVAL)0));
+    bool expanded = true;
+    while (expanded) {
+        expanded = false;
+        uint64_t start = METRIC_NOW();
+        METRIC_ADD(&this->_metrics, MC_NODES_VISITED, frontier.size());
+        std::vector<std::pair<KMeansNode*, TSVAL>> next;
+        for (auto iter = frontier.begin(); iter != frontier.end(); iter++) {
+            KMeansNode* n = iter->first;
+            if (this->is_leaf(n) || n->model == NULL) {
+                next.push_back(*iter);
+                continue;
+            }
+
+            expanded = true;
+            int32_t k = std::min(beam, (int32_t)n->children.size());
+            auto children = n->model->predict(v, k);
+            for (auto c = children.begin(); c != children.end(); c++) {
+                if (c->first >= 0 && c->first < n->children.size()) {
+                    next.push_back(std::make_pair(n->children[c->first], c->second));
+                }
+            }
+        }
+
+        std::stable_sort(next.begin(), next.end(), CompareByValue<KMeansNode*, TSVAL>());
+        if (next.size() > beam) {
+            next.resize(beam);
+        }
+        frontier.swap(next);
+        if (expanded) {
+            METRIC_RECORD_LEVEL(&this->_metrics, level++, METRIC_NOW() - start);
+        }
+    }
+
+    std::vector<const LeafPayLoad*> ret;
+    for (auto iter = frontier.begin(); iter != frontier.end(); iter++) {
+        const LeafPayLoad* storage = iter->first->storage;
+        if (storage != NULL) {
+            ret.push_back(storage);
+            METRIC_ADD(&this->_metrics, MC_LEAF_SCANNED, iter->first->count);
+        }
+    }
+
+    return ret;
+}
+
 int32_t SparseKMeansTree::_search_for_path(const SPVEC& v, KMeansNode* entry, std::vector<KMeansNode*>& res) const {
     if (entry == NULL) {
         //std::cerr << "Child node is NULL in the children list." << std::endl;
@@ -98,6 +526,7 @@ int32_t SparseKMeansTree::_search_for_path(const SPVEC& v, KMeansNode* entry, st
     }
     
     res.push_back(entry);
+    METRIC_ADD(&this->_metrics, MC_NODES_VISITED, 1);
     if (this->is_leaf(entry)) {
         return EXK_END;
     }
@@ -107,7 +536,9 @@ int32_t SparseKMeansTree::_search_for_path(const SPVEC& v, KMeansNode* entry, st
         return EXK_FAIL;
     }
 
+    uint64_t start = METRIC_NOW();
     int32_t cid = entry->model->predict(v);
+    METRIC_RECORD_LEVEL(&this->_metrics, res.size() - 1, METRIC_NOW() - start);
     if (cid == EXK_FAIL) {
         //std::cerr << "Modle prediction failed!" << std::endl;
         return EXK_FAIL;
@@ -126,6 +557,8 @@ std::vector<KMeansNode*> SparseKMeansTree::_search_for_path(const SPVEC& v) cons
 }
 
 std::vector<const KMeansNode*> SparseKMeansTree::search_for_path(const SPVEC& v) const {
+    METRIC_PATH(&this->_metrics, true);
+    EpochManager::Guard guard = this->read_guard();
     std::vector<const KMeansNode*> ret;
     std::vector<KMeansNode*> path = this->_search_for_path(v);
     for (auto iter = path.begin(); iter != path.end(); iter++) {
@@ -136,12 +569,72 @@ std::vector<const KMeansNode*> SparseKMeansTree::search_for_path(const SPVEC& v)
 }
 
 int32_t SparseKMeansTree::insert(int32_t id, const SPVEC& v, TSVAL weight) {
+    METRIC_PATH(&this->_metrics, false);
+    // a concurrent insert may retire the version this one copies
+    EpochManager::Guard guard = this->read_guard();
     auto path = this->_search_for_path(v);
     for (auto iter = path.begin(); iter != path.end(); iter++) {
         (*iter)->count += 1;
     }
 
-    (*path.rbegin())->storage->insert(id, weight, v);
+    std::atomic<LeafPayLoad*>& storage = (*path.rbegin())->storage;
+    LeafPayLoad* old = storage.load();
+    while (true) {
+        LeafPayLoad* copy = old->clone();
+        copy->insert(id, weight, v);
+        if (storage.compare_exchange_strong(old, copy)) {
+            break;
+        }
+        // another insert published first, old is its version now
+        delete copy;
+    }
+    this->_epochs.retire(old, dispose_payload);
+    return EXK_SUC;
+}
+
+int32_t SparseKMeansTree::insert_batch(const std::vector<int32_t>& ids, const std::vector<const SPVEC*>& vecs,
+                                       const std::vector<TSVAL>* weights) {
+    if (ids.size() != vecs.size() || (weights != NULL && weights->size() != ids.size())) {
+        return EXK_FAIL;
+    }
+
+    EpochManager::Guard guard = this->read_guard();
+    std::vector<KMeansNode*> leaves(ids.size());
+    this->parallel_for(ids.size(), [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+            METRIC_PATH(&this->_metrics, false);
+            auto path = this->_search_for_path(*vecs[i]);
+            for (auto iter = path.begin(); iter != path.end(); iter++) {
+                (*iter)->count += 1;
+            }
+            leaves[i] = *path.rbegin();
+        }
+    }, PRIORITY_INGEST);
+
+    std::unordered_map<KMeansNode*, std::vector<size_t>> groups;
+    for (size_t i = 0; i < leaves.size(); i++) {
+        groups[leaves[i]].push_back(i);
+    }
+    std::vector<std::pair<KMeansNode*, std::vector<size_t>>> members(groups.begin(), groups.end());
+
+    this->parallel_for(members.size(), [&](int64_t begin, int64_t end) {
+        for (int64_t j = begin; j < end; j++) {
+            std::atomic<LeafPayLoad*>& storage = members[j].first->storage;
+            LeafPayLoad* old = storage.load();
+            while (true) {
+                LeafPayLoad* copy = old->clone();
+                for (auto iter = members[j].second.begin(); iter != members[j].second.end(); iter++) {
+                    copy->insert(ids[*iter], weights != NULL ? (*weights)[*iter] : 1, *vecs[*iter]);
+                }
+                if (storage.compare_exchange_strong(old, copy)) {
+                    break;
+                }
+                delete copy;
+            }
+            this->_epochs.retire(old, dispose_payload);
+        }
+    }, PRIORITY_INGEST, 1);
+
     return EXK_SUC;
 }
 
@@ -151,6 +644,125 @@ SparseKMeansTree::~SparseKMeansTree() {
     }
 }
 
+TreeStats SparseKMeansTree::stats() const {
+    EpochManager::Guard guard = this->read_guard();
+    std::vector<std::pair<const KMeansNode*, int32_t>> nodes;
+    std::vector<std::pair<const KMeansNode*, int32_t>> stack(1, std::make_pair((const KMeansNode*)this->_root, 0));
+    while (!stack.empty()) {
+        auto top = stack.back();
+        stack.pop_back();
+        nodes.push_back(top);
+        for (auto iter = top.first->children.begin(); iter != top.first->children.end(); iter++) {
+            stack.push_back(std::make_pair((const KMeansNode*)*iter, top.second + 1));
+        }
+    }
+
+    std::atomic<size_t> center_bytes(0);
+    std::atomic<size_t> payload_bytes(0);
+    std::atomic<size_t> node_bytes(0);
+    std::atomic<size_t> degenerate(0);
+    this->parallel_for(nodes.size(), [&](int64_t begin, int64_t end) {
+        size_t centers = 0, payloads = 0, node = 0, degenerates = 0;
+        for (int32_t i = begin; i < end; i++) {
+            const KMeansNode* n = nodes[i].first;
+            node += sizeof(KMeansNode) + n->children.capacity() * sizeof(KMeansNode*);
+            if (n->model != NULL) {
+                node += sizeof(SparseKMeansModel);
+                centers += n->model->center_bytes();
+            }
+            const LeafPayLoad* storage = n->storage;
+            if (storage != NULL) {
+                payloads += storage->memory_bytes();
+            }
+
+            if (!this->is_leaf(n)) {
+                bool one_sided = n->children.size() < 2;
+                for (auto iter = n->children.begin(); iter != n->children.end(); iter++) {
+                    one_sided = one_sided || (n->count > 0 && (*iter)->count == n->count);
+                }
+                degenerates += one_sided;
+            }
+        }
+        center_bytes += centers;
+        payload_bytes += payloads;
+        node_bytes += node;
+        degenerate += degenerates;
+    }, PRIORITY_BUILD);
+
+    TreeStats ret;
+    ret.nodes = nodes.size();
+    ret.depth = 0;
+    ret.empty_leaves = 0;
+    ret.degenerate_nodes = degenerate;
+    ret.center_bytes = center_bytes;
+    ret.payload_bytes = payload_bytes;
+    ret.node_bytes = node_bytes;
+
+    std::vector<size_t> sizes;
+    std::vector<size_t> inner;
+    std::vector<size_t> children;
+    for (auto iter = nodes.begin(); iter != nodes.end(); iter++) {
+        int32_t d = iter->second;
+        ret.depth = std::max(ret.depth, d);
+        if (this->is_leaf(iter->first)) {
+            if (ret.depth_hist.size() <= d) {
+                ret.depth_hist.resize(d + 1, 0);
+            }
+            ret.depth_hist[d]++;
+            sizes.push_back(iter->first->count);
+            ret.empty_leaves += iter->first->count == 0;
+        } else {
+            if (inner.size() <= d) {
+                inner.resize(d + 1, 0);
+                children.resize(d + 1, 0);
+            }
+            inner[d]++;
+            children[d] += iter->first->children.size();
+        }
+    }
+
+    for (size_t d = 0; d < inner.size(); d++) {
+        ret.fan_out.push_back(inner[d] > 0 ? (double)children[d] / inner[d] : 0);
+    }
+
+    std::sort(sizes.begin(), sizes.end());
+    ret.leaves = sizes.size();
+    ret.leaf_min = sizes.front();
+    ret.leaf_median = sizes[sizes.size() / 2];
+    ret.leaf_p99 = sizes[std::min(sizes.size() - 1, sizes.size() * 99 / 100)];
+    ret.leaf_max = sizes.back();
+    size_t total = 0;
+    for (auto iter = sizes.begin(); iter != sizes.end(); iter++) {
+        total += *iter;
+    }
+    ret.leaf_mean = (double)total / sizes.size();
+    ret.imbalance = total > 0 ? ret.leaf_max / ret.leaf_mean : 0;
+
+    return ret;
+}
+
+std::string TreeStats::to_string() const {
+    nlohmann::json obj;
+    obj["nodes"] = this->nodes;
+    obj["leaves"] = this->leaves;
+    obj["depth"] = this->depth;
+    obj["depth_hist"] = this->depth_hist;
+    obj["fan_out"] = this->fan_out;
+    obj["leaf_size"] = {
+        {"min", this->leaf_min}, {"median", this->leaf_median}, {"p99", this->leaf_p99},
+        {"max", this->leaf_max}, {"mean", this->leaf_mean}
+    };
+    obj["imbalance"] = this->imbalance;
+    obj["empty_leaves"] = this->empty_leaves;
+    obj["degenerate_nodes"] = this->degenerate_nodes;
+    obj["bytes"] = {
+        {"centers", this->center_bytes}, {"payloads", this->payload_bytes}, {"nodes", this->node_bytes},
+        {"total", this->center_bytes + this->payload_bytes + this->node_bytes}
+    };
+
+    return obj.dump();
+}
+
 std::string SparseKMeansTree::node_to_string(KMeansNode* n) {
     if (n == NULL) {
         std::string empty;
@@ -159,7 +771,7 @@ std::string SparseKMeansTree::node_to_string(KMeansNode* n) {
 
     std::stringstream stream;
     std::string model_string = n->model != NULL ? n->model->to_string() : "NULL";
-    stream << "{\"model\":" << model_string << ", size: " << n->count << "}";
+    stream << "{\"model\":" << model_string << ", size: " << n->count.load() << "}";
     return stream.str();
 }
 
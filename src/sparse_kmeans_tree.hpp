@@ -1,17 +1,59 @@
 #ifndef SPARSE_KMEANS_TREE_HPP
 #define SPARSE_KMEANS_TREE_HPP
 #include <vector>
+#include <atomic>
+#include <condition_variable>
+#include <cstdio>
+#include <fstream>
+#include <mutex>
 #include "sparse_kmeans.hpp"
 #include "payload.hpp"
+#include "sample_stream.hpp"
+#include "metrics.hpp"
+#include "epoch.hpp"
 
+// partition files written at once by the out-of-core build, nodes of more children
+// take one pass over their samples per batch, fewer when their buffers don't fit
+#define STREAM_OPEN_PARTS 64
+#define STREAM_PART_BYTES (sizeof(std::ofstream) + BUFSIZ)
+
+// Inner nodes are immutable once built. The storage of a leaf is replaced as a whole on
+// every insert, searches load it once and read a consistent version.
 struct KMeansNode {
     // Payload
-    LeafPayLoad* storage;
+    std::atomic<LeafPayLoad*> storage;
     std::vector<KMeansNode*> children;
-    int32_t count;
+    std::atomic<int32_t> count;
 
     // Model
     SparseKMeansModel* model;
+
+    KMeansNode(): storage(NULL), count(0), model(NULL) {}
+};
+
+// Shape and memory footprint of a tree, leaf sizes count the inserted members
+struct TreeStats {
+    size_t nodes;
+    size_t leaves;
+    int32_t depth;
+    std::vector<size_t> depth_hist;   // leaves per depth
+    std::vector<double> fan_out;      // mean children of the inner nodes per depth
+
+    size_t leaf_min;
+    size_t leaf_median;
+    size_t leaf_p99;
+    size_t leaf_max;
+    double leaf_mean;
+    double imbalance;                 // largest leaf over the mean leaf
+
+    size_t empty_leaves;              // leaves without members
+    size_t degenerate_nodes;          // inner nodes with one child, or one child holding all the members
+
+    size_t center_bytes;
+    size_t payload_bytes;
+    size_t node_bytes;                // nodes, children lists and model objects
+
+    std::string to_string() const;
 };
 
 class SparseKMeansTree {
@@ -20,8 +62,39 @@ private:
     int32_t _max_node_size;
     DENSE_SPARSE_DIST_FUNC(_func);
     
-    int32_t fit(const std::vector<const SPVEC*>& training_samples);
-    int32_t fit_node(KMeansNode* n, const std::vector<const SPVEC*>& training_samples);
+    int32_t fit(const std::vector<const SPVEC*>& training_samples, const std::vector<TSVAL>* training_weights = NULL,
+                const KMeansNode* warm = NULL);
+    // seed is the model seed of the node, derived from the root seed and the node path,
+    // warm the node of a previous tree at the same path, whose centers it starts from
+    int32_t fit_node(KMeansNode* n, const std::vector<const SPVEC*>& training_samples, const std::vector<TSVAL>* training_weights,
+                     uint64_t seed, size_t depth, const KMeansNode* warm = NULL);
+
+    // out-of-core building, nodes which don't fit in the budget are partitioned on disk
+    std::string _work_dir;
+    size_t _memory_budget;
+    int32_t fit_node_stream(KMeansNode* n, SampleStream& stream, const std::string& tag, uint64_t seed, size_t depth);
+    int32_t fail_node(KMeansNode* n);
+    // bytes the build holds at once, by the same accounting its memory budget is
+    // checked with: blocks and their raw lines, node trainings, segments and partition
+    // buffers. The models of the built nodes are the output and not counted
+    std::atomic<size_t> _build_bytes;
+    std::atomic<size_t> _build_peak;
+    void hold(size_t bytes);
+    void release(size_t bytes) {
+        this->_build_bytes -= bytes;
+    }
+    // node models trained at once, one per thread of the executor unless the root
+    // model caps them with set_parallel_fits, node fits wait for a slot
+    size_t _parallel_fits;
+    size_t _fits;
+    std::mutex _fit_lock;
+    std::condition_variable _fit_done;
+    size_t fit_slots() const {
+        size_t threads = this->_executor->threads();
+        return this->_parallel_fits > 0 ? std::min(threads, this->_parallel_fits) : threads;
+    }
+    void begin_fit();
+    void end_fit();
     bool is_leaf(const KMeansNode* n) const {
         return n->children.size() == 0;
     };
@@ -30,6 +103,16 @@ private:
     int32_t _search_for_path(const SPVEC& v, KMeansNode* entry, std::vector<KMeansNode*>& res) const;
 
     LeafPayLoad* _sample_payload;
+    // shared with the models of every node, recorded from const searches too
+    mutable Metrics _metrics;
+    // leaf versions replaced by inserts, freed once no search can hold them
+    EpochManager _epochs;
+    // executor and thread cap of the root model, run the loops of the tree too
+    Executor* _executor;
+    size_t _max_threads;
+    void parallel_for(int64_t n, const RANGE_FUNC& body, int32_t priority, int64_t grain = 0) const {
+        this->_executor->parallel_for(n, body, priority, this->_max_threads, grain);
+    }
     void dispose_sub_tree(KMeansNode* n);
 
     std::string node_to_string(KMeansNode* n);
@@ -47,10 +130,76 @@ public:
                      float cut_rate = 2
                      );
 
+    // every node is fitted with a copy of the prototype model and its options, the
+    // training weights, one per sample when given, go down the tree with the samples
+    SparseKMeansTree(LeafPayLoad* sample_payload,
+                     const std::vector<const SPVEC*>& training_samples,
+                     const SparseKMeansModel& prototype,
+                     int32_t max_node_size = 1000,
+                     const std::vector<TSVAL>* training_weights = NULL
+                     );
+
+    // Refresh build, every node starts its iterations from the centers of the node at
+    // the same path in previous instead of seeding, nodes previous lacks are seeded
+    SparseKMeansTree(LeafPayLoad* sample_payload,
+                     const std::vector<const SPVEC*>& training_samples,
+                     const SparseKMeansModel& prototype,
+                     const SparseKMeansTree& previous,
+                     int32_t max_node_size = 1000,
+                     const std::vector<TSVAL>* training_weights = NULL
+                     );
+
+    SparseKMeansTree(LeafPayLoad* sample_payload,
+                     SampleStream& training_stream,
+                     const std::string& work_dir,
+                     size_t memory_budget,
+                     int32_t max_node_size = 1000,
+                     int32_t k = 100,
+                     int32_t iterations = 1000,
+                     const char* initiator="kmeans++",
+                     DENSE_SPARSE_DIST_FUNC(func) = inversed_dense_sparse_dot,
+                     float cut_rate = 2
+                     );
+
+    // Searches never lock and may run concurrently with inserts. The leaves they return
+    // stay valid while the caller holds a read guard taken before the search.
+    EpochManager::Guard read_guard() const {
+        return this->_epochs.enter();
+    }
+
+    // The leaves returned are only pinned for the duration of the call. With inserts
+    // running concurrently, the caller holds read_guard() from before the call until it
+    // is done with them, or they may be freed under it.
     const LeafPayLoad* search_for_leaf(const SPVEC& v) const;
+    // beam search keeping the beam closest nodes of every level, leaves are returned
+    // closest first, pinned like search_for_leaf
+    std::vector<const LeafPayLoad*> search_for_leaves(const SPVEC& v, int32_t beam) const;
+    // nodes are never freed before the tree, their storage is pinned like search_for_leaf
     std::vector<const KMeansNode*> search_for_path(const SPVEC& v) const;
+    // copies the leaf, inserts into the copy and publishes it, concurrent inserts into
+    // one leaf retry on the newer version. Each call copies the whole leaf, bulk ingest
+    // goes through insert_batch
     int32_t insert(int32_t id, const SPVEC& v, TSVAL weight);
+    // bulk ingest, routes the vectors in parallel and publishes one version per leaf for
+    // all its members, in batch order, weights 1 unless given
+    int32_t insert_batch(const std::vector<int32_t>& ids, const std::vector<const SPVEC*>& vecs,
+                         const std::vector<TSVAL>* weights = NULL);
     std::string to_string();
+    // computed in one parallel pass over the nodes
+    TreeStats stats() const;
+    // most bytes the build held at once, within the memory budget of an out-of-core build
+    size_t build_peak_bytes() const {
+        return this->_build_peak.load();
+    }
+
+    // searches, inserts and building so far, all zero unless built with KMT_METRICS
+    MetricsSnapshot get_metrics() const {
+        return this->_metrics.snapshot();
+    }
+
+    void reset_metrics() {
+        this->_metrics.reset();
+    }
 
     ~SparseKMeansTree();
 };
@@ -1,9 +1,21 @@
 #include "vector_base.hpp"
+#include "random.hpp"
+#include "executor.hpp"
 #include <iostream>
 #include <fstream>
+#include <cstring>
+#include <algorithm>
+#include <unordered_map>
+
+// lines parsed in parallel at once by the loader
+#define VB_PARSE_BLOCK 4096
 
 const SPVEC& VectorBase::at(int32_t id) const {
-    return this->_storage.at(id);
+    auto iter = this->_storage.find(id);
+    if (iter == this->_storage.end()) {
+        return this->_storage.at(this->_representatives.at(id));
+    }
+    return iter->second;
 }
 
 void VectorBase::insert(int32_t id, const SPVEC& v) {
@@ -17,7 +29,7 @@ size_t VectorBase::size() const {
 std::vector<SPVEC> VectorBase::export_vectors(const std::vector<int32_t>& ids) const {
     std::vector<SPVEC> ret;
     for (auto iter = ids.begin(); iter != ids.end(); iter++) {
-        ret.push_back(this->_storage.at(*iter));
+        ret.push_back(this->at(*iter));
     }
 
     return ret;
@@ -26,7 +38,7 @@ std::vector<SPVEC> VectorBase::export_vectors(const std::vector<int32_t>& ids) c
 std::vector<const SPVEC*> VectorBase::get_vectors(const std::vector<int32_t>& ids) const {
     std::vector<const SPVEC*> ret;
     for (auto iter = ids.begin(); iter != ids.end(); iter++) {
-        auto vptr = &this->_storage.at(*iter);
+        auto vptr = &this->at(*iter);
         ret.push_back(vptr);
     }
 
@@ -37,11 +49,165 @@ const std::map<int32_t, SPVEC> VectorBase::get_map() const {
     return this->_storage;
 }
 
-VectorBase::VectorBase() {
+static bool same_vector(const SPVEC& a, const SPVEC& b) {
+    if (a.size() != b.size() || a.nnz() != b.nnz()) {
+        return false;
+    }
+    for (auto ia = a.begin(), ib = b.begin(); ia != a.end(); ia++, ib++) {
+        if (ia.index() != ib.index() || *ia != *ib) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static uint64_t exact_hash(const SPVEC& v) {
+    uint64_t h = v.size();
+    for (auto iter = v.begin(); iter != v.end(); iter++) {
+        float w = *iter;
+        uint32_t bits;
+        memcpy(&bits, &w, sizeof(bits));
+        h = mix_seed(h, ((uint64_t)iter.index() << 32) | bits);
+    }
+    return h;
+}
+
+// Charikar's SimHash, every nonzero votes its weight on the bits of its index hash
+uint64_t VectorBase::simhash(const SPVEC& v) {
+    double votes[64] = {0};
+    for (auto iter = v.begin(); iter != v.end(); iter++) {
+        uint64_t h = mix_seed(0, iter.index());
+        for (int32_t b = 0; b < 64; b++) {
+            votes[b] += (h >> b) & 1 ? *iter : -*iter;
+        }
+    }
+
+    uint64_t ret = 0;
+    for (int32_t b = 0; b < 64; b++) {
+        if (votes[b] > 0) {
+            ret |= 1ull << b;
+        }
+    }
+    return ret;
+}
+
+size_t VectorBase::dedup(int32_t mode, int32_t max_hamming) {
+    std::vector<int32_t> ids;
+    for (auto iter = this->_storage.begin(); iter != this->_storage.end(); iter++) {
+        ids.push_back(iter->first);
+    }
+
+    std::vector<uint64_t> hashes(ids.size());
+    Executor& pool = this->_executor != NULL ? *this->_executor : Executor::shared();
+    pool.parallel_for(ids.size(), [&](int64_t begin, int64_t end) {
+        for (int32_t i = begin; i < end; i++) {
+            const SPVEC& v = this->_storage.at(ids[i]);
+            hashes[i] = mode == DEDUP_SIMHASH ? simhash(v) : exact_hash(v);
+        }
+    }, PRIORITY_BUILD, this->_max_threads);
+
+    // near duplicates within max_hamming bits agree on at least one of max_hamming + 1
+    // bands of the signature, which are the buckets of the candidate representatives
+    max_hamming = std::max(0, std::min(max_hamming, 15));
+    int32_t bands = mode == DEDUP_SIMHASH ? max_hamming + 1 : 1;
+    int32_t band_bits = 64 / bands;
+    std::vector<std::unordered_map<uint64_t, std::vector<int32_t>>> buckets(bands);
+
+    // representatives are the first of their group by id
+    std::vector<int32_t> merged(ids.size(), -1);
+    size_t ret = 0;
+    for (int32_t i = 0; i < ids.size(); i++) {
+        uint64_t keys[16];
+        for (int32_t b = 0; b < bands; b++) {
+            keys[b] = bands == 1 ? hashes[i] : ((hashes[i] >> (b * band_bits)) & ((1ull << band_bits) - 1));
+            auto bucket = buckets[b].find(keys[b]);
+            if (bucket == buckets[b].end()) {
+                continue;
+            }
+
+            for (auto r = bucket->second.begin(); r != bucket->second.end() && merged[i] < 0; r++) {
+                bool dup = mode == DEDUP_SIMHASH ?
+                    __builtin_popcountll(hashes[i] ^ hashes[*r]) <= max_hamming :
+                    hashes[i] == hashes[*r] && same_vector(this->_storage.at(ids[i]), this->_storage.at(ids[*r]));
+                if (dup) {
+                    merged[i] = *r;
+                }
+            }
+            if (merged[i] >= 0) {
+                break;
+            }
+        }
+
+        if (merged[i] < 0) {
+            for (int32_t b = 0; b < bands; b++) {
+                buckets[b][keys[b]].push_back(i);
+            }
+        } else {
+            // a representative of an earlier dedup hands its duplicates over
+            int32_t rep = ids[merged[i]];
+            std::vector<int32_t>& group = this->_duplicates[rep];
+            group.push_back(ids[i]);
+            this->_representatives[ids[i]] = rep;
+            auto own = this->_duplicates.find(ids[i]);
+            if (own != this->_duplicates.end()) {
+                for (auto iter = own->second.begin(); iter != own->second.end(); iter++) {
+                    this->_representatives[*iter] = rep;
+                }
+                group.insert(group.end(), own->second.begin(), own->second.end());
+                this->_duplicates.erase(own);
+            }
+            ret++;
+        }
+    }
+
+    for (int32_t i = 0; i < ids.size(); i++) {
+        if (merged[i] >= 0) {
+            this->_storage.erase(ids[i]);
+        }
+    }
+    for (auto iter = this->_duplicates.begin(); iter != this->_duplicates.end(); iter++) {
+        std::sort(iter->second.begin(), iter->second.end());
+    }
+
+    return ret;
+}
+
+int32_t VectorBase::representative(int32_t id) const {
+    auto iter = this->_representatives.find(id);
+    return iter == this->_representatives.end() ? id : iter->second;
+}
+
+size_t VectorBase::multiplicity(int32_t id) const {
+    auto iter = this->_duplicates.find(id);
+    return iter == this->_duplicates.end() ? 1 : 1 + iter->second.size();
+}
+
+std::vector<TSVAL> VectorBase::multiplicities(const std::vector<int32_t>& ids) const {
+    std::vector<TSVAL> ret;
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        ret.push_back(this->multiplicity(*iter));
+    }
+    return ret;
+}
+
+const std::vector<int32_t>& VectorBase::duplicates(int32_t id) const {
+    static const std::vector<int32_t> none;
+    auto iter = this->_duplicates.find(id);
+    return iter == this->_duplicates.end() ? none : iter->second;
+}
 
+void VectorBase::set_executor(Executor* executor, size_t max_threads) {
+    this->_executor = executor;
+    this->_max_threads = max_threads;
 }
 
-VectorBase::VectorBase(std::string filename, int32_t dim, STR_HASH_FUNC(f), bool self_inc_id) {
+VectorBase::VectorBase(): _executor(NULL), _max_threads(0) {
+
+}
+
+VectorBase::VectorBase(std::string filename, int32_t dim, STR_HASH_FUNC(f), bool self_inc_id,
+                       Executor* executor, size_t max_threads): _executor(executor), _max_threads(max_threads) {
+    Executor& pool = executor != NULL ? *executor : Executor::shared();
     std::ifstream stream;
     stream.open(filename);
     if (!stream.is_open()) {
@@ -49,50 +215,48 @@ VectorBase::VectorBase(std::string filename, int32_t dim, STR_HASH_FUNC(f), bool
         return;
     }
 
+    // lines are read in blocks and every block is parsed in parallel, then inserted in
+    // file order
     int32_t inc = 0;
     bool sstop = false;
-    #pragma omp parallel
-    while (!sstop)  {
-        int32_t id;
-        std::string json_content;
-        std::string buf;
-
-        #pragma omp critical
-        {
-            if (self_inc_id) {        
+    std::vector<int32_t> ids;
+    std::vector<std::string> lines;
+    std::vector<SPVEC> vecs;
+    while (!sstop) {
+        ids.clear();
+        lines.clear();
+        while (!sstop && lines.size() < VB_PARSE_BLOCK) {
+            int32_t id;
+            std::string buf;
+            if (self_inc_id) {
                 std::getline(stream, buf, '\t');
                 if (buf.size() == 0) {
                     sstop = true;
-                } else {
-                    id = std::stol(buf);
+                    break;
                 }
+                id = std::stol(buf);
             } else {
                 id = inc;
                 inc++;
             }
-      
+
             std::getline(stream, buf, '\n');
-            json_content = buf;
             if (buf.size() == 0) {
                 sstop = true;
+                break;
             }
+            ids.push_back(id);
+            lines.push_back(buf);
         }
 
-        if (!sstop) {
-            SPVEC vec;
-            if (f == NULL) {
-                //std::cerr << "here" << std::endl;
-                vec = sp_vec_from_string(json_content, dim);
-            } else {
-                //std::cerr << "there" << std::endl;
-                vec = sp_vec_from_string(json_content, dim, f);
-            }
-
-            //std::cerr.flush();
-            #pragma omp critical
-            {
-                this->insert(id, vec);
+        vecs.resize(lines.size());
+        pool.parallel_for(lines.size(), [&](int64_t begin, int64_t end) {
+            for (int32_t i = begin; i < end; i++) {
+                vecs[i] = f == NULL ? sp_vec_from_string(lines[i], dim) : sp_vec_from_string(lines[i], dim, f);
             }
+        }, PRIORITY_INGEST, max_threads);
+        for (size_t i = 0; i < lines.size(); i++) {
+            this->insert(ids[i], vecs[i]);
         }
     }
 
@@ -4,8 +4,14 @@
 #include "sparse.hpp"
 #include <map>
 
+class Executor;
+
+#define DEDUP_EXACT 0
+#define DEDUP_SIMHASH 1
+
 class VectorBase {
 public:
+    // ids merged by dedup resolve to their representative
     const SPVEC& at(int32_t id) const;
     void insert(int32_t id, const SPVEC& v);
     size_t size() const;
@@ -13,11 +19,37 @@ public:
     std::vector<const SPVEC*> get_vectors(const std::vector<int32_t>& ids) const;
     const std::map<int32_t, SPVEC> get_map() const;
 
+    // Merges every vector into the first one, by id, it duplicates, exactly with
+    // DEDUP_EXACT, or with DEDUP_SIMHASH when their 64 bit SimHash signatures differ in
+    // at most max_hamming bits (up to 15). Only the representatives stay in the base,
+    // with the number of vectors they stand for. Returns the number of merged vectors.
+    size_t dedup(int32_t mode = DEDUP_EXACT, int32_t max_hamming = 3);
+    // the id itself when it was not merged
+    int32_t representative(int32_t id) const;
+    // 1 plus the vectors merged into id
+    size_t multiplicity(int32_t id) const;
+    // weights of the training samples ids, their multiplicities
+    std::vector<TSVAL> multiplicities(const std::vector<int32_t>& ids) const;
+    // merged into id, in id order
+    const std::vector<int32_t>& duplicates(int32_t id) const;
+
+    static uint64_t simhash(const SPVEC& v);
+
+    // parallel loops of the loader and of dedup, the shared executor when NULL, with at
+    // most max_threads threads
+    void set_executor(Executor* executor, size_t max_threads = 0);
+
     VectorBase();
-    VectorBase(std::string filename, int32_t dim, STR_HASH_FUNC(f) = NULL, bool self_inc_id = false);
+    VectorBase(std::string filename, int32_t dim, STR_HASH_FUNC(f) = NULL, bool self_inc_id = false,
+               Executor* executor = NULL, size_t max_threads = 0);
 
 private:
+    Executor* _executor;
+    size_t _max_threads;
     std::map<int32_t, SPVEC> _storage;
+    // merged id to its representative, representative to the ids merged into it
+    std::map<int32_t, int32_t> _representatives;
+    std::map<int32_t, std::vector<int32_t>> _duplicates;
 };
 
 
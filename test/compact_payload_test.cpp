@@ -0,0 +1,69 @@
+#include "doctest.h"
+#include "vector_base.hpp"
+#include "sparse_kmeans_tree.hpp"
+#include "compact_payload.hpp"
+#include <iostream>
+
+int32_t parse_xy_5(std::string v) {
+    if (v == "x") {
+        return 0;
+    } else if (v == "y") {
+        return 1;
+    }
+
+    return -1;
+}
+
+TEST_CASE("[CompactPayLoad] members are kept sorted with their weights") {
+    VectorBase base("../data/kmeans.jsonl", 2, parse_xy_5, true);
+    int32_t ids[] = {7, 300, 2, 19, 130, 2, 0};
+
+    for (int32_t c = 0; c < 2; c++) {
+        CompactPayLoad payload(&base, 10, c == 1);
+        for (int32_t i = 0; i < 7; i++) {
+            payload.insert(ids[i], (TSVAL)ids[i] + i, base.at(0));
+        }
+        REQUIRE(payload.size() == 6);
+
+        int32_t expected[] = {0, 2, 7, 19, 130, 300};
+        TSVAL weights[] = {6, 7, 7, 22, 134, 301};
+        CompactPayLoad::Cursor cur = payload.cursor();
+        int32_t id;
+        TSVAL weight;
+        for (int32_t i = 0; i < 6; i++) {
+            REQUIRE(cur.next(id, weight));
+            REQUIRE(id == expected[i]);
+            REQUIRE(weight == weights[i]);
+        }
+        REQUIRE(!cur.next(id, weight));
+
+        if (!payload.is_compressed()) {
+            ConstSpan<int32_t> span = payload.get_ids();
+            REQUIRE(std::equal(span.begin(), span.end(), expected));
+        }
+    }
+}
+
+TEST_CASE("A simple K Means Tree with compact payloads") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_5, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    CompactPayLoad sbrk(&base, 10, true);
+    SparseKMeansTree kmst(&sbrk, vecs, 10, 2, 100, true, "kmeans++", dense_sparse_l2_distance);
+
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        kmst.insert(*iter, base.at(*iter), 1.0);
+    }
+
+    std::vector<const SPVEC*> rows;
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        const LeafPayLoad* leaf = kmst.search_for_leaf(base.at(*iter));
+        leaf->get_all_vector_ptrs(rows);
+        REQUIRE(std::find(rows.begin(), rows.end(), &base.at(*iter)) != rows.end());
+    }
+}
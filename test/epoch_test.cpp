@@ -0,0 +1,148 @@
+#include "doctest.h"
+#include "epoch.hpp"
+#include "vector_base.hpp"
+#include "sparse_kmeans_tree.hpp"
+#include "quantized_payload.hpp"
+#include <algorithm>
+#include <cstddef>
+#include <omp.h>
+
+int32_t parse_xy_9(std::string v) {
+    if (v == "x") {
+        return 0;
+    } else if (v == "y") {
+        return 1;
+    }
+
+    return -1;
+}
+
+static void count_free(void* p) {
+    (*static_cast<int32_t*>(p))++;
+}
+
+TEST_CASE("[EpochManager] retired objects outlive the readers") {
+    EpochManager epochs;
+    int32_t freed = 0;
+    {
+        EpochManager::Guard guard = epochs.enter();
+        epochs.retire(&freed, count_free);
+        for (int32_t i = 0; i < 4; i++) {
+            REQUIRE(!epochs.collect());
+        }
+        REQUIRE(freed == 0);
+        REQUIRE(epochs.pending() == 1);
+    }
+
+    // one collect moves past the epoch of the reader, the next one frees
+    epochs.collect();
+    REQUIRE(epochs.collect());
+    REQUIRE(freed == 1);
+    REQUIRE(epochs.pending() == 0);
+
+    // a reader entering after the retirement doesn't hold it back
+    epochs.retire(&freed, count_free);
+    EpochManager::Guard late = epochs.enter();
+    epochs.collect();
+    REQUIRE(freed == 1);
+}
+
+TEST_CASE("[EpochManager] trees keep the default alignment") {
+    // forests allocate their trees with plain new
+    REQUIRE(alignof(EpochManager) <= alignof(std::max_align_t));
+    REQUIRE(alignof(SparseKMeansTree) <= alignof(std::max_align_t));
+}
+
+TEST_CASE("[EpochManager] searches run while inserting into a K Means Tree") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_9, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+    QuantizedPayLoad sbrk(&base, 10);
+    SparseKMeansTree kmst(&sbrk, vecs, 10, 2, 100, true, "kmeans++", dense_sparse_l2_distance);
+
+    // every vector is inserted 50 times under as many ids by the writers while the
+    // readers scan the leaves, no insert into a leaf is lost to a concurrent one
+    int32_t rounds = 50;
+    int32_t threads = std::max(omp_get_max_threads(), 4);
+    std::atomic<int32_t> writers(threads / 2);
+    std::atomic<int64_t> bad(0);
+    #pragma omp parallel num_threads(threads)
+    {
+        int32_t t = omp_get_thread_num();
+        if (t < threads / 2) {
+            for (int32_t r = t; r < rounds; r += threads / 2) {
+                for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+                    kmst.insert(*iter + 60 * r, base.at(*iter), 1.0);
+                }
+            }
+            writers--;
+        } else {
+            std::vector<int32_t> members;
+            while (writers.load() > 0) {
+                for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+                    EpochManager::Guard guard = kmst.read_guard();
+                    auto leaves = kmst.search_for_leaves(base.at(*iter), 2);
+                    for (auto leaf = leaves.begin(); leaf != leaves.end(); leaf++) {
+                        (*leaf)->get_all_ids(members);
+                        for (auto m = members.begin(); m != members.end(); m++) {
+                            bad += *m < 0 || *m >= 60 * rounds;
+                        }
+                    }
+                }
+            }
+        }
+    }
+
+    REQUIRE(bad.load() == 0);
+    REQUIRE(kmst.search_for_path(base.at(0)).front()->count.load() == 60 * rounds);
+    std::vector<int32_t> members;
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        kmst.search_for_leaf(base.at(*iter))->get_all_ids(members);
+        for (int32_t r = 0; r < rounds; r++) {
+            REQUIRE(std::count(members.begin(), members.end(), *iter + 60 * r) == 1);
+        }
+    }
+}
+
+TEST_CASE("[EpochManager] batch inserts publish one version per leaf") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_9, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+    QuantizedPayLoad sbrk(&base, 10);
+    SparseKMeansTree one(&sbrk, vecs, 10, 2, 100, true, "kmeans++", dense_sparse_l2_distance);
+    SparseKMeansTree batch(&sbrk, vecs, 10, 2, 100, true, "kmeans++", dense_sparse_l2_distance);
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        one.insert(*iter, base.at(*iter), 1.0);
+    }
+    std::vector<TSVAL> weights(ids.size(), 1.0);
+    std::vector<int32_t> shifted;
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        shifted.push_back(*iter + 60);
+    }
+    REQUIRE(batch.insert_batch(ids, vecs, &weights) == EXK_SUC);
+    REQUIRE(batch.insert_batch(shifted, vecs, NULL) == EXK_SUC);
+    REQUIRE(batch.insert_batch(ids, std::vector<const SPVEC*>(), NULL) == EXK_FAIL);
+
+    // the same members in the same leaves, in insertion order, then again under the
+    // ids of the second batch
+    std::vector<int32_t> expected;
+    std::vector<int32_t> members;
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        one.search_for_leaf(base.at(*iter))->get_all_ids(expected);
+        batch.search_for_leaf(base.at(*iter))->get_all_ids(members);
+        REQUIRE(members.size() == 2 * expected.size());
+        REQUIRE(std::equal(expected.begin(), expected.end(), members.begin()));
+        for (size_t j = 0; j < expected.size(); j++) {
+            REQUIRE(members[expected.size() + j] == expected[j] + 60);
+        }
+    }
+    REQUIRE(batch.search_for_path(base.at(0)).front()->count.load() == 120);
+}
@@ -0,0 +1,164 @@
+#include "doctest.h"
+#include "executor.hpp"
+#include "vector_base.hpp"
+#include "sparse_kmeans_tree.hpp"
+#include "map_payload.hpp"
+#include <stdexcept>
+#include <thread>
+
+int32_t parse_xy_10(std::string v) {
+    if (v == "x") {
+        return 0;
+    } else if (v == "y") {
+        return 1;
+    }
+
+    return -1;
+}
+
+TEST_CASE("[Executor] parallel loops cover every index once") {
+    Executor executor(4);
+    REQUIRE(executor.threads() == 4);
+
+    int64_t sizes[] = {0, 1, 7, 1000};
+    int64_t grains[] = {0, 1, 3, 5000};
+    size_t limits[] = {0, 1, 2, 16};
+    for (int64_t n : sizes) {
+        for (int64_t grain : grains) {
+            for (size_t limit : limits) {
+                std::vector<std::atomic<int32_t>> hits(n);
+                for (int64_t i = 0; i < n; i++) {
+                    hits[i] = 0;
+                }
+                executor.parallel_for(n, [&](int64_t begin, int64_t end) {
+                    for (int64_t i = begin; i < end; i++) {
+                        hits[i]++;
+                    }
+                }, PRIORITY_BUILD, limit, grain);
+                for (int64_t i = 0; i < n; i++) {
+                    REQUIRE(hits[i].load() == 1);
+                }
+            }
+        }
+    }
+}
+
+TEST_CASE("[Executor] nested loops share the threads under the cap") {
+    Executor executor(8);
+    std::atomic<int32_t> running(0);
+    std::atomic<int32_t> most(0);
+    std::atomic<int64_t> total(0);
+
+    // two outer threads with two threads each for their inner loops, out of eight
+    executor.parallel_for(8, [&](int64_t begin, int64_t end) {
+        for (int64_t i = begin; i < end; i++) {
+            executor.parallel_for(100, [&](int64_t b, int64_t e) {
+                int32_t now = ++running;
+                int32_t seen = most.load();
+                while (seen < now && !most.compare_exchange_weak(seen, now)) {
+                }
+                total += e - b;
+                running--;
+            }, PRIORITY_QUERY, 2, 10);
+        }
+    }, PRIORITY_BUILD, 2, 1);
+
+    REQUIRE(total.load() == 800);
+    REQUIRE(most.load() <= 4);
+    REQUIRE(running.load() == 0);
+}
+
+TEST_CASE("[Executor] exceptions of the chunks reach the caller") {
+    Executor executor(4);
+    std::atomic<int64_t> done(0);
+
+    // every chunk past the first ones throws, on the caller and on the workers
+    for (int32_t r = 0; r < 20; r++) {
+        REQUIRE_THROWS_AS(executor.parallel_for(1000, [&](int64_t begin, int64_t end) {
+            if (begin >= 10) {
+                throw std::runtime_error("bad chunk");
+            }
+            done += end - begin;
+        }, PRIORITY_BUILD, 0, 1), std::runtime_error);
+    }
+
+    // the pool keeps running loops afterwards
+    done = 0;
+    executor.parallel_for(1000, [&](int64_t begin, int64_t end) {
+        done += end - begin;
+    }, PRIORITY_BUILD, 0, 1);
+    REQUIRE(done.load() == 1000);
+}
+
+static void wait_for(const std::atomic<int32_t>& value, int32_t at_least) {
+    while (value.load() < at_least) {
+        std::this_thread::yield();
+    }
+}
+
+TEST_CASE("[Executor] idle workers join queries before builds") {
+    Executor executor(2);
+    std::atomic<int32_t> entered(0);
+    std::atomic<int32_t> busy(0);
+    std::atomic<int32_t> queued(0);
+    std::atomic<int32_t> first(-1);
+
+    // the caller and the only worker hold the two chunks of the first loop
+    std::thread hold([&]() {
+        executor.parallel_for(2, [&](int64_t begin, int64_t end) {
+            entered++;
+            wait_for(busy, 1);
+        }, PRIORITY_INGEST, 0, 1);
+    });
+    wait_for(entered, 2);
+
+    // a build and a query loop wait in the queues, their callers stuck in chunk 0
+    auto loop = [&](int32_t priority) {
+        executor.parallel_for(16, [&, priority](int64_t begin, int64_t end) {
+            if (begin == 0) {
+                queued++;
+                wait_for(queued, 3);
+            } else {
+                int32_t none = -1;
+                first.compare_exchange_strong(none, priority);
+            }
+        }, priority, 0, 1);
+    };
+    std::thread build(loop, PRIORITY_BUILD);
+    std::thread query(loop, PRIORITY_QUERY);
+    wait_for(queued, 2);
+
+    // the worker freed by the first loop picks the query
+    busy = 1;
+    while (first.load() == -1) {
+        std::this_thread::yield();
+    }
+    queued++;
+    hold.join();
+    build.join();
+    query.join();
+    REQUIRE(first.load() == PRIORITY_QUERY);
+}
+
+TEST_CASE("[Executor] trees fit the same on any number of threads") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_10, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    Executor serial(1);
+    Executor pool(4);
+    SparseKMeansModel model(2, 100, true, "kmeans++", dense_sparse_l2_distance_sq);
+    model.set_seed(11);
+
+    MapPayLoad sbrk(&base, 10);
+    model.set_executor(&serial);
+    SparseKMeansTree one(&sbrk, vecs, model, 10);
+    model.set_executor(&pool, 3);
+    SparseKMeansTree many(&sbrk, vecs, model, 10);
+    REQUIRE(one.to_string() == many.to_string());
+    REQUIRE(one.stats().nodes == many.stats().nodes);
+    REQUIRE(one.stats().leaves == many.stats().leaves);
+}
@@ -0,0 +1,58 @@
+#include "doctest.h"
+#include "metrics.hpp"
+#include <cstddef>
+#include <thread>
+#include <vector>
+
+TEST_CASE("Metrics histograms") {
+    REQUIRE(Metrics::bucket(0) == 0);
+    REQUIRE(Metrics::bucket(1) == 1);
+    REQUIRE(Metrics::bucket(3) == 2);
+    REQUIRE(Metrics::bucket(4) == 3);
+    REQUIRE(Metrics::bucket(UINT64_MAX) == METRIC_BUCKETS - 1);
+
+    Metrics metrics;
+    for (uint64_t v = 1; v <= 100; v++) {
+        metrics.record(MH_SEARCH_NS, v);
+    }
+    metrics.record_level(METRIC_LEVELS + 3, 10);
+
+    MetricsSnapshot snapshot = metrics.snapshot();
+    REQUIRE(snapshot.count(MH_SEARCH_NS) == 100);
+    REQUIRE(snapshot.count(MH_INSERT_NS) == 0);
+    REQUIRE(snapshot.percentile(MH_SEARCH_NS, 0.5) == 63);
+    REQUIRE(snapshot.percentile(MH_SEARCH_NS, 1) == 127);
+    REQUIRE(snapshot.level_percentile(METRIC_LEVELS - 1, 0.5) == 15);
+
+    metrics.reset();
+    REQUIRE(metrics.snapshot().count(MH_SEARCH_NS) == 0);
+}
+
+TEST_CASE("Metrics counters from many threads") {
+    Metrics metrics;
+    std::vector<std::thread> threads;
+    for (int32_t t = 0; t < 2 * METRIC_SHARDS; t++) {
+        threads.push_back(std::thread([&metrics]() {
+            for (int32_t i = 0; i < 1000; i++) {
+                metrics.add(MC_NODES_VISITED, 2);
+            }
+        }));
+    }
+    for (auto iter = threads.begin(); iter != threads.end(); iter++) {
+        iter->join();
+    }
+
+    REQUIRE(metrics.snapshot().counters[MC_NODES_VISITED] == 2 * METRIC_SHARDS * 2000);
+}
+
+TEST_CASE("Metrics hold their shards apart") {
+    // trees embed a Metrics and are allocated with plain new
+    REQUIRE(alignof(Metrics) <= alignof(std::max_align_t));
+    REQUIRE(sizeof(Metrics) <= 64);
+
+    Metrics metrics;
+    REQUIRE(metrics.snapshot().counters[MC_SEARCHES] == 0);
+    metrics.reset();
+    metrics.add(MC_SEARCHES, 3);
+    REQUIRE(metrics.snapshot().counters[MC_SEARCHES] == 3);
+}
@@ -0,0 +1,82 @@
+#include "doctest.h"
+#include "vector_base.hpp"
+#include "quantized_payload.hpp"
+#include "half.hpp"
+#include <iostream>
+
+int32_t parse_xy_6(std::string v) {
+    if (v == "x") {
+        return 0;
+    } else if (v == "y") {
+        return 1;
+    }
+
+    return -1;
+}
+
+TEST_CASE("[half] fp16 and bf16 round trips") {
+    float values[] = {0, 1, -2.5, 0.333333, 65504, 1e-6, 3.1415926};
+    for (int32_t i = 0; i < 7; i++) {
+        REQUIRE(fabs(half_to_float(float_to_half(values[i])) - values[i]) <= fabs(values[i]) / 1024 + 1e-7);
+        REQUIRE(fabs(bf16_to_float(float_to_bf16(values[i])) - values[i]) <= fabs(values[i]) / 128);
+    }
+}
+
+TEST_CASE("[QuantizedPayLoad] approximated scores match the exact ones") {
+    VectorBase base("../data/kmeans.jsonl", 2, parse_xy_6, true);
+
+    for (int32_t c = 0; c < 2; c++) {
+        QuantizedPayLoad payload(&base, 20, c == 0 ? QUANT_INT8 : QUANT_FP16);
+        for (int32_t i = 0; i < 20; i++) {
+            payload.insert(i, 1.0, base.at(i));
+        }
+        REQUIRE(payload.size() == 20);
+
+        const SPVEC& x = base.at(3);
+        std::vector<std::pair<int32_t, TSVAL>> scores;
+        payload.score(x, scores);
+        for (int32_t i = 0; i < 20; i++) {
+            TSVAL exact = boost::numeric::ublas::inner_prod(base.at(i), x);
+            REQUIRE(scores[i].first == i);
+            REQUIRE(fabs(scores[i].second - exact) < exact * 0.02);
+        }
+
+        auto res = payload.search(x, 3, 10);
+        REQUIRE(res.size() == 3);
+        TSVAL best = 0;
+        for (int32_t i = 0; i < 20; i++) {
+            best = std::max(best, (TSVAL)boost::numeric::ublas::inner_prod(base.at(i), x));
+        }
+        REQUIRE(res[0].second == best);
+        REQUIRE(res[0].second >= res[1].second);
+    }
+}
+
+TEST_CASE("[QuantizedPayLoad] inserting a member again replaces it") {
+    VectorBase base("../data/kmeans.jsonl", 2, parse_xy_6, true);
+
+    for (int32_t c = 0; c < 2; c++) {
+        QuantizedPayLoad payload(&base, 20, c == 0 ? QUANT_INT8 : QUANT_FP16);
+        for (int32_t i = 0; i < 5; i++) {
+            payload.insert(i, 1.0, base.at(i));
+        }
+
+        // the member in the middle takes the vector of another one
+        SPVEC v(base.at(7));
+        v *= 3;
+        payload.insert(2, 1.0, v);
+        REQUIRE(payload.size() == 5);
+        std::vector<int32_t> ids;
+        payload.get_all_ids(ids);
+        REQUIRE(ids == std::vector<int32_t>({0, 1, 2, 3, 4}));
+
+        const SPVEC& x = base.at(3);
+        std::vector<std::pair<int32_t, TSVAL>> scores;
+        payload.score(x, scores);
+        for (int32_t i = 0; i < 5; i++) {
+            TSVAL exact = boost::numeric::ublas::inner_prod(i == 2 ? v : base.at(i), x);
+            REQUIRE(scores[i].first == i);
+            REQUIRE(fabs(scores[i].second - exact) <= fabs(exact) * 0.02);
+        }
+    }
+}
@@ -0,0 +1,49 @@
+#include "doctest.h"
+#include "random.hpp"
+#include <set>
+
+TEST_CASE("Philox4x32-10 known answers") {
+    // the known answer vectors of the Random123 distribution, the counter is
+    // (index low, index high, stream low, stream high) and the key (seed low, seed high)
+    uint32_t out[4];
+    PhiloxRng(0, 0).block(0, out);
+    REQUIRE(out[0] == 0x6627e8d5);
+    REQUIRE(out[1] == 0xe169c58d);
+    REQUIRE(out[2] == 0xbc57ac4c);
+    REQUIRE(out[3] == 0x9b00dbd8);
+
+    PhiloxRng(UINT64_MAX, UINT64_MAX).block(UINT64_MAX, out);
+    REQUIRE(out[0] == 0x408f276d);
+    REQUIRE(out[1] == 0x41c83b0e);
+    REQUIRE(out[2] == 0xa20bc7c6);
+    REQUIRE(out[3] == 0x6d5451fd);
+
+    PhiloxRng(0x299f31d0a4093822ull, 0x0370734413198a2eull).block(0x85a308d3243f6a88ull, out);
+    REQUIRE(out[0] == 0xd16cfe09);
+    REQUIRE(out[1] == 0x94fdcceb);
+    REQUIRE(out[2] == 0x5001e420);
+    REQUIRE(out[3] == 0x24126ea1);
+}
+
+TEST_CASE("Philox draws are addressable and stay in range") {
+    PhiloxRng rng(42);
+    PhiloxRng other(42);
+    for (uint64_t i = 0; i < 100; i++) {
+        REQUIRE(rng.next() == other.u64_at(i));
+    }
+
+    std::set<uint64_t> seen;
+    for (int32_t i = 0; i < 1000; i++) {
+        double u = rng.uniform();
+        REQUIRE(u >= 0);
+        REQUIRE(u < 1);
+        uint64_t b = rng.below(7);
+        REQUIRE(b < 7);
+        seen.insert(b);
+    }
+    REQUIRE(seen.size() == 7);
+
+    REQUIRE(PhiloxRng(42, 1).u64_at(0) != PhiloxRng(42, 0).u64_at(0));
+    REQUIRE(mix_seed(42, 0) != mix_seed(42, 1));
+    REQUIRE(mix_seed(42, 0) != mix_seed(43, 0));
+}
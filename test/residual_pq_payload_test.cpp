@@ -0,0 +1,132 @@
+#include "doctest.h"
+#include "vector_base.hpp"
+#include "residual_pq_payload.hpp"
+#include "sparse_kmeans_tree.hpp"
+
+int32_t parse_xy_8(std::string v) {
+    if (v == "x") {
+        return 0;
+    } else if (v == "y") {
+        return 1;
+    }
+
+    return -1;
+}
+
+TEST_CASE("[ResidualPQPayLoad] lookup table scores approximate the exact ones") {
+    VectorBase base("../data/kmeans.jsonl", 2, parse_xy_8, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 20; i++) {
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+    const SPVEC& x = base.at(3);
+
+    // not fitted, exact scores
+    ResidualPQPayLoad exact(&base, 20);
+    for (int32_t i = 0; i < 20; i++) {
+        exact.insert(i, 1.0, base.at(i));
+    }
+    REQUIRE(!exact.is_fitted());
+    std::vector<std::pair<int32_t, TSVAL>> scores;
+    exact.score(x, scores);
+    for (int32_t i = 0; i < 20; i++) {
+        REQUIRE(scores[i].second == doctest::Approx(boost::numeric::ublas::inner_prod(base.at(i), x)));
+    }
+
+    // one centroid per training sample reproduces them, fewer approximate them
+    for (int32_t centroids = 32; centroids >= 4; centroids /= 8) {
+        ResidualPQPayLoad payload(&base, 20, 2, centroids);
+        payload.fit(vecs, NULL);
+        REQUIRE(payload.is_fitted());
+        for (int32_t i = 0; i < 20; i++) {
+            payload.insert(i, 1.0, base.at(i));
+        }
+        REQUIRE(payload.size() == 20);
+
+        payload.score(x, scores);
+        for (int32_t i = 0; i < 20; i++) {
+            TSVAL dot = boost::numeric::ublas::inner_prod(base.at(i), x);
+            REQUIRE(scores[i].first == i);
+            REQUIRE(fabs(scores[i].second - dot) <= (centroids > 20 ? 1e-3 : 0.1) * dot);
+        }
+
+        // the shortlist is rescored exactly
+        auto res = payload.search(x, 3, 10);
+        REQUIRE(res.size() == 3);
+        TSVAL best = 0;
+        for (int32_t i = 0; i < 20; i++) {
+            best = std::max(best, (TSVAL)boost::numeric::ublas::inner_prod(base.at(i), x));
+        }
+        REQUIRE(res[0].second == best);
+        REQUIRE(res[0].second >= res[1].second);
+    }
+}
+
+TEST_CASE("[ResidualPQPayLoad] leaves of a K Means Tree are fitted on their samples") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_8, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+    ResidualPQPayLoad sbrk(&base, 10, 2, 4);
+    SparseKMeansTree kmst(&sbrk, vecs, 10, 2, 100, true, "kmeans++", dense_sparse_l2_distance);
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        kmst.insert(*iter, base.at(*iter), 1.0);
+    }
+
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        const ResidualPQPayLoad* leaf = static_cast<const ResidualPQPayLoad*>(kmst.search_for_leaf(base.at(*iter)));
+        REQUIRE(leaf->is_fitted());
+        auto res = leaf->search(base.at(*iter), 1, 4);
+        REQUIRE(res.size() == 1);
+    }
+}
+
+TEST_CASE("[ResidualPQPayLoad] clones score like the original and diverge on insert") {
+    VectorBase base("../data/kmeans.jsonl", 2, parse_xy_8, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 20; i++) {
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+    const SPVEC& x = base.at(3);
+
+    ResidualPQPayLoad payload(&base, 20, 2, 4);
+    payload.fit(vecs, NULL);
+    for (int32_t i = 0; i < 10; i++) {
+        payload.insert(i, 1.0, base.at(i));
+    }
+
+    // the clone shares the codebooks, its members are its own
+    LeafPayLoad* clone = payload.clone();
+    ResidualPQPayLoad* copy = dynamic_cast<ResidualPQPayLoad*>(clone);
+    REQUIRE(copy->is_fitted());
+    for (int32_t i = 10; i < 20; i++) {
+        copy->insert(i, 1.0, base.at(i));
+    }
+    REQUIRE(payload.size() == 10);
+    REQUIRE(copy->size() == 20);
+
+    std::vector<std::pair<int32_t, TSVAL>> scores;
+    std::vector<std::pair<int32_t, TSVAL>> copied;
+    payload.score(x, scores);
+    copy->score(x, copied);
+    for (int32_t i = 0; i < 10; i++) {
+        REQUIRE(copied[i] == scores[i]);
+    }
+
+    // a fresh payload fitted the same way codes the new members the same
+    ResidualPQPayLoad again(&base, 20, 2, 4);
+    again.fit(vecs, NULL);
+    for (int32_t i = 0; i < 20; i++) {
+        again.insert(i, 1.0, base.at(i));
+    }
+    again.score(x, scores);
+    for (int32_t i = 0; i < 20; i++) {
+        REQUIRE(copied[i] == scores[i]);
+    }
+    payload.dispose(&clone);
+}
@@ -0,0 +1,196 @@
+#include "doctest.h"
+#include "vector_base.hpp"
+#include "sample_stream.hpp"
+#include "sparse_kmeans.hpp"
+#include "sparse_kmeans_tree.hpp"
+#include "map_payload.hpp"
+#include <iostream>
+#include <fstream>
+#include <cstdio>
+
+int32_t parse_xy_4(std::string v) {
+    if (v == "x") {
+        return 0;
+    } else if (v == "y") {
+        return 1;
+    }
+
+    return -1;
+}
+
+TEST_CASE("[SampleStream] blocks are bounded by the budget") {
+    SampleStream stream("../data/kmeans.jsonl", 2, parse_xy_4, true);
+    REQUIRE(stream.is_open());
+    REQUIRE(stream.count() == 20);
+
+    std::vector<std::pair<int32_t, SPVEC>> block;
+    int32_t next_id = 0;
+    while (EXK_SUC == stream.next_block(block, 400)) {
+        REQUIRE(block.size() <= 3);
+        for (auto iter = block.begin(); iter != block.end(); iter++) {
+            REQUIRE(iter->first == next_id);
+            REQUIRE(iter->second.nnz() == 2);
+            next_id++;
+        }
+    }
+
+    REQUIRE(next_id == 20);
+    REQUIRE(stream.exhausted());
+}
+
+TEST_CASE("[SampleStream] the count is kept once known") {
+    // a pass of next_block reaching the end counts the samples
+    SampleStream stream("../data/kmeans.jsonl", 2, parse_xy_4, true);
+    std::vector<std::pair<int32_t, SPVEC>> block;
+    while (EXK_SUC == stream.next_block(block, 400)) {
+    }
+    REQUIRE(stream.count() == 20);
+
+    // a count given by the writer of the file is not scanned again
+    SampleStream told("../data/kmeans.jsonl", 2, parse_xy_4, true);
+    told.set_count(7);
+    REQUIRE(told.count() == 7);
+    stream.rewind();
+    REQUIRE(stream.count() == 20);
+}
+
+TEST_CASE("A simple K Means streamed in blocks") {
+    SampleStream stream("../data/kmeans_2.jsonl", 2, parse_xy_4, true);
+    SparseKMeansModel model(2, 100, true, "kmeans++", dense_sparse_l2_distance);
+
+    int32_t st = model.fit_stream(stream, 32 + 5 * 160);
+    REQUIRE(st != EXK_FAIL);
+
+    auto assignment = model.get_assignment();
+    REQUIRE(assignment.size() == 20);
+    for (int32_t i = 0; i < 9; i++) {
+        REQUIRE(assignment[i] == assignment[i+1]);
+        REQUIRE(assignment[i] != assignment[i+10]);
+    }
+}
+
+TEST_CASE("The stream budget holds the assignment of the corpus") {
+    SampleStream stream("../data/kmeans_2.jsonl", 2, parse_xy_4, true);
+    SparseKMeansModel model(2, 100, true, "kmeans++", dense_sparse_l2_distance);
+
+    // the centers and their accumulators take 32 bytes, the 20 assignments 80
+    REQUIRE(model.fit_stream(stream, 32 + 20 * sizeof(int32_t)) == EXK_FAIL);
+    REQUIRE(model.fit_stream(stream, 32 + 20 * sizeof(int32_t) + 5 * 200) != EXK_FAIL);
+}
+
+TEST_CASE("The stream seeding samples the whole corpus") {
+    // the first blocks hold one point only, the second cluster comes after them
+    const char* name = "./stream_late.jsonl";
+    {
+        std::ofstream out(name);
+        for (int32_t i = 0; i < 200; i++) {
+            out << i << "\t{\"x\": " << (i < 100 ? 0 : 10) << ", \"y\": " << (i < 100 ? 0 : 10) << "}\n";
+        }
+    }
+    SampleStream stream(name, 2, parse_xy_4, true);
+    SparseKMeansModel model(2, 100, true, "kmeans++", dense_sparse_l2_distance);
+    model.set_seed(3);
+
+    // a dozen samples per block and as many in the reservoir
+    REQUIRE(model.fit_stream(stream, 32 + 200 * sizeof(int32_t) + 20 * 200) != EXK_FAIL);
+    std::remove(name);
+
+    auto assignment = model.get_assignment();
+    REQUIRE(assignment.size() == 200);
+    for (int32_t i = 0; i < 200; i++) {
+        REQUIRE(assignment[i] == assignment[i < 100 ? 0 : 199]);
+    }
+    REQUIRE(assignment[0] != assignment[199]);
+}
+
+TEST_CASE("A K Means Tree built out of core") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_4, true);
+    SampleStream stream("../data/kmeans_3.jsonl", 2, parse_xy_4, true);
+
+    // one partition file and a few samples, not the 60 samples with their training
+    size_t budget = STREAM_PART_BYTES + 4000;
+    MapPayLoad sbrk(&base, 10);
+    SparseKMeansTree kmst(&sbrk, stream, ".", budget, 10, 2, 100, "kmeans++", dense_sparse_l2_distance);
+    REQUIRE(kmst.build_peak_bytes() <= budget);
+
+    for (int32_t i = 0; i < 60; i++) {
+        kmst.insert(i, base.at(i), 1.0);
+    }
+
+    for (int32_t i = 0; i < 60; i++) {
+        auto ids = const_cast<LeafPayLoad*>(kmst.search_for_leaf(base.at(i)))->get_all_ids();
+        REQUIRE(ids.count(i) == 1);
+        REQUIRE(ids.size() <= 10);
+    }
+}
+
+TEST_CASE("An out of core node writes its partitions in batches") {
+    // 400 distinct points on a grid, split by the root in more children than the
+    // partition files open at once
+    const char* name = "./stream_wide.jsonl";
+    {
+        std::ofstream out(name);
+        for (int32_t i = 0; i < 400; i++) {
+            out << i << "\t{\"x\": " << i % 20 << ", \"y\": " << i / 20 << "}\n";
+        }
+    }
+    int32_t k = STREAM_OPEN_PARTS + 16;
+    VectorBase base(name, 2, parse_xy_4, true);
+    SampleStream stream(name, 2, parse_xy_4, true);
+    size_t budget = 2 * k * 2 * sizeof(TSVAL) + 400 * sizeof(int32_t) + 100 * 200;
+
+    MapPayLoad sbrk(&base, 4);
+    SparseKMeansTree kmst(&sbrk, stream, ".", budget, 4, k, 10, "kmeans++", dense_sparse_l2_distance);
+    std::remove(name);
+    REQUIRE(kmst.stats().fan_out[0] == k);
+    REQUIRE(kmst.build_peak_bytes() <= budget);
+
+    for (int32_t i = 0; i < 400; i++) {
+        kmst.insert(i, base.at(i), 1.0);
+    }
+    for (int32_t i = 0; i < 400; i++) {
+        std::vector<int32_t> ids;
+        kmst.search_for_leaf(base.at(i))->get_all_ids(ids);
+        REQUIRE(std::count(ids.begin(), ids.end(), i) == 1);
+    }
+}
+
+TEST_CASE("An out of core build stays within its budget") {
+    // 400 samples of two nnz in 1000 dims, the dense centers of a node cost more than
+    // its samples
+    const char* name = "./stream_sparse.jsonl";
+    {
+        std::ofstream out(name);
+        for (int32_t i = 0; i < 400; i++) {
+            out << i << "\t{\"" << (i % 10) * 100 << "\": 1, \"" << (i % 10) * 100 + 1 + i / 10 << "\": 0.5}\n";
+        }
+    }
+    size_t budget = 120 * 1024;
+
+    // the samples fit, not with the training of the root besides them
+    SampleStream probe(name, 1000, NULL, true);
+    std::vector<std::pair<int32_t, SPVEC>> block;
+    probe.next_block(block, budget);
+    REQUIRE(probe.exhausted());
+    REQUIRE(probe.block_bytes() + probe.line_bytes() <= budget);
+    SparseKMeansModel model(10, 10, true, "kmeans++", dense_sparse_l2_distance);
+    REQUIRE(probe.block_bytes() + model.training_bytes(400, 1000) > budget);
+
+    VectorBase base(name, 1000, NULL, true);
+    SampleStream stream(name, 1000, NULL, true);
+    MapPayLoad sbrk(&base, 50);
+    SparseKMeansTree kmst(&sbrk, stream, ".", budget, 50, 10, 10, "kmeans++", dense_sparse_l2_distance);
+    std::remove(name);
+    REQUIRE(kmst.build_peak_bytes() > 0);
+    REQUIRE(kmst.build_peak_bytes() <= budget);
+    REQUIRE(kmst.stats().leaves > 1);
+
+    for (int32_t i = 0; i < 400; i++) {
+        kmst.insert(i, base.at(i), 1.0);
+    }
+    for (int32_t i = 0; i < 400; i++) {
+        std::vector<int32_t> ids;
+        kmst.search_for_leaf(base.at(i))->get_all_ids(ids);
+        REQUIRE(std::count(ids.begin(), ids.end(), i) == 1);
+    }
+}
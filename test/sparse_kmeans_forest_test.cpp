@@ -0,0 +1,72 @@
+#include "doctest.h"
+#include "vector_base.hpp"
+#include "sparse_kmeans_forest.hpp"
+#include "map_payload.hpp"
+#include <set>
+
+int32_t parse_xy_7(std::string v) {
+    if (v == "x") {
+        return 0;
+    } else if (v == "y") {
+        return 1;
+    }
+
+    return -1;
+}
+
+TEST_CASE("Randomized K Means Forest") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_7, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+    SparseKMeansModel prototype(2, 100, true, "kmeans++", dense_sparse_l2_distance_sq);
+    prototype.set_seed(7);
+
+    MapPayLoad sbrk(&base, 10);
+    SparseKMeansForest forest(&sbrk, vecs, prototype, 4, 0.5, 10);
+    REQUIRE(forest.size() == 4);
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        REQUIRE(forest.insert(*iter, base.at(*iter), 1.0) == EXK_SUC);
+    }
+
+    // every tree holds every member, in its own leaves
+    for (size_t t = 0; t < forest.size(); t++) {
+        REQUIRE(forest.tree(t).stats().leaves > 1);
+    }
+
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        std::vector<int32_t> candidates;
+        forest.search_candidates(base.at(*iter), 1, candidates);
+        std::set<int32_t> unique(candidates.begin(), candidates.end());
+        REQUIRE(unique.size() == candidates.size());
+        REQUIRE(unique.count(*iter) == 1);
+
+        // a superset of the candidates of each tree
+        for (size_t t = 0; t < forest.size(); t++) {
+            auto leaves = forest.tree(t).search_for_leaves(base.at(*iter), 1);
+            std::vector<int32_t> members;
+            for (auto leaf = leaves.begin(); leaf != leaves.end(); leaf++) {
+                (*leaf)->get_all_ids(members);
+                for (auto m = members.begin(); m != members.end(); m++) {
+                    REQUIRE(unique.count(*m) == 1);
+                }
+            }
+        }
+
+        auto res = forest.search(base.at(*iter), 3, 1, base);
+        REQUIRE(res.size() == 3);
+        REQUIRE(res[0].first == *iter);
+        REQUIRE(res[0].second == doctest::Approx(0));
+        REQUIRE(res[1].second >= res[0].second);
+        REQUIRE(res[2].second >= res[1].second);
+
+        // the dense query of the previous search left nothing behind
+        for (auto r = res.begin(); r != res.end(); r++) {
+            SPVEC diff = base.at(r->first) - base.at(*iter);
+            REQUIRE(r->second == doctest::Approx(boost::numeric::ublas::inner_prod(diff, diff)));
+        }
+    }
+}
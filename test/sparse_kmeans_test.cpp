@@ -1,6 +1,7 @@
 #include "doctest.h"
 #include "vector_base.hpp"
 #include "sparse_kmeans.hpp"
+#include "topk.hpp"
 #include <iostream>
 
 int32_t parse_xy_2(std::string v) {
@@ -51,17 +52,35 @@ TEST_CASE("A simple K Means using L2") {
     }
 }
 
-TEST_CASE("A simple K Means when empty center ==> fail") {
-    VectorBase base("../data/kmeans_2.jsonl", 2, parse_xy_2);
+TEST_CASE("A simple K Means reseeds an empty center") {
+    VectorBase base("../data/kmeans_2.jsonl", 2, parse_xy_2, true);
     std::vector<int32_t> ids = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19};
     std::vector<const SPVEC*> vecs = base.get_vectors(ids);
 
-    std::cerr << "init model..." << std::endl;
+    // the largest center attracts every sample under the inversed dot
     SparseKMeansModel model(2, 100, true, "kmeans++", inversed_dense_sparse_dot);
-
-    std::cerr << "start fitting..." << std::endl;
     int32_t st = model.fit(vecs);
-    REQUIRE(st == EXK_FAIL);
+    REQUIRE(st == EXK_SUC);
+    REQUIRE(model.get_recoveries() > 0);
+
+    auto assignment = model.get_assignment();
+    REQUIRE(std::count(assignment.begin(), assignment.end(), 0) > 0);
+    REQUIRE(std::count(assignment.begin(), assignment.end(), 1) > 0);
+}
+
+TEST_CASE("A simple K Means when no cluster can spare a member ==> fail") {
+    VectorBase base;
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 10; i++) {
+        SPVEC v(2);
+        v(i % 2) = 1;
+        base.insert(i, v);
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    SparseKMeansModel model(3, 100, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(model.fit(vecs) == EXK_FAIL);
 }
 
 TEST_CASE("Non exclusive K Means degenerates to exclusive if the K == 1") {
@@ -81,4 +100,470 @@ TEST_CASE("Non exclusive K Means degenerates to exclusive if the K == 1") {
         REQUIRE(u[i][0].first == u[i+1][0].first);
         REQUIRE(u[i][0].first != u[i+10][0].first);
     }
-}
\ No newline at end of file
+}
+
+TEST_CASE("A simple K Means with pruned sparse centers") {
+    VectorBase base("../data/kmeans_2.jsonl", 2, parse_xy_2, true);
+    std::vector<int32_t> ids = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19};
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    SparseKMeansModel model(2, 100, true, "kmeans++", dense_sparse_l2_distance);
+    REQUIRE(model.set_center_pruning(1) == EXK_SUC);
+
+    int32_t st = model.fit(vecs);
+    REQUIRE(st != EXK_FAIL);
+    REQUIRE(model.get_centers().size() == 0);
+    REQUIRE(model.get_sparse_centers().size() == 2);
+    for (int32_t i = 0; i < 2; i++) {
+        REQUIRE(model.get_sparse_centers()[i].nnz() == 1);
+    }
+
+    auto assignment = model.get_assignment();
+    for (int32_t i = 0; i < 9; i++) {
+        REQUIRE(assignment[i] == assignment[i+1]);
+        REQUIRE(assignment[i] != assignment[i+10]);
+        REQUIRE(model.predict(*vecs[i]) == assignment[i]);
+    }
+}
+
+TEST_CASE("[prune_center] keeps the top weights or the mass") {
+    DSVEC d(6);
+    d(0) = 0.1; d(1) = -4; d(2) = 0; d(3) = 3; d(4) = 2; d(5) = 1;
+
+    CPVEC top = prune_center(d, 2, 0);
+    REQUIRE(top.nnz() == 2);
+    REQUIRE(top(1) == -4);
+    REQUIRE(top(3) == 3);
+
+    CPVEC mass = prune_center(d, 0, 0.8);
+    REQUIRE(mass.nnz() == 3);
+    REQUIRE(mass(4) == 2);
+    REQUIRE(mass(5) == 0);
+}
+
+TEST_CASE("A simple K Means with dimension major centers") {
+    VectorBase base("../data/kmeans_2.jsonl", 2, parse_xy_2, true);
+    std::vector<int32_t> ids = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11, 12, 13, 14, 15, 16, 17, 18, 19};
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    for (int32_t f = 0; f < 2; f++) {
+        SparseKMeansModel model(2, 100, true, "kmeans++", f == 0 ? dense_sparse_l2_distance_sq : dense_sparse_l2_distance);
+        REQUIRE(model.set_dimension_major(true) == EXK_SUC);
+
+        int32_t st = model.fit(vecs);
+        REQUIRE(st != EXK_FAIL);
+        REQUIRE(model.get_centers().size() == 0);
+
+        auto assignment = model.get_assignment();
+        for (int32_t i = 0; i < 9; i++) {
+            REQUIRE(assignment[i] == assignment[i+1]);
+            REQUIRE(assignment[i] != assignment[i+10]);
+            REQUIRE(model.predict(*vecs[i]) == assignment[i]);
+        }
+    }
+}
+
+TEST_CASE("Inverted index over pruned centers matches the exhaustive scoring") {
+    // 5 clusters in 1000 dims, each drawing most of its nonzeros from its own 50 dims
+    srand(7);
+    VectorBase base;
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 300; i++) {
+        SPVEC v(1000);
+        int32_t cluster = i % 5;
+        for (int32_t j = 0; j < 10; j++) {
+            int32_t d = rand() % 4 == 0 ? rand() % 1000 : cluster * 50 + rand() % 50;
+            v(d) = 1 + rand() % 10;
+        }
+        base.insert(i, v);
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    SparseKMeansModel model(20, 20, true, "random");
+    REQUIRE(model.set_center_pruning(30) == EXK_SUC);
+    REQUIRE(model.set_inverted_index(true) == EXK_SUC);
+    model.fit(vecs);
+
+    const std::vector<CPVEC>& centers = model.get_sparse_centers();
+    REQUIRE(centers.size() == 20);
+    for (auto iter = vecs.begin(); iter != vecs.end(); iter++) {
+        std::vector<std::pair<int32_t, TSVAL>> exact;
+        for (int32_t i = 0; i < centers.size(); i++) {
+            exact.push_back(std::make_pair(i, inversed_sparse_sparse_dot(centers[i], **iter)));
+        }
+        std::stable_sort(exact.begin(), exact.end(), CompareByValue<int32_t, TSVAL>());
+
+        TSVAL dist;
+        model.predict(**iter, &dist);
+        REQUIRE(dist == doctest::Approx(exact[0].second));
+
+        auto top = model.predict(**iter, 3);
+        for (int32_t i = 0; i < top.size(); i++) {
+            REQUIRE(top[i].second == doctest::Approx(exact[i].second));
+        }
+    }
+}
+
+TEST_CASE("Half precision centers rarely change the assignment") {
+    srand(11);
+    VectorBase base;
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 300; i++) {
+        SPVEC v(200);
+        int32_t cluster = i % 10;
+        for (int32_t j = 0; j < 20; j++) {
+            int32_t d = rand() % 3 == 0 ? rand() % 200 : cluster * 20 + rand() % 20;
+            v(d) = (TSVAL)(1 + rand() % 100) / 10;
+        }
+        base.insert(i, v);
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    int32_t precisions[] = {CENTER_FP16, CENTER_BF16};
+    TSVAL bounds[] = {0.01, 0.03};
+    for (int32_t layout = 0; layout < 2; layout++) {
+        for (int32_t p = 0; p < 2; p++) {
+            SparseKMeansModel model(10, 10, true, "random", dense_sparse_l2_distance_sq);
+            model.set_dimension_major(layout == 1);
+            REQUIRE(model.fit(vecs) != EXK_FAIL);
+
+            std::vector<int32_t> fp32;
+            for (auto iter = vecs.begin(); iter != vecs.end(); iter++) {
+                fp32.push_back(model.predict(**iter));
+            }
+            size_t bytes = model.center_bytes();
+
+            REQUIRE(model.set_center_precision(precisions[p]) == EXK_SUC);
+            model.freeze_centers();
+            REQUIRE(model.center_bytes() < bytes * 0.6);
+
+            int32_t disagreement = 0;
+            for (int32_t i = 0; i < vecs.size(); i++) {
+                if (model.predict(*vecs[i]) != fp32[i]) {
+                    disagreement++;
+                }
+            }
+            REQUIRE(disagreement <= bounds[p] * vecs.size());
+        }
+    }
+}
+
+TEST_CASE("Balanced K Means bounds the cluster sizes") {
+    // 4 groups of 100, 60, 30 and 10 points in 2 dims
+    srand(11);
+    VectorBase base;
+    std::vector<int32_t> ids;
+    int32_t sizes[] = {100, 60, 30, 10};
+    for (int32_t g = 0; g < 4; g++) {
+        for (int32_t i = 0; i < sizes[g]; i++) {
+            SPVEC v(2);
+            v(0) = 10 * (g % 2) + (float)rand() / RAND_MAX;
+            v(1) = 10 * (g / 2) + (float)rand() / RAND_MAX;
+            base.insert(ids.size(), v);
+            ids.push_back(ids.size());
+        }
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    auto cluster_sizes = [](const SparseKMeansModel& model) {
+        std::vector<int32_t> ret(model.get_k(), 0);
+        for (auto iter = model.get_assignment().begin(); iter != model.get_assignment().end(); iter++) {
+            ret[*iter]++;
+        }
+        std::sort(ret.begin(), ret.end());
+        return ret;
+    };
+
+    SparseKMeansModel hard(4, 20, true, "random", dense_sparse_l2_distance_sq);
+    REQUIRE(hard.set_balance(BALANCE_HARD, 0.5) == EXK_FAIL);
+    REQUIRE(hard.set_balance(BALANCE_HARD, 1.2) == EXK_SUC);
+    REQUIRE(hard.fit(vecs) == EXK_SUC);
+    auto hard_sizes = cluster_sizes(hard);
+    REQUIRE(*hard_sizes.rbegin() <= 60);
+    REQUIRE(*hard_sizes.begin() >= 20);
+
+    SparseKMeansModel soft(4, 20, true, "random", dense_sparse_l2_distance_sq);
+    REQUIRE(soft.set_balance(BALANCE_SOFT, 100) == EXK_SUC);
+    REQUIRE(soft.fit(vecs) == EXK_SUC);
+    auto soft_sizes = cluster_sizes(soft);
+    REQUIRE(*soft_sizes.rbegin() - *soft_sizes.begin() < 90);
+
+    // more centers than the candidates kept per sample, the full samples fall back on
+    // the others and the capacity still holds
+    SparseKMeansModel wide(2 * BALANCE_CANDIDATES, 20, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(wide.set_balance(BALANCE_HARD, 1.1) == EXK_SUC);
+    REQUIRE(wide.fit(vecs) == EXK_SUC);
+    auto wide_sizes = cluster_sizes(wide);
+    REQUIRE(*wide_sizes.rbegin() <= ceil(1.1 * 200 / (2 * BALANCE_CANDIDATES)));
+    REQUIRE(wide_sizes.size() == 2 * BALANCE_CANDIDATES);
+}
+
+TEST_CASE("Spherical K Means keeps unit centers and assigns by cosine") {
+    // 4 directions in 200 dims, with sample norms spread over two orders of magnitude
+    srand(5);
+    VectorBase base;
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 200; i++) {
+        SPVEC v(200);
+        int32_t cluster = i % 4;
+        float scale = 0.1 + (rand() % 100);
+        for (int32_t j = 0; j < 8; j++) {
+            int32_t d = rand() % 5 == 0 ? rand() % 200 : cluster * 50 + rand() % 20;
+            v(d) = scale * (1 + rand() % 5);
+        }
+        base.insert(i, v);
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    SparseKMeansModel model(4, 30, true, "kmeans++", negative_dense_sparse_dot);
+    REQUIRE(model.is_spherical());
+    REQUIRE(model.fit(vecs) == EXK_SUC);
+
+    for (auto iter = model.get_centers().begin(); iter != model.get_centers().end(); iter++) {
+        REQUIRE(boost::numeric::ublas::norm_2(*iter) == doctest::Approx(1));
+    }
+
+    for (auto iter = vecs.begin(); iter != vecs.end(); iter++) {
+        int32_t best = 0;
+        TSVAL best_cos = -2;
+        for (int32_t i = 0; i < model.get_k(); i++) {
+            TSVAL cos = boost::numeric::ublas::inner_prod(model.get_centers()[i], **iter) / boost::numeric::ublas::norm_2(**iter);
+            if (cos > best_cos) {
+                best_cos = cos;
+                best = i;
+            }
+        }
+
+        TSVAL dist;
+        REQUIRE(model.predict(**iter, &dist) == best);
+        REQUIRE(dist < 0);
+        REQUIRE(model.predict(**iter, 4).size() >= 1);
+    }
+
+    // the same clustering from the dimension major layout
+    SparseKMeansModel row_major(4, 30, true, "kmeans++", negative_dense_sparse_dot);
+    row_major.set_seed(5);
+    REQUIRE(row_major.fit(vecs) == EXK_SUC);
+    SparseKMeansModel dim_major(4, 30, true, "kmeans++", negative_dense_sparse_dot);
+    dim_major.set_seed(5);
+    REQUIRE(dim_major.set_dimension_major(true) == EXK_SUC);
+    REQUIRE(dim_major.fit(vecs) == EXK_SUC);
+    REQUIRE(dim_major.get_assignment() == row_major.get_assignment());
+    std::vector<DSVEC> row_centers = row_major.export_centers();
+    std::vector<DSVEC> dim_centers = dim_major.export_centers();
+    REQUIRE(dim_centers.size() == row_centers.size());
+    for (size_t c = 0; c < row_centers.size(); c++) {
+        for (size_t d = 0; d < row_centers[c].size(); d++) {
+            REQUIRE(dim_centers[c](d) == doctest::Approx(row_centers[c](d)).epsilon(1e-4));
+        }
+    }
+}
+
+TEST_CASE("Seeded K Means is reproducible for any thread count") {
+    srand(3);
+    VectorBase base;
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 500; i++) {
+        SPVEC v(300);
+        int32_t cluster = i % 6;
+        for (int32_t j = 0; j < 10; j++) {
+            int32_t d = rand() % 4 == 0 ? rand() % 300 : cluster * 50 + rand() % 50;
+            v(d) = (TSVAL)(1 + rand() % 100) / 7;
+        }
+        base.insert(i, v);
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    std::vector<std::vector<DSVEC>> centers;
+    std::vector<std::vector<int32_t>> assignments;
+    for (int32_t t = 1; t <= 4; t *= 2) {
+        Executor executor(t);
+        SparseKMeansModel model(6, 20, true, "kmeans++", dense_sparse_l2_distance_sq);
+        model.set_executor(&executor, t);
+        model.set_seed(1234);
+        REQUIRE(model.fit(vecs) == EXK_SUC);
+        centers.push_back(model.get_centers());
+        assignments.push_back(model.get_assignment());
+    }
+    REQUIRE(centers.size() == 3);
+
+    for (size_t r = 1; r < centers.size(); r++) {
+        REQUIRE(assignments[r] == assignments[0]);
+        for (size_t c = 0; c < centers[0].size(); c++) {
+            for (size_t d = 0; d < centers[0][c].size(); d++) {
+                REQUIRE(centers[r][c](d) == centers[0][c](d));
+            }
+        }
+    }
+
+    SparseKMeansModel other(6, 20, true, "kmeans++", dense_sparse_l2_distance_sq);
+    other.set_seed(1235);
+    REQUIRE(other.fit(vecs) == EXK_SUC);
+    bool same = true;
+    for (size_t c = 0; c < centers[0].size(); c++) {
+        for (size_t d = 0; d < centers[0][c].size(); d++) {
+            same = same && other.get_centers()[c](d) == centers[0][c](d);
+        }
+    }
+    REQUIRE(!same);
+}
+
+TEST_CASE("Subsampled K Means assigns all the samples") {
+    srand(13);
+    VectorBase base;
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 2000; i++) {
+        SPVEC v(400);
+        int32_t cluster = i % 8;
+        for (int32_t j = 0; j < 10; j++) {
+            int32_t d = rand() % 5 == 0 ? rand() % 400 : cluster * 50 + rand() % 50;
+            v(d) = (TSVAL)(1 + rand() % 10);
+        }
+        base.insert(i, v);
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    SparseKMeansModel full(8, 30, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(full.fit(vecs) == EXK_SUC);
+    REQUIRE(full.get_subsample_quality().subsample == 2000);
+
+    SparseKMeansModel model(8, 30, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(model.set_subsample(300) == EXK_SUC);
+    REQUIRE(model.subsample_size(2000) == 300);
+    REQUIRE(model.subsample_size(250) == 250);
+    REQUIRE(model.fit(vecs) == EXK_SUC);
+    REQUIRE(model.get_assignment().size() == 2000);
+
+    const SubsampleQuality& quality = model.get_subsample_quality();
+    REQUIRE(quality.samples == 2000);
+    REQUIRE(quality.subsample == 300);
+    REQUIRE(quality.full_dist > 0);
+    REQUIRE(quality.full_dist < 1.2 * quality.subsample_dist);
+
+    for (size_t i = 0; i < vecs.size(); i++) {
+        REQUIRE(model.get_assignment()[i] == model.predict(*vecs[i]));
+    }
+
+    REQUIRE(model.set_subsample(0, 0.1) == EXK_SUC);
+    REQUIRE(model.subsample_size(2000) == 200);
+    REQUIRE(model.subsample_size(20) == 8);
+    REQUIRE(model.set_subsample(0, 2) == EXK_FAIL);
+    SparseKMeansModel fuzzy(8, 30, false);
+    REQUIRE(fuzzy.set_subsample(300) == EXK_FAIL);
+}
+
+TEST_CASE("Warm started K Means converges from the previous centers") {
+    srand(17);
+    VectorBase base;
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 600; i++) {
+        SPVEC v(300);
+        int32_t cluster = i % 6;
+        for (int32_t j = 0; j < 10; j++) {
+            int32_t d = rand() % 5 == 0 ? rand() % 300 : cluster * 50 + rand() % 50;
+            v(d) = (TSVAL)(1 + rand() % 10);
+        }
+        base.insert(i, v);
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    SparseKMeansModel cold(6, 100, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(cold.set_dimension_major(true) == EXK_SUC);
+    REQUIRE(cold.fit(vecs) == EXK_SUC);
+    std::vector<DSVEC> centers = cold.export_centers();
+    REQUIRE(centers.size() == 6);
+    REQUIRE(cold.get_fit_iterations() > 2);
+
+    // from the converged centers the first E-step already gives the final assignment
+    SparseKMeansModel warm(6, 100, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(warm.set_initial_centers(centers) == EXK_SUC);
+    REQUIRE(warm.fit(vecs) == EXK_SUC);
+    REQUIRE(warm.get_fit_iterations() <= 2);
+    REQUIRE(warm.get_assignment() == cold.get_assignment());
+
+    // fewer centers than the model k, not more
+    std::vector<DSVEC> four(centers.begin(), centers.begin() + 4);
+    SparseKMeansModel fewer(6, 100, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(fewer.set_initial_centers(four) == EXK_SUC);
+    REQUIRE(fewer.get_k() == 4);
+    REQUIRE(fewer.fit(vecs) == EXK_SUC);
+    SparseKMeansModel smaller(3, 100, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(smaller.set_initial_centers(four) == EXK_FAIL);
+
+    std::vector<DSVEC> wrong(6, DSVEC(10));
+    SparseKMeansModel mismatch(6, 100, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(mismatch.set_initial_centers(wrong) == EXK_SUC);
+    REQUIRE(mismatch.fit(vecs) == EXK_FAIL);
+}
+
+TEST_CASE("Weighted K Means matches the fit over the repeated samples") {
+    srand(19);
+    VectorBase base;
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 300; i++) {
+        SPVEC v(200);
+        int32_t cluster = i % 5;
+        for (int32_t j = 0; j < 8; j++) {
+            int32_t d = rand() % 5 == 0 ? rand() % 200 : cluster * 40 + rand() % 40;
+            v(d) = (TSVAL)(1 + rand() % 10);
+        }
+        base.insert(i, v);
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    // sample i weighs 1 + i % 4, and is repeated as many times in the expanded set
+    std::vector<TSVAL> weights;
+    std::vector<const SPVEC*> expanded;
+    for (size_t i = 0; i < vecs.size(); i++) {
+        weights.push_back(1 + i % 4);
+        for (size_t r = 0; r < 1 + i % 4; r++) {
+            expanded.push_back(vecs[i]);
+        }
+    }
+
+    SparseKMeansModel seeding(5, 0, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(seeding.fit(vecs, &weights) == EXK_SUC);
+    std::vector<DSVEC> initial = seeding.export_centers();
+
+    SparseKMeansModel weighted(5, 50, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(weighted.set_initial_centers(initial) == EXK_SUC);
+    REQUIRE(weighted.fit(vecs, &weights) == EXK_SUC);
+
+    SparseKMeansModel repeated(5, 50, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(repeated.set_initial_centers(initial) == EXK_SUC);
+    REQUIRE(repeated.fit(expanded) == EXK_SUC);
+
+    for (int32_t c = 0; c < 5; c++) {
+        for (size_t d = 0; d < 200; d++) {
+            REQUIRE(weighted.get_centers()[c](d) == doctest::Approx(repeated.get_centers()[c](d)).epsilon(1e-4));
+        }
+    }
+    // so does the objective
+    REQUIRE(weighted.get_inertia() > 0);
+    REQUIRE(weighted.get_inertia() == doctest::Approx(repeated.get_inertia()).epsilon(1e-4));
+
+    // balanced sizes count the weights
+    SparseKMeansModel balanced(5, 50, true, "kmeans++", dense_sparse_l2_distance_sq);
+    REQUIRE(balanced.set_balance(BALANCE_HARD, 1.2) == EXK_SUC);
+    REQUIRE(balanced.fit(vecs, &weights) == EXK_SUC);
+    std::vector<double> mass(5, 0);
+    for (size_t i = 0; i < vecs.size(); i++) {
+        mass[balanced.get_assignment()[i]] += weights[i];
+    }
+    for (int32_t c = 0; c < 5; c++) {
+        REQUIRE(mass[c] <= 1.2 * 750 / 5 + 4);
+    }
+
+    std::vector<TSVAL> bad(weights);
+    bad[3] = 0;
+    REQUIRE(weighted.fit(vecs, &bad) == EXK_FAIL);
+    bad.resize(10);
+    REQUIRE(weighted.fit(vecs, &bad) == EXK_FAIL);
+}
@@ -31,4 +31,310 @@ TEST_CASE("A simple K Means Tree in L2") {
     }
 
     std::cout << kmst.to_string() << std::endl;
-}
\ No newline at end of file
+}
+
+TEST_CASE("A K Means Tree from a pruned prototype model") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_3, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    SparseKMeansModel prototype(2, 100, true, "kmeans++", dense_sparse_l2_distance);
+    prototype.set_center_pruning(0, 0.99);
+
+    MapPayLoad sbrk(&base, 10);
+    SparseKMeansTree kmst(&sbrk, vecs, prototype, 10);
+
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        kmst.insert(*iter, base.at(*iter), 1.0);
+    }
+
+    auto path = kmst.search_for_path(base.at(0));
+    REQUIRE(path.size() > 1);
+    for (auto iter = path.begin(); iter + 1 != path.end(); iter++) {
+        REQUIRE((*iter)->model->is_pruned());
+        REQUIRE((*iter)->model->get_centers().size() == 0);
+    }
+}
+
+TEST_CASE("Beam search over a K Means Tree") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_3, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    MapPayLoad sbrk(&base, 10);
+    SparseKMeansTree kmst(&sbrk, vecs, 10, 2, 100, true, "kmeans++", dense_sparse_l2_distance);
+
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        kmst.insert(*iter, base.at(*iter), 1.0);
+    }
+
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        auto one = kmst.search_for_leaves(base.at(*iter), 1);
+        REQUIRE(one.size() == 1);
+        REQUIRE(one[0] == kmst.search_for_leaf(base.at(*iter)));
+
+        auto wide = kmst.search_for_leaves(base.at(*iter), 4);
+        REQUIRE(wide.size() >= one.size());
+        REQUIRE(wide[0] == one[0]);
+    }
+}
+
+TEST_CASE("Metrics of a K Means Tree") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_3, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    MapPayLoad sbrk(&base, 10);
+    SparseKMeansTree kmst(&sbrk, vecs, 10, 2, 100, true, "kmeans++", dense_sparse_l2_distance);
+
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        kmst.insert(*iter, base.at(*iter), 1.0);
+    }
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        kmst.search_for_leaf(base.at(*iter));
+    }
+
+    MetricsSnapshot snapshot = kmst.get_metrics();
+#ifdef KMT_METRICS
+    REQUIRE(snapshot.counters[MC_INSERTS] == 60);
+    REQUIRE(snapshot.counters[MC_SEARCHES] == 60);
+    REQUIRE(snapshot.counters[MC_NODES_FITTED] > 0);
+    REQUIRE(snapshot.counters[MC_FIT_ITERATIONS] >= snapshot.counters[MC_NODES_FITTED]);
+    REQUIRE(snapshot.counters[MC_NODES_VISITED] >= 2 * 120);
+    // every visited inner node scores its 2 centers
+    REQUIRE(snapshot.counters[MC_CENTER_DOTS] == 2 * (snapshot.counters[MC_NODES_VISITED] - 120));
+    REQUIRE(snapshot.counters[MC_LEAF_SCANNED] >= 60);
+    REQUIRE(snapshot.count(MH_SEARCH_NS) == 60);
+    REQUIRE(snapshot.count(MH_NODE_FIT_NS) == snapshot.counters[MC_NODES_FITTED]);
+    REQUIRE(snapshot.count(MH_SEEDING_NS) == snapshot.counters[MC_NODES_FITTED]);
+#else
+    REQUIRE(snapshot.counters[MC_SEARCHES] == 0);
+#endif
+
+    kmst.reset_metrics();
+    REQUIRE(kmst.get_metrics().counters[MC_SEARCHES] == 0);
+}
+
+TEST_CASE("Shape and memory statistics of a K Means Tree") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_3, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    MapPayLoad sbrk(&base, 10);
+    SparseKMeansTree kmst(&sbrk, vecs, 10, 2, 100, true, "kmeans++", dense_sparse_l2_distance);
+
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        kmst.insert(*iter, base.at(*iter), 1.0);
+    }
+
+    TreeStats stats = kmst.stats();
+    size_t leaves = 0;
+    for (auto iter = stats.depth_hist.begin(); iter != stats.depth_hist.end(); iter++) {
+        leaves += *iter;
+    }
+    REQUIRE(leaves == stats.leaves);
+    REQUIRE(stats.depth_hist.size() == stats.depth + 1);
+    REQUIRE(stats.fan_out.size() > 0);
+    REQUIRE(stats.fan_out[0] == 2);
+    REQUIRE(stats.nodes == stats.leaves + (stats.leaves - 1));
+    REQUIRE(stats.leaf_min <= stats.leaf_median);
+    REQUIRE(stats.leaf_median <= stats.leaf_max);
+    REQUIRE(stats.leaf_mean == doctest::Approx(60.0 / stats.leaves));
+    REQUIRE(stats.imbalance >= 1);
+    REQUIRE(stats.center_bytes >= (stats.nodes - stats.leaves) * 2 * 2 * sizeof(TSVAL));
+    REQUIRE(stats.payload_bytes >= stats.leaves * sizeof(MapPayLoad));
+    REQUIRE(stats.node_bytes >= stats.nodes * sizeof(KMeansNode));
+}
+
+TEST_CASE("Seeded K Means Tree is reproducible for any thread count") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_3, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+    SparseKMeansModel prototype(2, 100, true, "kmeans++", dense_sparse_l2_distance);
+    prototype.set_seed(99);
+
+    std::vector<std::string> dumps;
+    for (int32_t t = 1; t <= 4; t *= 2) {
+        Executor executor(t);
+        prototype.set_executor(&executor, t);
+        MapPayLoad sbrk(&base, 10);
+        SparseKMeansTree kmst(&sbrk, vecs, prototype, 10);
+        for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+            kmst.insert(*iter, base.at(*iter), 1.0);
+        }
+        dumps.push_back(kmst.to_string() + kmst.stats().to_string());
+    }
+
+    REQUIRE(dumps.size() == 3);
+    REQUIRE(dumps[1] == dumps[0]);
+    REQUIRE(dumps[2] == dumps[0]);
+}
+
+TEST_CASE("A K Means Tree caps the node fits run at once") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_3, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+    Executor executor(4);
+    SparseKMeansModel prototype(2, 100, true, "kmeans++", dense_sparse_l2_distance);
+    prototype.set_seed(5);
+    prototype.set_executor(&executor);
+
+    MapPayLoad sbrk(&base, 10);
+    SparseKMeansTree all(&sbrk, vecs, prototype, 10);
+    prototype.set_parallel_fits(1);
+    SparseKMeansTree one(&sbrk, vecs, prototype, 10);
+    REQUIRE(one.to_string() == all.to_string());
+
+    // one training of at most all the samples, and the segments of every inner node
+    TreeStats stats = one.stats();
+    size_t segments = stats.nodes * 2 * 2 * sizeof(std::vector<const SPVEC*>) + 60 * sizeof(const SPVEC*) * stats.depth;
+    REQUIRE(one.build_peak_bytes() >= prototype.training_bytes(60, 2));
+    REQUIRE(one.build_peak_bytes() <= prototype.training_bytes(60, 2) + segments);
+}
+
+TEST_CASE("A K Means Tree keeps the samples of an unsplittable node in a leaf") {
+    // 20 distinct samples, then 40 copies of one more, which no model can split
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_3, true);
+    std::vector<const SPVEC*> vecs;
+    for (int32_t i = 0; i < 20; i++) {
+        vecs.push_back(&base.at(i));
+    }
+    for (int32_t i = 0; i < 40; i++) {
+        vecs.push_back(&base.at(20));
+    }
+
+    MapPayLoad sbrk(&base, 10);
+    SparseKMeansModel prototype(2, 100, true, "kmeans++", dense_sparse_l2_distance);
+    SparseKMeansTree kmst(&sbrk, vecs, prototype, 10);
+
+    for (int32_t i = 0; i < 21; i++) {
+        REQUIRE(kmst.insert(i, base.at(i), 1.0) != EXK_FAIL);
+    }
+    std::vector<const KMeansNode*> path = kmst.search_for_path(base.at(20));
+    REQUIRE(path.back()->storage.load() != NULL);
+    REQUIRE(path.back()->model == NULL);
+}
+
+TEST_CASE("Adaptive branching factor of a K Means Tree") {
+    REQUIRE(fixed_node_k(1500, 1000, 100) == 100);
+    REQUIRE(balanced_node_k(1500, 1000, 100) == 2);
+    REQUIRE(balanced_node_k(10000000, 1000, 100) == 100);
+    REQUIRE(balanced_node_k(200000, 1000, 100) == 15);
+    REQUIRE(balanced_node_k(60, 10, 8) == 6);
+
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_3, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    SparseKMeansModel prototype(8, 100, true, "kmeans++", dense_sparse_l2_distance);
+    prototype.set_node_k(balanced_node_k);
+    REQUIRE(prototype.node_k(60, 10, 0) == 6);
+    REQUIRE(prototype.set_k(9) == EXK_FAIL);
+
+    MapPayLoad sbrk(&base, 10);
+    SparseKMeansTree kmst(&sbrk, vecs, prototype, 10);
+    TreeStats stats = kmst.stats();
+    REQUIRE(stats.fan_out[0] == 6);
+
+    std::vector<size_t> caps(1, 3);
+    prototype.set_node_k(balanced_node_k, caps);
+    REQUIRE(prototype.node_k(60, 10, 0) == 3);
+    REQUIRE(prototype.node_k(20, 10, 1) == 2);
+
+    MapPayLoad capped_sbrk(&base, 10);
+    SparseKMeansTree capped(&capped_sbrk, vecs, prototype, 10);
+    REQUIRE(capped.stats().fan_out[0] == 3);
+}
+
+TEST_CASE("Refresh build of a K Means Tree from a previous one") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_3, true);
+    std::vector<int32_t> ids;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    SparseKMeansModel prototype(2, 100, true, "kmeans++", dense_sparse_l2_distance);
+    MapPayLoad sbrk(&base, 10);
+    SparseKMeansTree previous(&sbrk, vecs, prototype, 10);
+
+    // the same samples under another seed, every node starts from its converged centers
+    prototype.set_seed(7);
+    MapPayLoad refreshed_sbrk(&base, 10);
+    SparseKMeansTree refreshed(&refreshed_sbrk, vecs, prototype, previous, 10);
+    REQUIRE(refreshed.to_string() == previous.to_string());
+
+#ifdef KMT_METRICS
+    MetricsSnapshot before = previous.get_metrics();
+    MetricsSnapshot after = refreshed.get_metrics();
+    REQUIRE(after.counters[MC_NODES_FITTED] == before.counters[MC_NODES_FITTED]);
+    REQUIRE(after.counters[MC_FIT_ITERATIONS] <= 2 * after.counters[MC_NODES_FITTED]);
+#endif
+
+    // centers of another k or dimension are not reused, the nodes are seeded
+    SparseKMeansModel wider(3, 100, true, "kmeans++", dense_sparse_l2_distance);
+    wider.set_seed(7);
+    MapPayLoad fresh_sbrk(&base, 10);
+    SparseKMeansTree fresh(&fresh_sbrk, vecs, wider, 10);
+    MapPayLoad wider_sbrk(&base, 10);
+    SparseKMeansTree rekeyed(&wider_sbrk, vecs, wider, previous, 10);
+    REQUIRE(rekeyed.to_string() == fresh.to_string());
+
+    VectorBase base3("../data/kmeans_3.jsonl", 3, parse_xy_3, true);
+    std::vector<const SPVEC*> vecs3 = base3.get_vectors(ids);
+    MapPayLoad fresh3_sbrk(&base3, 10);
+    SparseKMeansTree fresh3(&fresh3_sbrk, vecs3, prototype, 10);
+    MapPayLoad moved_sbrk(&base3, 10);
+    SparseKMeansTree moved(&moved_sbrk, vecs3, prototype, previous, 10);
+    REQUIRE(moved.to_string() == fresh3.to_string());
+    REQUIRE(moved.stats().leaves == fresh3.stats().leaves);
+}
+
+TEST_CASE("A K Means Tree from weighted samples") {
+    VectorBase base("../data/kmeans_3.jsonl", 2, parse_xy_3, true);
+    std::vector<int32_t> ids;
+    std::vector<TSVAL> weights;
+    for (int32_t i = 0; i < 60; i++) {
+        ids.push_back(i);
+        weights.push_back(i < 10 ? 50 : 1);
+    }
+    std::vector<const SPVEC*> vecs = base.get_vectors(ids);
+
+    SparseKMeansModel prototype(2, 100, true, "kmeans++", dense_sparse_l2_distance);
+    MapPayLoad sbrk(&base, 10);
+    SparseKMeansTree kmst(&sbrk, vecs, prototype, 10, &weights);
+    for (auto iter = ids.begin(); iter != ids.end(); iter++) {
+        REQUIRE(kmst.insert(*iter, base.at(*iter), weights[*iter]) == EXK_SUC);
+    }
+
+    TreeStats stats = kmst.stats();
+    REQUIRE(stats.leaf_mean == doctest::Approx(60.0 / stats.leaves));
+    REQUIRE(stats.fan_out[0] == 2);
+}
@@ -0,0 +1,70 @@
+#include "doctest.h"
+#include "vector_base.hpp"
+
+TEST_CASE("Exact dedup of a vector base") {
+    VectorBase base;
+    for (int32_t i = 0; i < 30; i++) {
+        SPVEC v(100);
+        v(i % 10) = 1;
+        v(50 + i % 10) = 2;
+        base.insert(i, v);
+    }
+    // equal indices, other value
+    SPVEC other(100);
+    other(0) = 1;
+    other(50) = 3;
+    base.insert(30, other);
+
+    REQUIRE(base.dedup() == 20);
+    REQUIRE(base.size() == 11);
+    REQUIRE(base.representative(13) == 3);
+    REQUIRE(base.representative(3) == 3);
+    REQUIRE(base.representative(30) == 30);
+    REQUIRE(base.multiplicity(3) == 3);
+    REQUIRE(base.multiplicity(30) == 1);
+    REQUIRE(base.duplicates(3) == std::vector<int32_t>({13, 23}));
+    REQUIRE(base.at(23)(53) == 2);
+
+    std::vector<int32_t> ids = {0, 1, 30};
+    REQUIRE(base.multiplicities(ids) == std::vector<TSVAL>({3, 3, 1}));
+
+    // merged ids resolve to their representative
+    std::vector<int32_t> merged = {13, 23, 30};
+    std::vector<const SPVEC*> vecs = base.get_vectors(merged);
+    REQUIRE(vecs[0] == &base.at(3));
+    REQUIRE(vecs[1] == &base.at(3));
+    REQUIRE(vecs[2] == &base.at(30));
+    std::vector<SPVEC> exported = base.export_vectors(merged);
+    REQUIRE(exported[1](53) == 2);
+    REQUIRE(exported[2](50) == 3);
+
+    // a second pass finds nothing more
+    REQUIRE(base.dedup() == 0);
+}
+
+TEST_CASE("Near duplicate dedup of a vector base with SimHash") {
+    VectorBase base;
+    srand(23);
+    std::vector<SPVEC> originals;
+    for (int32_t i = 0; i < 20; i++) {
+        SPVEC v(1000);
+        for (int32_t j = 0; j < 40; j++) {
+            v(rand() % 1000) = 1 + rand() % 10;
+        }
+        originals.push_back(v);
+        base.insert(i, v);
+    }
+    // slightly perturbed copies
+    for (int32_t i = 0; i < 20; i++) {
+        SPVEC v = originals[i];
+        auto iter = v.begin();
+        *iter = *iter * 1.01;
+        base.insert(100 + i, v);
+    }
+
+    REQUIRE(__builtin_popcountll(VectorBase::simhash(originals[0]) ^ VectorBase::simhash(base.at(100))) <= 3);
+    REQUIRE(base.dedup(DEDUP_SIMHASH, 3) >= 18);
+    REQUIRE(base.size() <= 22);
+    REQUIRE(base.representative(100) == 0);
+    REQUIRE(base.multiplicity(0) >= 2);
+}